@@ -131,6 +131,11 @@
  */
 #define TRY_DENSE_HEAP_START (void *)0x800000000
 
+/*
+ * Size of a transparent huge page, for a heap backed by them
+ */
+#define HUGE_PAGE_SIZE (1 << 21) /* 2 MB */
+
 /*********** Parameters controlling sparse memory version of heap ***********/
 
 /*
@@ -149,9 +154,9 @@
 #define SPARSE_PAGE_SIZE (1 << 10)
 
 /*
- * Maximum target load for hash table
+ * Number of page ID bits resolved by each level of the page table
  */
-#define HASH_LOAD 10.0
+#define RADIX_BITS 8
 
 /***************** Parameters for looking up reference throughput *********/
 /*
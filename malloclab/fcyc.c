@@ -1,10 +1,20 @@
 /* Compute time used by function f */
 
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/times.h>
 
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #include "clock.h"
 #include "fcyc.h"
 
@@ -32,6 +42,13 @@ static unsigned long int *cache_buf = NULL;
 static double *values = NULL;
 static unsigned long int samplecount = 0;
 
+/* Hardware event counters */
+static bool use_counters = false;
+static bool counters_opened = false;
+static int counter_fd[FC_NUM_COUNTERS];
+static double sample_counts[FC_NUM_COUNTERS]; /* Of the last sample */
+static double best_counts[FC_NUM_COUNTERS];   /* Of the fastest sample */
+
 #define KEEP_VALS 0
 #define KEEP_SAMPLES 0
 
@@ -57,6 +74,8 @@ static void init_sampler(void) {
     samples = calloc(maxsamples + kbest, sizeof(double));
 #endif
     samplecount = 0;
+    for (int i = 0; i < FC_NUM_COUNTERS; i++)
+        best_counts[i] = -1.0;
 }
 
 /* Add new sample.  */
@@ -88,6 +107,103 @@ static unsigned long int has_converged(void) {
            ((1 + epsilon) * values[0] >= values[kbest - 1]);
 }
 
+/* Code to count hardware events */
+
+#ifdef __linux__
+/* Open the counters of the calling thread, disabled.  Those the system
+   does not have stay at -1 */
+static void open_counters(void) {
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[FC_NUM_COUNTERS] = {
+        [FC_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        [FC_L1D_MISSES] = {PERF_TYPE_HW_CACHE,
+                           PERF_COUNT_HW_CACHE_L1D |
+                               (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        [FC_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        [FC_DTLB_MISSES] = {PERF_TYPE_HW_CACHE,
+                            PERF_COUNT_HW_CACHE_DTLB |
+                                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        [FC_BRANCH_MISSES] = {PERF_TYPE_HARDWARE,
+                              PERF_COUNT_HW_BRANCH_MISSES},
+    };
+    int err = 0;
+    bool any = false;
+
+    for (int i = 0; i < FC_NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        /* The kernel may multiplex the counters; scale by these */
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counter_fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counter_fd[i] < 0)
+            err = errno;
+        else
+            any = true;
+    }
+    if (!any)
+        fprintf(stderr, "Warning: hardware counters unavailable (%s)\n",
+                strerror(err));
+    counters_opened = true;
+}
+
+/* Reset and enable the counters */
+static void start_counters(void) {
+    if (!counters_opened)
+        open_counters();
+    for (int i = 0; i < FC_NUM_COUNTERS; i++) {
+        if (counter_fd[i] >= 0) {
+            ioctl(counter_fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counter_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+/* Disable the counters and store their values, divided by reps, into
+   sample_counts */
+static void stop_counters(unsigned long reps) {
+    for (int i = 0; i < FC_NUM_COUNTERS; i++) {
+        if (counter_fd[i] >= 0)
+            ioctl(counter_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (int i = 0; i < FC_NUM_COUNTERS; i++) {
+        uint64_t buf[3]; /* value, time enabled, time running */
+        sample_counts[i] = -1.0;
+        if (counter_fd[i] < 0 ||
+            read(counter_fd[i], buf, sizeof(buf)) != (ssize_t)sizeof(buf) ||
+            buf[2] == 0)
+            continue;
+        sample_counts[i] = (double)buf[0] * ((double)buf[1] / (double)buf[2]) /
+                           (double)reps;
+    }
+}
+#else
+static void start_counters(void) {
+}
+
+static void stop_counters(unsigned long reps) {
+    (void)reps;
+    for (int i = 0; i < FC_NUM_COUNTERS; i++)
+        sample_counts[i] = -1.0;
+}
+#endif
+
+/* Keep the counts of the sample if it is the fastest so far */
+static void add_counts(double val) {
+    if (samplecount == 0 || val < values[0])
+        memcpy(best_counts, sample_counts, sizeof(best_counts));
+}
+
 /* Code to clear cache */
 
 static volatile unsigned long int sink = 0;
@@ -136,11 +252,18 @@ double fcyc(test_funct f, void *args) {
     do {
         if (clear_cache)
             clear();
+        if (use_counters)
+            start_counters();
         start_counter();
         for (r = 0; r < reps; r++) {
             f(args);
         }
         cyc = (double)get_counter() / (double)reps;
+        if (use_counters) {
+            stop_counters(reps);
+            if (cyc > 0.0)
+                add_counts(cyc);
+        }
         if (cyc > 0.0)
             add_sample(cyc);
     } while (!has_converged() && samplecount < maxsamples);
@@ -176,11 +299,18 @@ double fsec(test_funct f, void *args) {
     do {
         if (clear_cache)
             clear();
+        if (use_counters)
+            start_counters();
         start_timer();
         for (r = 0; r < reps; r++) {
             f(args);
         }
         sec = get_timer() / (double)reps;
+        if (use_counters) {
+            stop_counters(reps);
+            if (sec > 0.0)
+                add_counts(sec);
+        }
         //        printf(" %.3f", sec * 1e6);
         if (sec > 0.0)
             add_sample(sec);
@@ -255,3 +385,21 @@ void set_fcyc_maxsamples(unsigned long int maxsamples_arg) {
 void set_fcyc_epsilon(double epsilon_arg) {
     epsilon = epsilon_arg;
 }
+
+/* When set, will count hardware events with perf_event_open
+   Default = false
+*/
+void set_fcyc_counters(bool count) {
+    use_counters = count;
+}
+
+/* Get the events per call in the fastest sample of the last measurement */
+bool fcyc_get_counters(double counts[FC_NUM_COUNTERS]) {
+    bool any = false;
+    for (int i = 0; i < FC_NUM_COUNTERS; i++) {
+        counts[i] = use_counters ? best_counts[i] : -1.0;
+        if (counts[i] >= 0.0)
+            any = true;
+    }
+    return any;
+}
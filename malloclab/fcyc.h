@@ -62,4 +62,26 @@ void set_fcyc_maxsamples(unsigned long int maxsamples);
 */
 void set_fcyc_epsilon(double epsilon);
 
+/* Hardware events that can be counted while the function runs */
+typedef enum {
+    FC_INSTRUCTIONS,
+    FC_L1D_MISSES,
+    FC_LLC_MISSES,
+    FC_DTLB_MISSES,
+    FC_BRANCH_MISSES,
+    FC_NUM_COUNTERS
+} fcyc_counter_t;
+
+/* When set, will count hardware events with perf_event_open, if the
+   system allows it
+   Default = false
+*/
+void set_fcyc_counters(bool count);
+
+/* Get the events per call of the function in the fastest sample of the
+   last fcyc or fsec.  An event that could not be counted is set to -1.
+   Returns false if no event was counted.
+*/
+bool fcyc_get_counters(double counts[FC_NUM_COUNTERS]);
+
 #endif /* fcyc.h */
@@ -10,15 +10,23 @@
 #define _XOPEN_SOURCE 700
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
+#include <inttypes.h>
+#include <malloc.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -26,10 +34,14 @@
 #include <sanitizer/msan_interface.h>
 #endif
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 #include "config.h"
 #include "fcyc.h"
 #include "memlib.h"
-#include "mm.h"
+#include "mm-backend.h"
 #include "stree.h"
 
 /**********************
@@ -39,6 +51,19 @@
 /* Misc */
 #define MAXLINE 1024 /* max string size */
 #define HDRLINES 4   /* number of header lines in a trace file */
+#define BATCH_MAX 64 /* most ops replayed in one batch call */
+#define PAR_REPS 5   /* runs of a parallel replay, the fastest one counts */
+#define LAT_TYPES 3  /* malloc (and aligned_alloc), free, realloc */
+#define LAT_SIZES 8  /* request size classes: <=16, <=64, ... <=64K, more */
+#define LAT_BUCKETS 48 /* log2 buckets of the cycles of an op */
+#define LAT_WORST 10   /* slowest ops kept per trace */
+#define BTRACE_MAGIC "MMTRACE1" /* first bytes of a binary trace file */
+#define PROFILE_OUT "heap-profile.csv" /* default file of the heap profile */
+#define GATE_UTIL_SLACK 0.005 /* utilization a trace may lose to a baseline */
+#define GATE_TPUT_SLACK 0.10  /* share of throughput it may lose, advisory */
+#define NUM_BACKENDS 5 /* allocators mdriver is linked with */
+#define LIBC_BACKEND 4 /* index of libc malloc among them */
+#define CONCURRENT_BACKEND 1 /* and of mm.c built with MM_CONCURRENT */
 #define LINENUM(i)                                                             \
     (i + HDRLINES + 1) /* cnvt trace request nums to linenums (origin 1) */
 
@@ -84,11 +109,19 @@ typedef struct {
     tree_t *lo_tree;
 } range_set_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/* Types of trace operations */
+typedef enum { ALLOC, FREE, REALLOC, ALIGNED_ALLOC } optype_t;
+
+/*
+ * Characterizes a single trace operation (allocator request). Packed into
+ * 16 bytes, since binary trace files store it as is.
+ */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
-    unsigned int index;                 /* index for free() to use later */
-    size_t size;                        /* byte size of alloc/realloc request */
+    size_t size;        /* byte size of alloc/realloc request */
+    unsigned int index; /* index for free() to use later */
+    uint8_t type;       /* type of request, an optype_t */
+    uint8_t align_log;  /* log2 of the alignment of an aligned alloc */
+    uint16_t run;       /* ops in the batch starting here, if -b */
 } traceop_t;
 
 /* Holds the information for one trace file */
@@ -102,8 +135,25 @@ typedef struct {
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     size_t *block_rand_base; /* index into random_data, if debug is on */
+    void **batch;            /* scratch array for the batch replay, if -b */
+    void *map;     /* mapping of a binary trace file, ops point into it */
+    size_t map_len;
 } trace_t;
 
+/*
+ * Header of a binary trace file. It is followed by the num_ops requests,
+ * stored as traceop_t so that they can be mapped in place. op_size guards
+ * against files written by an mdriver with another traceop_t.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t op_size;
+    uint32_t weight;
+    uint32_t num_ids;
+    uint32_t num_ops;
+    uint64_t data_bytes;
+} btrace_header_t;
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -114,6 +164,43 @@ typedef struct {
     range_set_t *ranges;
 } speed_t;
 
+/*
+ * Holds a trace split across the threads of a parallel replay. Every thread
+ * replays its ops in trace order, and an op waits until the earlier ops on
+ * the same id, maybe replayed by other threads, are done.
+ */
+typedef struct {
+    trace_t *trace;
+    unsigned int num_threads;
+    unsigned int **thread_ops; /* opnums replayed by each thread... */
+    unsigned int *num_thread_ops; /* ... and how many of them */
+    unsigned int *seq;        /* number of earlier ops on the same id */
+    atomic_uint *done;        /* number of ops done on each id */
+    pthread_barrier_t start;  /* releases the threads together */
+} par_t;
+
+/* Holds the params to par_replay, which runs on its own thread */
+typedef struct {
+    par_t *par;
+    unsigned int thread;
+} par_thread_t;
+
+/* One timed op of a trace */
+typedef struct {
+    unsigned int opnum;
+    unsigned int type; /* index into the LAT_TYPES */
+    size_t size;       /* request size, or size of the freed block */
+    uint64_t cycles;
+} lat_op_t;
+
+/* Latency histograms of the ops of a trace, by op type and size class */
+typedef struct {
+    uint64_t hist[LAT_TYPES][LAT_SIZES][LAT_BUCKETS];
+    uint64_t max[LAT_TYPES][LAT_SIZES];
+    lat_op_t worst[LAT_WORST]; /* slowest ops, slowest first */
+    unsigned int num_worst;
+} latency_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -121,13 +208,27 @@ typedef struct {
     weight_t weight;
     double ops; /* number of ops (malloc/free/realloc) in the trace */
 
-    /* run-time stats defined for both libc and student */
+    /* run-time stats defined for every allocator */
     bool valid;  /* was the trace processed correctly by the allocator? */
     double secs; /* number of secs needed to run the trace */
     double tput; /* throughput for this trace in Kops/s */
 
-    /* defined only for the student malloc package */
+    /* defined only for the allocators with an emulated heap */
     double util; /* space utilization for this trace (always 0 for libc) */
+    double realloc_bytes; /* bytes a copying realloc would have moved */
+    double realloc_saved; /* ... of which not copied, the block was kept */
+    double peak_heap;      /* highest heap size, in bytes */
+    double peak_resident;  /* highest sampled resident heap size, in bytes */
+    double final_heap;     /* heap size at the end of the trace */
+    double final_resident; /* resident heap size at the end of the trace */
+    double batched_ops;    /* ops replayed through the batch interface */
+    double batch_secs;     /* number of secs needed to replay them so */
+    double par1_secs;  /* secs of the parallel replay on a single thread */
+    double par_secs;   /* secs of the parallel replay, ids split by thread */
+    double xfree_secs; /* ... and with every block freed by another thread */
+    latency_t *latency; /* per-op latencies, if -L */
+    bool counted;       /* were hardware events counted, if -e? */
+    double counters[FC_NUM_COUNTERS]; /* events per replay, -1 if not */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -166,6 +267,21 @@ int verbose = REF_ONLY ? 0 : 1; /* global flag for verbose output */
 static int errors = 0; /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false; /* Print output as tab-separated fields */
+static bool batch_mode = false; /* Also replay through the batch interface */
+static unsigned int par_threads = 0; /* Also replay on this many threads */
+static bool latency_mode = false; /* Also time every op of a replay */
+static bool counters_mode = false; /* Also count hardware events */
+static unsigned int profile_every = 0; /* Sample the heap every that many ops */
+static const char *profile_out = PROFILE_OUT; /* CSV of the heap samples */
+static FILE *profile_file = NULL;
+static char *binary_out = NULL; /* Write the trace as a binary trace here */
+static const mm_backend_t *backend = &mm_backend; /* Allocator being run */
+static bool run_backend[NUM_BACKENDS] = {true}; /* Allocators to run */
+static const char *baseline_in = NULL;  /* Check the results against these */
+static const char *baseline_out = NULL; /* Save the results as baselines */
+/* Serializes the calls of a parallel replay to an allocator that is not
+   thread-safe */
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
@@ -196,9 +312,8 @@ static char **global_tracefiles = NULL;
 
 static char autoresult[MAXLINE]; /* autoresult string */
 
-/* Summary statistics for libc and student's mm.c submissions */
-static sum_stats_t global_libc_sum_stats;
-static sum_stats_t global_mm_sum_stats;
+/* Summary statistics for each allocator */
+static sum_stats_t global_sum_stats[NUM_BACKENDS];
 
 /* Performance statistics for driver */
 
@@ -226,21 +341,58 @@ static void randomize_block(trace_t *trace, unsigned int index);
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
+static bool map_trace(trace_t *trace, int fd);
+static size_t op_align(const traceop_t *op);
+static void write_trace(const trace_t *trace, const char *filename);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
-/* Routines for evaluating the correctness and speed of libc malloc */
-static bool eval_libc_valid(trace_t *trace);
-static void eval_libc_speed(void *ptr);
+/* The libc malloc package as an allocator for mdriver */
+static bool libc_init(void);
+static size_t libc_usable_size(void *ptr);
+static size_t libc_malloc_batch(size_t size, size_t n, void **out);
+static void libc_free_sized(void *ptr, size_t size);
+static void libc_free_batch(void **ptrs, size_t n);
+static bool libc_checkheap(int line);
+static bool libc_profile(mm_profile_t *prof);
+
+/* Routines for choosing the allocators to run and comparing them */
+static void select_backends(const char *list);
+static void print_backend_stats(size_t n, stats_t *const *all_stats);
+static const char *trace_name(const char *filename);
+static void write_baselines(const char *filename, size_t n,
+                            stats_t *const *all_stats);
+static bool check_baselines(const char *filename, size_t n,
+                            stats_t *const *all_stats);
+
+/* Routines for replaying a trace on many threads */
+static par_t *new_par(trace_t *trace, unsigned int num_threads, bool cross);
+static void free_par(par_t *par);
+static void *par_replay(void *ptr);
+static double eval_par_speed(par_t *par);
+static void eval_par(trace_t *trace, stats_t *stats);
 
 /* Routines for evaluating correctnes, space utilization, and speed
-   of the student's malloc package in mm.c */
+   of an allocator, called through backend */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, size_t tracenum);
+static double eval_mm_util(trace_t *trace, size_t tracenum, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static bool eval_mm_batch(trace_t *trace, range_set_t *ranges,
+                          size_t *batched);
+static void eval_mm_speed_batch(void *ptr);
+static void eval_mm_latency(trace_t *trace, latency_t *lat);
+static void eval_mm_profile(trace_t *trace);
+static bool write_profile(const trace_t *trace, unsigned int opnum,
+                          size_t payload);
 
 /* Various helper routines */
 static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats);
+static void print_realloc_stats(size_t n, const stats_t *stats);
+static void print_footprint_stats(size_t n, const stats_t *stats);
+static void print_batch_stats(size_t n, const stats_t *stats);
+static void print_par_stats(size_t n, stats_t *const *all_stats);
+static void print_latency_stats(size_t n, const stats_t *stats);
+static void print_counter_stats(size_t n, const stats_t *stats);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, unsigned int opnum,
                          const char *fmt, ...)
@@ -251,6 +403,37 @@ static void app_error(const char *fmt, ...)
     __attribute__((format(printf, 1, 2), noreturn));
 static double compute_scaled_score(double value, double min, double max);
 
+/* The other allocators, built with MM_NAMESPACE */
+extern const mm_backend_t concurrent_mm_backend;
+extern const mm_backend_t splay_mm_backend;
+extern const mm_backend_t naive_mm_backend;
+
+static const mm_backend_t libc_backend = {
+    .name = "libc",
+    .emulated = false,
+    .thread_safe = true,
+    .init = libc_init,
+    .malloc = malloc,
+    .free = free,
+    .realloc = realloc,
+    .aligned_alloc = aligned_alloc,
+    .usable_size = libc_usable_size,
+    .malloc_batch = libc_malloc_batch,
+    .free_sized = libc_free_sized,
+    .free_batch = libc_free_batch,
+    .checkheap = libc_checkheap,
+    .profile = libc_profile,
+};
+
+/* The allocators mdriver can run, mm.c first: it is the one graded */
+static const mm_backend_t *const backends[NUM_BACKENDS] = {
+    &mm_backend,
+    &concurrent_mm_backend,
+    &splay_mm_backend,
+    &naive_mm_backend,
+    &libc_backend,
+};
+
 static sigjmp_buf timeout_jmpbuf;
 
 /* Timeout signal handler */
@@ -269,11 +452,12 @@ static double measure_ref_throughput(bool checkpoint);
  * num_tracefiles, if there's a timeout)
  */
 static void run_tests(size_t num_tracefiles, const char *tracedir,
-                      char **tracefiles, stats_t *mm_stats,
-                      speed_t *speed_params) {
+                      char **tracefiles, const mm_backend_t *be,
+                      stats_t *mm_stats, speed_t *speed_params) {
     volatile size_t i;
     range_set_t *volatile ranges = 0;
 
+    backend = be;
     for (i = 0; i < num_tracefiles; i++) {
         /* initialize simulated memory system in memlib.c *
          * start each trace with a clean system */
@@ -292,7 +476,7 @@ static void run_tests(size_t num_tracefiles, const char *tracedir,
             mm_stats[i].valid = false;
         } else {
             if (verbose > 1)
-                printf("Checking mm_malloc for correctness");
+                printf("Checking %s for correctness", backend->name);
             mm_stats[i].valid =
                 /* Do 2 tests, since may fail to reinitialize properly */
                 eval_mm_valid(trace, ranges);
@@ -302,6 +486,22 @@ static void run_tests(size_t num_tracefiles, const char *tracedir,
             mm_stats[i].valid =
                 mm_stats[i].valid && eval_mm_valid(trace, ranges);
 
+            if (batch_mode && mm_stats[i].valid) {
+                size_t batched;
+                if (verbose > 1)
+                    printf(", batch replay");
+                free_range_set(ranges);
+                ranges = new_range_set();
+                mm_stats[i].valid = eval_mm_batch(trace, ranges, &batched);
+                mm_stats[i].batched_ops = (double)batched;
+            }
+
+            if (profile_every > 0 && mm_stats[i].valid) {
+                if (verbose > 1)
+                    printf(", heap profile");
+                eval_mm_profile(trace);
+            }
+
             if (onetime_flag) {
                 if (verbose > 1)
                     puts(".");
@@ -312,16 +512,33 @@ static void run_tests(size_t num_tracefiles, const char *tracedir,
         }
 #if !defined DEBUG && !defined USE_ASAN && !defined USE_MSAN
         if (mm_stats[i].valid) {
-            if (verbose > 1)
-                printf(", efficiency");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            if (backend->emulated) {
+                if (verbose > 1)
+                    printf(", efficiency");
+                mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
+            }
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
                 printf(", and performance");
             mm_stats[i].secs =
                 sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
+            if (counters_mode && !sparse_mode)
+                mm_stats[i].counted = fcyc_get_counters(mm_stats[i].counters);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+            if (batch_mode)
+                mm_stats[i].batch_secs =
+                    sparse_mode ? 1.0 : fsec(eval_mm_speed_batch, speed_params);
+            if (par_threads > 0 && !sparse_mode)
+                eval_par(trace, &mm_stats[i]);
+            if (latency_mode && !sparse_mode) {
+                if (verbose > 1)
+                    printf(", latency");
+                mm_stats[i].latency = calloc(1, sizeof(latency_t));
+                if (mm_stats[i].latency == NULL)
+                    unix_error("latency calloc in run_tests failed");
+                eval_mm_latency(trace, mm_stats[i].latency);
+            }
         }
 #endif
         if (verbose > 0)
@@ -349,11 +566,11 @@ int main(int argc, char **argv) {
     global_tracefiles = NULL;  /* array of trace file names */
     num_global_tracefiles = 0; /* the number of traces in that array */
 
-    stats_t *libc_stats = NULL; /* libc stats for each trace */
-    stats_t *mm_stats = NULL;   /* mm (i.e. student) stats for each trace */
-    speed_t speed_params;       /* input parameters to the xx_speed routines */
+    /* stats of each allocator for each trace */
+    stats_t *all_stats[NUM_BACKENDS] = {NULL};
+    stats_t *mm_stats = NULL; /* mm (i.e. student) stats for each trace */
+    speed_t speed_params;     /* input parameters to the xx_speed routines */
 
-    bool run_libc = false;   /* If set, run libc malloc (set by -l) */
     bool autograder = false; /* if set then called by autograder (-A) */
     bool checkpoint = false;
 
@@ -369,7 +586,8 @@ int main(int argc, char **argv) {
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF) {
+    while ((c = getopt(argc, argv,
+                       "a:d:f:c:g:G:s:t:v:P:w:H:o:hpCOVAlDTbLeM")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -401,7 +619,19 @@ int main(int argc, char **argv) {
             break;
 
         case 'l': /* Run libc malloc */
-            run_libc = true;
+            run_backend[LIBC_BACKEND] = true;
+            break;
+
+        case 'a': /* Also run these allocators */
+            select_backends(optarg);
+            break;
+
+        case 'g': /* Check the results against baselines */
+            baseline_in = optarg;
+            break;
+
+        case 'G': /* Save the results as baselines */
+            baseline_out = optarg;
             break;
 
         case 'V': /* Increase verbosity level */
@@ -428,6 +658,39 @@ int main(int argc, char **argv) {
             tab_mode = true;
             break;
 
+        case 'b':
+            batch_mode = true;
+            break;
+
+        case 'P': /* Also replay each trace on that many threads */
+            par_threads = (unsigned int)atoi(optarg);
+            break;
+
+        case 'L': /* Also time every op */
+            latency_mode = true;
+            break;
+
+        case 'e': /* Also count hardware events */
+            counters_mode = true;
+            set_fcyc_counters(true);
+            break;
+
+        case 'M': /* Back the dense heap by huge pages */
+            mem_use_huge_pages(true);
+            break;
+
+        case 'w': /* Convert the trace to a binary trace */
+            binary_out = optarg;
+            break;
+
+        case 'H': /* Sample the heap every that many ops */
+            profile_every = (unsigned int)atoi(optarg);
+            break;
+
+        case 'o': /* File of the heap profile */
+            profile_out = optarg;
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -439,9 +702,13 @@ int main(int argc, char **argv) {
     }
 #endif /* !REF_ONLY */
 
+    /* A serialized mm cannot scale, so -P also runs its concurrent build */
+    if (par_threads > 0 && !backends[0]->thread_safe)
+        run_backend[CONCURRENT_BACKEND] = true;
+
     if (num_global_tracefiles == 0) {
         int i;
-        if (sparse_mode & !run_libc) {
+        if (sparse_mode && !run_backend[LIBC_BACKEND]) {
             for (i = 0; default_giant_tracefiles[i]; i++)
                 add_tracefile(default_giant_tracefiles[i]);
         }
@@ -449,10 +716,24 @@ int main(int argc, char **argv) {
             add_tracefile(default_tracefiles[i]);
     }
 
+    /* Optionally convert a trace to the binary format and stop */
+    if (binary_out != NULL) {
+        stats_t stats;
+        if (num_global_tracefiles != 1)
+            app_error("-w needs exactly one trace, given with -f");
+        trace_t *trace = read_trace(&stats, tracedir, global_tracefiles[0]);
+        write_trace(trace, binary_out);
+        free_trace(trace);
+        exit(0);
+    }
+
     if (debug_mode != DBG_NONE) {
         init_random_data();
     }
 
+    if (profile_every > 0 && (profile_file = fopen(profile_out, "w")) == NULL)
+        unix_error("Could not open %s", profile_out);
+
     /* Initialize the timeout */
     if (set_timeout > 0) {
         signal(SIGALRM, timeout_handler);
@@ -460,42 +741,33 @@ int main(int argc, char **argv) {
     }
 
     /*
-     * Optionally run and evaluate the libc malloc package
+     * Optionally run and evaluate the other allocators
      */
-    if (run_libc) {
+    for (size_t b = 1; b < NUM_BACKENDS; b++) {
+        if (!run_backend[b] || onetime_flag)
+            continue;
         if (verbose > 1)
-            printf("\nTesting libc malloc\n");
+            printf("\nTesting %s malloc\n", backends[b]->name);
 
-        /* Allocate libc stats array, with one stats_t struct per tracefile */
-        libc_stats = (stats_t *)calloc(num_global_tracefiles, sizeof(stats_t));
-        if (libc_stats == NULL)
-            unix_error("libc_stats calloc in main failed");
+        /* Allocate its stats array, with one stats_t struct per tracefile */
+        all_stats[b] =
+            (stats_t *)calloc(num_global_tracefiles, sizeof(stats_t));
+        if (all_stats[b] == NULL)
+            unix_error("stats calloc in main failed");
 
-        /* Evaluate the libc malloc package using the K-best scheme */
-        for (size_t i = 0; i < num_global_tracefiles; i++) {
-            trace_t *trace =
-                read_trace(&libc_stats[i], tracedir, global_tracefiles[i]);
-
-            if (verbose > 1)
-                printf("Checking libc malloc for correctness, ");
-            libc_stats[i].valid = eval_libc_valid(trace);
-            if (libc_stats[i].valid) {
-                speed_params.trace = trace;
-                if (verbose > 1)
-                    printf("and performance.\n");
-                libc_stats[i].secs = fsec(eval_libc_speed, &speed_params);
-            }
-            free_trace(trace);
-        }
+        errors = 0; /* the errors of this allocator only */
+        run_tests(num_global_tracefiles, tracedir, global_tracefiles,
+                  backends[b], all_stats[b], &speed_params);
 
-        /* Display the libc results in a compact table and return the
-           summary statistics */
+        /* Display its results in a compact table and return the summary
+           statistics */
         if (verbose) {
-            printf("\nResults for libc malloc:\n");
-            printresults(num_global_tracefiles, libc_stats,
-                         &global_libc_sum_stats);
+            printf("\nResults for %s malloc:\n", backends[b]->name);
+            printresults(num_global_tracefiles, all_stats[b],
+                         &global_sum_stats[b]);
         }
     }
+    errors = 0; /* only the errors of mm are counted */
 
 #if !REF_ONLY
     /*
@@ -525,9 +797,10 @@ int main(int argc, char **argv) {
     mm_stats = (stats_t *)calloc(num_global_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
+    all_stats[0] = mm_stats;
 
-    run_tests(num_global_tracefiles, tracedir, global_tracefiles, mm_stats,
-              &speed_params);
+    run_tests(num_global_tracefiles, tracedir, global_tracefiles,
+              backends[0], mm_stats, &speed_params);
 
     /* Display the mm results in a compact table */
     if (verbose) {
@@ -543,18 +816,45 @@ int main(int argc, char **argv) {
             }
         } else {
             printf("\nResults for mm malloc:\n");
-            printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
+            printresults(num_global_tracefiles, mm_stats, &global_sum_stats[0]);
             printf("\n");
+            if (!tab_mode) {
+                print_realloc_stats(num_global_tracefiles, mm_stats);
+                print_footprint_stats(num_global_tracefiles, mm_stats);
+                if (batch_mode)
+                    print_batch_stats(num_global_tracefiles, mm_stats);
+                if (par_threads > 0 && !sparse_mode)
+                    print_par_stats(num_global_tracefiles, all_stats);
+                if (latency_mode && !sparse_mode)
+                    print_latency_stats(num_global_tracefiles, mm_stats);
+            }
         }
     }
 
+    /* Optionally compare the allocators */
+    bool regressed = false;
+    if (!onetime_flag) {
+        size_t num_run = 0;
+        for (size_t b = 0; b < NUM_BACKENDS; b++)
+            num_run += run_backend[b];
+        if (verbose && !tab_mode && num_run > 1)
+            print_backend_stats(num_global_tracefiles, all_stats);
+        if (baseline_out != NULL)
+            write_baselines(baseline_out, num_global_tracefiles, all_stats);
+        if (baseline_in != NULL)
+            regressed =
+                !check_baselines(baseline_in, num_global_tracefiles, all_stats);
+    }
+
     /* Optionally compare the performance of mm and libc */
-    if (run_libc) {
+    if (all_stats[LIBC_BACKEND] != NULL && global_sum_stats[0].tput > 0 &&
+        global_sum_stats[LIBC_BACKEND].tput > 0) {
         printf("Comparison with libc malloc: mm/libc = %.0f Kops / %.0f Kops = "
                "%.2f\n",
-               (float)global_mm_sum_stats.tput,
-               (float)global_libc_sum_stats.tput,
-               (float)(global_mm_sum_stats.tput / global_libc_sum_stats.tput));
+               (float)global_sum_stats[0].tput,
+               (float)global_sum_stats[LIBC_BACKEND].tput,
+               (float)(global_sum_stats[0].tput /
+                       global_sum_stats[LIBC_BACKEND].tput));
     }
 
     /* temporaries used to compute the performance index */
@@ -695,7 +995,9 @@ int main(int argc, char **argv) {
                 avg_mm_harm_throughput, avg_mm_util * 100);
         printf("%s\n", autoresult);
     }
-    exit(0);
+    if (profile_file != NULL)
+        fclose(profile_file);
+    exit(regressed ? 1 : 0);
 }
 
 /*****************************************************************
@@ -744,9 +1046,11 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or of a mapping */
+    if (backend->emulated &&
+        ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_mapped(lo, size)) {
         malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)",
                      (void *)lo, (void *)hi, (void *)mem_heap_lo(),
                      (void *)mem_heap_hi());
@@ -941,7 +1245,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     trace_t *trace;
     char type[MAXLINE];
     unsigned int index;
-    size_t size;
+    size_t size, align;
     unsigned int max_index = 0;
     unsigned int op_index;
     int ignore = 0;
@@ -959,22 +1263,29 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     if ((tracefile = fopen(trace->filename, "r")) == NULL) {
         unix_error("Could not open %s in read_trace", trace->filename);
     }
-    unsigned int iweight;
-    ignore += fscanf(tracefile, "%u", &iweight);
-    trace->weight = iweight;
-    ignore += fscanf(tracefile, "%u", &trace->num_ids);
-    ignore += fscanf(tracefile, "%u", &trace->num_ops);
-    ignore += fscanf(tracefile, "%zu", &trace->data_bytes);
+
+    /* A binary trace is mapped, requests and all */
+    if (map_trace(trace, fileno(tracefile))) {
+        fclose(tracefile);
+        tracefile = NULL;
+    } else {
+        unsigned int iweight;
+        ignore += fscanf(tracefile, "%u", &iweight);
+        trace->weight = iweight;
+        ignore += fscanf(tracefile, "%u", &trace->num_ids);
+        ignore += fscanf(tracefile, "%u", &trace->num_ops);
+        ignore += fscanf(tracefile, "%zu", &trace->data_bytes);
+
+        /* We'll store each request line in the trace in this array */
+        if ((trace->ops = (traceop_t *)calloc(trace->num_ops,
+                                              sizeof(traceop_t))) == NULL)
+            unix_error("malloc 2 failed in read_trace");
+    }
 
     if (trace->weight > 3) {
         app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
     }
 
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops =
-             (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-        unix_error("malloc 2 failed in read_trace");
-
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = (char **)calloc(trace->num_ids, sizeof(char *))) ==
         NULL)
@@ -990,10 +1301,16 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
              calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
         unix_error("malloc 5 failed in read_trace");
 
+    /* and, for the batch replay, room for the longest run of ops */
+    trace->batch = NULL;
+    if (batch_mode &&
+        (trace->batch = calloc(BATCH_MAX, sizeof(*trace->batch))) == NULL)
+        unix_error("malloc 6 failed in read_trace");
+
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
+    while (tracefile != NULL && fscanf(tracefile, "%s", type) != EOF) {
         switch (type[0]) {
         case 'a':
             ignore += fscanf(tracefile, "%u %lu", &index, &size);
@@ -1009,6 +1326,18 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].size = size;
             max_index = (index > max_index) ? index : max_index;
             break;
+        case 'A':
+            ignore += fscanf(tracefile, "%u %zu %lu", &index, &align, &size);
+            if (align == 0 || (align & (align - 1)) != 0)
+                app_error("Alignment %zu is not a power of two in tracefile "
+                          "%s\n",
+                          align, trace->filename);
+            trace->ops[op_index].type = ALIGNED_ALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->ops[op_index].align_log = (uint8_t)__builtin_ctzl(align);
+            max_index = (index > max_index) ? index : max_index;
+            break;
         case 'f':
             ignore += fscanf(tracefile, "%u", &index);
             trace->ops[op_index].type = FREE;
@@ -1022,9 +1351,36 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
         if (op_index == trace->num_ops)
             break;
     }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
+    if (tracefile != NULL) {
+        fclose(tracefile);
+        assert(max_index == trace->num_ids - 1);
+        assert(trace->num_ops == op_index);
+    }
+
+    /* Find the runs of allocs of one size and of frees, for the batch
+     * replay. A mapped trace is private, so it is only copied if -b. */
+    for (op_index = batch_mode ? trace->num_ops : 0; op_index-- > 0;) {
+        traceop_t *op = &trace->ops[op_index];
+        traceop_t *next = op + 1;
+        op->run = 1;
+        if (op_index + 1 < trace->num_ops && next->type == op->type &&
+            next->run < BATCH_MAX &&
+            ((op->type == ALLOC && next->size == op->size) ||
+             op->type == FREE))
+            op->run = (uint16_t)(next->run + 1);
+    }
+
+    /* A free of the batch replay also carries the size of its block, for
+     * mm_free_sized, so the replay does not have to track the sizes */
+    for (op_index = 0; batch_mode && op_index < trace->num_ops; op_index++) {
+        traceop_t *op = &trace->ops[op_index];
+        if (op->type != FREE)
+            trace->block_sizes[op->index] = op->size;
+        else
+            op->size = op->index == (unsigned int)-1
+                           ? 0
+                           : trace->block_sizes[op->index];
+    }
 
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
@@ -1034,6 +1390,99 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     return trace;
 }
 
+/*
+ * map_trace - If the open trace file fd is a binary trace, map it and point
+ *     the trace's header fields and ops into it. Returns false if it is a
+ *     text trace.
+ */
+static bool map_trace(trace_t *trace, int fd) {
+    btrace_header_t header;
+    struct stat st;
+
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, BTRACE_MAGIC, sizeof(header.magic)) != 0)
+        return false;
+
+    if (header.op_size != sizeof(traceop_t))
+        app_error("%s: written with %u-byte ops, this mdriver uses %zu; "
+                  "convert the .rep file again",
+                  trace->filename, header.op_size, sizeof(traceop_t));
+    if (fstat(fd, &st) < 0)
+        unix_error("fstat failed in map_trace");
+    if ((size_t)st.st_size !=
+        sizeof(header) + (size_t)header.num_ops * sizeof(traceop_t))
+        app_error("%s: truncated binary trace", trace->filename);
+
+    /* Private, so that the batch replay can fill in the runs */
+    trace->map_len = (size_t)st.st_size;
+    trace->map =
+        mmap(NULL, trace->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (trace->map == MAP_FAILED)
+        unix_error("mmap failed in map_trace");
+    trace->weight = header.weight;
+    trace->num_ids = header.num_ids;
+    trace->num_ops = header.num_ops;
+    trace->data_bytes = header.data_bytes;
+    trace->ops = (traceop_t *)((char *)trace->map + sizeof(header));
+
+    /* Check the requests, like the text parser does */
+    for (unsigned int i = 0; i < trace->num_ops; i++) {
+        const traceop_t *op = &trace->ops[i];
+        bool valid;
+        switch (op->type) {
+        case ALLOC:
+        case REALLOC:
+            valid = op->index < trace->num_ids;
+            break;
+        case ALIGNED_ALLOC:
+            valid = op->index < trace->num_ids &&
+                    op->align_log < 8 * sizeof(size_t);
+            break;
+        case FREE:
+            valid = op->index < trace->num_ids || op->index == (unsigned int)-1;
+            break;
+        default:
+            valid = false;
+            break;
+        }
+        if (!valid)
+            app_error("%s: bogus request %u in binary trace", trace->filename,
+                      i);
+    }
+    return true;
+}
+
+/*
+ * write_trace - Write a trace in the binary format that map_trace reads
+ */
+static void write_trace(const trace_t *trace, const char *filename) {
+    btrace_header_t header;
+    FILE *out;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BTRACE_MAGIC, sizeof(header.magic));
+    header.op_size = sizeof(traceop_t);
+    header.weight = trace->weight;
+    header.num_ids = trace->num_ids;
+    header.num_ops = trace->num_ops;
+    header.data_bytes = trace->data_bytes;
+
+    if ((out = fopen(filename, "w")) == NULL)
+        unix_error("Could not open %s in write_trace", filename);
+    if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, out) !=
+            trace->num_ops ||
+        fclose(out) != 0)
+        unix_error("Could not write %s in write_trace", filename);
+}
+
+/*
+ * op_align - Returns the alignment of an aligned alloc request
+ */
+static size_t op_align(const traceop_t *op) {
+    return (size_t)1 << op->align_log;
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -1048,10 +1497,14 @@ static void reinit_trace(trace_t *trace) {
  *              to, all of which were allocated in read_trace().
  */
 static void free_trace(trace_t *trace) {
-    free(trace->ops); /* free the three arrays... */
+    if (trace->map != NULL)
+        munmap(trace->map, trace->map_len);
+    else
+        free(trace->ops); /* free the three arrays... */
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
+    free(trace->batch);
     free(trace); /* and the trace record itself... */
 }
 
@@ -1066,7 +1519,7 @@ static void free_trace(trace_t *trace) {
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
     unsigned int i;
     unsigned int index;
-    size_t size;
+    size_t size, align, usable;
     char *newp;
     char *oldp;
     char *p;
@@ -1077,7 +1530,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
     reinit_trace(trace);
 
     /* Call the mm package's init function */
-    if (!mm_init()) {
+    if (!backend->init()) {
         malloc_error(trace, 0, "mm_init failed.");
         return false;
     }
@@ -1091,7 +1544,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
             range_t *r;
 
             /* Let the students check their own heap */
-            if (!mm_checkheap(0)) {
+            if (!backend->checkheap(0)) {
                 malloc_error(trace, i, "mm_checkheap returned false\n");
                 return false;
             };
@@ -1108,20 +1561,47 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
 
         switch (trace->ops[i].type) {
 
-        case ALLOC: /* mm_malloc */
+        case ALLOC:         /* mm_malloc */
+        case ALIGNED_ALLOC: /* mm_aligned_alloc */
 
             /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL) {
-                malloc_error(trace, i, "mm_malloc failed.");
+            if (trace->ops[i].type == ALLOC) {
+                if ((p = backend->malloc(size)) == NULL) {
+                    malloc_error(trace, i, "mm_malloc failed.");
+                    return false;
+                }
+            } else {
+                align = op_align(&trace->ops[i]);
+                if ((p = backend->aligned_alloc(align, size)) == NULL) {
+                    malloc_error(trace, i, "mm_aligned_alloc failed.");
+                    return false;
+                }
+                if ((uintptr_t)p % align != 0) {
+                    malloc_error(trace, i,
+                                 "Payload address (%p) not aligned to %zu "
+                                 "bytes",
+                                 p, align);
+                    return false;
+                }
+            }
+
+            /* The usable size must cover the request */
+            usable = backend->usable_size(p);
+            if (usable < size) {
+                malloc_error(trace, i,
+                             "mm_usable_size returned %zu for a %zu byte "
+                             "block",
+                             usable, size);
                 return false;
             }
 
             /*
              * Test the range of the new block for correctness and add it
              * to the range list if OK. The block must be  be aligned properly,
-             * and must not overlap any currently allocated block.
+             * and must not overlap any currently allocated block, up to its
+             * usable size.
              */
-            if (add_range(ranges, p, size, trace, i, index) == 0)
+            if (add_range(ranges, p, usable, trace, i, index) == 0)
                 return false;
 
             /* Remember region */
@@ -1140,7 +1620,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
             /* Call the student's realloc */
             oldp = trace->blocks[index];
             setUBCheck(false);
-            newp = mm_realloc(oldp, size);
+            newp = backend->realloc(oldp, size);
             setUBCheck(true);
             if ((newp == NULL) && (size != 0)) {
                 malloc_error(trace, i, "mm_realloc failed.");
@@ -1192,7 +1672,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
                 p = trace->blocks[index];
                 remove_range(ranges, p);
             }
-            mm_free(p);
+            backend->free(p);
             break;
 
         default:
@@ -1214,8 +1694,12 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
  *   is always the high water mark of the heap.
  *
  *   A higher number is better: 1 is optimal.
+ *
+ *   Also records in stats how many bytes realloc did not have to copy
+ *   because it returned the same block, and the heap footprint: the peak
+ *   and final heap size, and the resident size sampled over the trace.
  */
-static double eval_mm_util(trace_t *trace, size_t tracenum) {
+static double eval_mm_util(trace_t *trace, size_t tracenum, stats_t *stats) {
     unsigned int i;
     unsigned int index;
     size_t size, newsize, oldsize;
@@ -1223,22 +1707,42 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
     size_t total_size = 0;
     char *p;
     char *newp, *oldp;
+    size_t resident, peak_resident = 0;
+    unsigned int sample_every = trace->num_ops / 32 + 1;
 
     reinit_trace(trace);
 
+    /* Release the pages of earlier runs, so they are not counted resident */
+    if (mem_heapsize() > 0)
+        mem_decommit(mem_heap_lo(), mem_heapsize());
+
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
-    if (!mm_init())
+    if (!backend->init())
         app_error("trace %zd: mm_init failed in eval_mm_util", tracenum);
 
     for (i = 0; i < trace->num_ops; i++) {
+        if (i % sample_every == 0) {
+            resident = mem_resident();
+            if (resident > peak_resident)
+                peak_resident = resident;
+            if (verbose > 2)
+                printf("trace %zd op %u: heap %zu resident %zu\n", tracenum,
+                       i, mem_heapsize(), resident);
+        }
+
         switch (trace->ops[i].type) {
 
-        case ALLOC: /* mm_alloc */
+        case ALLOC:         /* mm_alloc */
+        case ALIGNED_ALLOC: /* mm_aligned_alloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
 
-            if ((p = mm_malloc(size)) == NULL) {
+            if (trace->ops[i].type == ALLOC)
+                p = backend->malloc(size);
+            else
+                p = backend->aligned_alloc(op_align(&trace->ops[i]), size);
+            if (p == NULL) {
                 app_error("trace %zd: mm_malloc failed in eval_mm_util",
                           tracenum);
             }
@@ -1257,12 +1761,21 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
 
             oldp = trace->blocks[index];
             setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0) {
+            if ((newp = backend->realloc(oldp, newsize)) == NULL &&
+                newsize != 0) {
                 app_error("trace %zd: mm_realloc failed in eval_mm_util",
                           tracenum);
             }
             setUBCheck(true);
 
+            /* Count the bytes a copy would have moved */
+            if (oldp != NULL && newsize != 0) {
+                size_t copysize = newsize < oldsize ? newsize : oldsize;
+                stats->realloc_bytes += (double)copysize;
+                if (newp == oldp)
+                    stats->realloc_saved += (double)copysize;
+            }
+
             /* Remember region and size */
             trace->blocks[index] = newp;
             trace->block_sizes[index] = newsize;
@@ -1280,7 +1793,7 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            backend->free(p);
 
             total_size -= size;
             break;
@@ -1295,7 +1808,14 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
             (total_size > max_total_size) ? total_size : max_total_size;
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    resident = mem_resident();
+    stats->peak_heap = (double)mem_heap_peak();
+    stats->peak_resident =
+        (double)(resident > peak_resident ? resident : peak_resident);
+    stats->final_heap = (double)mem_heapsize();
+    stats->final_resident = (double)resident;
+
+    return ((double)max_total_size / (double)mem_heap_peak());
 }
 
 /*
@@ -1311,7 +1831,7 @@ static void eval_mm_speed(void *ptr) {
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
-    if (!mm_init())
+    if (!backend->init())
         app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
@@ -1321,17 +1841,27 @@ static void eval_mm_speed(void *ptr) {
         case ALLOC: /* mm_malloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = backend->malloc(size)) == NULL)
                 app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
 
+        case ALIGNED_ALLOC: /* mm_aligned_alloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            p = backend->aligned_alloc(op_align(&trace->ops[i]), size);
+            if (p == NULL)
+                app_error("mm_aligned_alloc error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
             oldp = trace->blocks[index];
             setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
+            if ((newp = backend->realloc(oldp, newsize)) == NULL &&
+                newsize != 0)
                 app_error("mm_realloc error in eval_mm_speed");
             setUBCheck(true);
             trace->blocks[index] = newp;
@@ -1344,7 +1874,7 @@ static void eval_mm_speed(void *ptr) {
             } else {
                 block = trace->blocks[index];
             }
-            mm_free(block);
+            backend->free(block);
             break;
 
         default:
@@ -1353,106 +1883,1150 @@ static void eval_mm_speed(void *ptr) {
 }
 
 /*
- * eval_libc_valid - We run this function to make sure that the
- *    libc malloc can run to completion on the set of traces.
- *    We'll be conservative and terminate if any libc malloc call fails.
- *
+ * eval_mm_batch - Replay the trace through the batch interface of the mm
+ *    malloc package. A run of allocations of one size becomes a single
+ *    mm_malloc_batch call and a run of frees a single mm_free_batch call,
+ *    up to BATCH_MAX ops each; a lone free goes to mm_free_sized. If
+ *    ranges is not NULL, every block is checked like in eval_mm_valid. The
+ *    number of ops replayed in batches is stored in batched.
  */
-static bool eval_libc_valid(trace_t *trace) {
-    unsigned int i;
-    size_t newsize;
-    char *p, *newp, *oldp;
+static bool eval_mm_batch(trace_t *trace, range_set_t *ranges,
+                          size_t *batched) {
+    unsigned int i, j, k, n;
+    unsigned int index;
+    size_t size;
+    char *p;
+    void **batch = trace->batch;
 
     reinit_trace(trace);
+    mem_reset_brk();
+    if (!backend->init()) {
+        malloc_error(trace, 0, "mm_init failed.");
+        return false;
+    }
+
+    *batched = 0;
+    for (i = 0; i < trace->num_ops; i = j) {
+        j = i + 1;
+        size = trace->ops[i].size;
 
-    for (i = 0; i < trace->num_ops; i++) {
         switch (trace->ops[i].type) {
 
-        case ALLOC: /* malloc */
-            if ((p = malloc(trace->ops[i].size)) == NULL) {
-                malloc_error(trace, i, "libc malloc failed");
-                unix_error("System message");
+        case ALLOC: /* mm_malloc_batch */
+            n = trace->ops[i].run;
+            j = i + n;
+            if (n == 1) {
+                batch[0] = backend->malloc(size);
+            } else if (backend->malloc_batch(size, n, batch) == n) {
+                *batched += n;
+            } else {
+                batch[0] = NULL;
+            }
+            if (batch[0] == NULL) {
+                malloc_error(trace, i, "mm_malloc_batch failed.");
+                return false;
+            }
+
+            for (k = 0; k < n; k++) {
+                index = trace->ops[i + k].index;
+                p = batch[k];
+                if (ranges != NULL &&
+                    add_range(ranges, p, size, trace, i + k, index) == 0)
+                    return false;
+                trace->blocks[index] = p;
             }
-            trace->blocks[trace->ops[i].index] = p;
             break;
 
-        case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[trace->ops[i].index];
-            if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0) {
-                malloc_error(trace, i, "libc realloc failed");
-                unix_error("System message");
+        case ALIGNED_ALLOC: /* mm_aligned_alloc */
+            index = trace->ops[i].index;
+            p = backend->aligned_alloc(op_align(&trace->ops[i]), size);
+            if (p == NULL) {
+                malloc_error(trace, i, "mm_aligned_alloc failed.");
+                return false;
             }
-            trace->blocks[trace->ops[i].index] = newp;
+            if (ranges != NULL &&
+                add_range(ranges, p, size, trace, i, index) == 0)
+                return false;
+            trace->blocks[index] = p;
             break;
 
-        case FREE: /* free */
-            if (trace->ops[i].index != (unsigned int)-1) {
-                free(trace->blocks[trace->ops[i].index]);
+        case REALLOC: /* mm_realloc */
+            index = trace->ops[i].index;
+            p = trace->blocks[index];
+            if (ranges != NULL && p != NULL)
+                remove_range(ranges, p);
+            setUBCheck(false);
+            p = backend->realloc(p, size);
+            setUBCheck(true);
+            if (p == NULL && size != 0) {
+                malloc_error(trace, i, "mm_realloc failed.");
+                return false;
+            }
+            if (ranges != NULL && size > 0 &&
+                add_range(ranges, p, size, trace, i, index) == 0)
+                return false;
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free_batch */
+            n = trace->ops[i].run;
+            j = i + n;
+            for (k = 0; k < n; k++) {
+                index = trace->ops[i + k].index;
+                p = index == (unsigned int)-1 ? NULL : trace->blocks[index];
+                if (ranges != NULL && p != NULL)
+                    remove_range(ranges, p);
+                batch[k] = p;
+            }
+            if (n == 1) {
+                backend->free_sized(batch[0], size);
             } else {
-                free(0);
+                backend->free_batch(batch, n);
+                *batched += n;
             }
             break;
 
         default:
-            app_error("invalid operation type  in eval_libc_valid");
+            app_error("Nonexistent request type in eval_mm_batch");
         }
     }
-
     return true;
 }
 
 /*
- * eval_libc_speed - This is the function that is used by fcyc() to
- *    measure the running time of the libc malloc package on the set
- *    of traces.
+ * eval_mm_speed_batch - This is the function that is used by fcyc()
+ *    to measure the running time of the batch replay.
  */
-static void eval_libc_speed(void *ptr) {
-    unsigned int i;
-    unsigned int index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
+static void eval_mm_speed_batch(void *ptr) {
+    size_t batched;
+    if (!eval_mm_batch(((speed_t *)ptr)->trace, NULL, &batched))
+        app_error("eval_mm_batch failed in eval_mm_speed_batch");
+}
+
+/*
+ * read_tsc - Read the time stamp counter, or a nanosecond clock where
+ *    there is none
+ */
+static uint64_t read_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/*
+ * add_latency - Count one op of a trace in the latency histograms
+ */
+static void add_latency(latency_t *lat, const trace_t *trace,
+                        unsigned int opnum, size_t size, uint64_t cycles) {
+    unsigned int type, size_class, bucket, k;
+
+    switch (trace->ops[opnum].type) {
+    case FREE:
+        type = 1;
+        break;
+    case REALLOC:
+        type = 2;
+        break;
+    default:
+        type = 0;
+        break;
+    }
+
+    size_class = 0;
+    for (size_t limit = 16; size > limit && size_class < LAT_SIZES - 1;
+         limit *= 4)
+        size_class++;
+
+    bucket = 0;
+    while (bucket < LAT_BUCKETS - 1 && (cycles >> (bucket + 1)) != 0)
+        bucket++;
+
+    lat->hist[type][size_class][bucket]++;
+    if (cycles > lat->max[type][size_class])
+        lat->max[type][size_class] = cycles;
+
+    /* Insertion into the slowest ops, kept sorted */
+    if (lat->num_worst == LAT_WORST &&
+        cycles <= lat->worst[LAT_WORST - 1].cycles)
+        return;
+    if (lat->num_worst < LAT_WORST)
+        lat->num_worst++;
+    for (k = lat->num_worst - 1; k > 0 && lat->worst[k - 1].cycles < cycles;
+         k--)
+        lat->worst[k] = lat->worst[k - 1];
+    lat->worst[k].opnum = opnum;
+    lat->worst[k].type = type;
+    lat->worst[k].size = size;
+    lat->worst[k].cycles = cycles;
+}
+
+/*
+ * eval_mm_latency - Replay the trace like eval_mm_speed, timing every
+ *    mm call with read_tsc
+ */
+static void eval_mm_latency(trace_t *trace, latency_t *lat) {
+    unsigned int i, index;
+    size_t size;
+    uint64_t start, cycles;
+    char *p;
 
     reinit_trace(trace);
+    mem_reset_brk();
+    if (!backend->init())
+        app_error("mm_init failed in eval_mm_latency");
 
     for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+
         switch (trace->ops[i].type) {
-        case ALLOC: /* malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = malloc(size)) == NULL)
-                unix_error("malloc failed in eval_libc_speed");
+
+        case ALLOC: /* mm_malloc */
+            start = read_tsc();
+            p = backend->malloc(size);
+            cycles = read_tsc() - start;
+            if (p == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
             trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
             break;
 
-        case REALLOC: /* realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
-            if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
-                unix_error("realloc failed in eval_libc_speed\n");
+        case ALIGNED_ALLOC: /* mm_aligned_alloc */
+            start = read_tsc();
+            p = backend->aligned_alloc(op_align(&trace->ops[i]), size);
+            cycles = read_tsc() - start;
+            if (p == NULL)
+                app_error("mm_aligned_alloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            break;
 
-            trace->blocks[index] = newp;
+        case REALLOC: /* mm_realloc */
+            setUBCheck(false);
+            start = read_tsc();
+            p = backend->realloc(trace->blocks[index], size);
+            cycles = read_tsc() - start;
+            setUBCheck(true);
+            if (p == NULL && size != 0)
+                app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
             break;
 
-        case FREE: /* free */
-            index = trace->ops[i].index;
+        case FREE: /* mm_free */
+            p = NULL;
+            size = 0;
             if (index != (unsigned int)-1) {
-                block = trace->blocks[index];
-                free(block);
-            } else {
-                free(0);
+                p = trace->blocks[index];
+                size = trace->block_sizes[index];
             }
+            start = read_tsc();
+            backend->free(p);
+            cycles = read_tsc() - start;
             break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_latency");
         }
+
+        add_latency(lat, trace, i, size, cycles);
     }
 }
 
+/*
+ * eval_mm_profile - Replay the trace like eval_mm_util, writing a sample
+ *    of the heap to the profile every profile_every ops and at the end
+ */
+static void eval_mm_profile(trace_t *trace) {
+    unsigned int i, index;
+    size_t size;
+    size_t payload = 0; /* Live payload bytes */
+    char *p;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!backend->init())
+        app_error("mm_init failed in eval_mm_profile");
+
+    for (i = 0; i < trace->num_ops; i++) {
+        if (i % profile_every == 0 && !write_profile(trace, i, payload))
+            return;
+
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+
+        switch (trace->ops[i].type) {
+
+        case ALLOC:         /* mm_malloc */
+        case ALIGNED_ALLOC: /* mm_aligned_alloc */
+            if (trace->ops[i].type == ALLOC)
+                p = backend->malloc(size);
+            else
+                p = backend->aligned_alloc(op_align(&trace->ops[i]), size);
+            if (p == NULL)
+                app_error("mm_malloc error in eval_mm_profile");
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            payload += size;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            setUBCheck(false);
+            p = backend->realloc(trace->blocks[index], size);
+            setUBCheck(true);
+            if (p == NULL && size != 0)
+                app_error("mm_realloc error in eval_mm_profile");
+            payload += size - trace->block_sizes[index];
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            break;
+
+        case FREE: /* mm_free */
+            if (index == (unsigned int)-1) {
+                backend->free(NULL);
+                break;
+            }
+            backend->free(trace->blocks[index]);
+            payload -= trace->block_sizes[index];
+            trace->blocks[index] = NULL;
+            trace->block_sizes[index] = 0;
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_profile");
+        }
+    }
+    write_profile(trace, trace->num_ops, payload);
+}
+
+/*
+ * write_profile - Take a snapshot of the heap with mm_profile and append it
+ *    to the profile as a CSV row, after the header on the first call.
+ *    Returns false if the allocator cannot profile its heap.
+ *
+ *    Internal fragmentation is the share of the allocated blocks (not
+ *    counting the cached blocks and free slab slots) that is not payload.
+ *    External fragmentation is the share of the free bytes that are not
+ *    in the largest free block.
+ */
+static bool write_profile(const trace_t *trace, unsigned int opnum,
+                          size_t payload) {
+    static bool header_written = false;
+    static const mm_backend_t *warned = NULL;
+    mm_profile_t prof;
+    size_t j;
+
+    if (!backend->profile(&prof)) {
+        if (warned != backend)
+            fprintf(stderr, "Warning: %s cannot profile its heap, no heap "
+                            "profile written for it\n",
+                    backend->name);
+        warned = backend;
+        return false;
+    }
+    if (prof.num_lists > MM_PROFILE_LISTS)
+        prof.num_lists = MM_PROFILE_LISTS;
+
+    if (!header_written) {
+        fprintf(profile_file,
+                "allocator,trace,op,footprint,payload,util,alloc_blocks,"
+                "alloc_bytes,"
+                "free_blocks,free_bytes,largest_free,cached_bytes,slab_free,"
+                "mapped_bytes,internal_frag,external_frag");
+        for (j = 0; j < MM_PROFILE_BUCKETS; j++)
+            fprintf(profile_file, ",free_2^%zu", j);
+        for (j = 0; j < prof.num_lists; j++)
+            fprintf(profile_file, ",list%zu", j);
+        fputc('\n', profile_file);
+        header_written = true;
+    }
+
+    size_t footprint = mem_heapsize() + prof.mapped_bytes;
+    size_t in_use = prof.alloc_bytes + prof.mapped_bytes - prof.cached_bytes -
+                    prof.slab_free;
+    double internal =
+        in_use > payload ? (double)(in_use - payload) / (double)in_use : 0.0;
+    double external =
+        prof.free_bytes > 0
+            ? 1.0 - (double)prof.largest_free / (double)prof.free_bytes
+            : 0.0;
+    double util = footprint > 0 ? (double)payload / (double)footprint : 0.0;
+
+    fprintf(profile_file,
+            "%s,%s,%u,%zu,%zu,%.4f,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%.4f,%.4f",
+            backend->name, trace->filename, opnum, footprint, payload, util,
+            prof.alloc_blocks, prof.alloc_bytes, prof.free_blocks,
+            prof.free_bytes, prof.largest_free, prof.cached_bytes,
+            prof.slab_free, prof.mapped_bytes, internal, external);
+    for (j = 0; j < MM_PROFILE_BUCKETS; j++)
+        fprintf(profile_file, ",%zu", prof.free_hist[j]);
+    for (j = 0; j < prof.num_lists; j++)
+        fprintf(profile_file, ",%zu", prof.list_blocks[j]);
+    fputc('\n', profile_file);
+    return true;
+}
+
+/*
+ * new_par - Split a trace across num_threads threads for a parallel replay.
+ *    The ops on an id go to thread (id % num_threads), except that with
+ *    cross set, frees go to the next thread, so that no thread frees the
+ *    blocks it allocated.
+ */
+static par_t *new_par(trace_t *trace, unsigned int num_threads, bool cross) {
+    unsigned int i, t, index;
+    unsigned int *seen;
+    par_t *par = calloc(1, sizeof(par_t));
+    if (par == NULL)
+        unix_error("calloc failed in new_par");
+
+    par->trace = trace;
+    par->num_threads = num_threads;
+    par->thread_ops = calloc(num_threads, sizeof(*par->thread_ops));
+    par->num_thread_ops = calloc(num_threads, sizeof(*par->num_thread_ops));
+    par->seq = calloc(trace->num_ops, sizeof(*par->seq));
+    par->done = calloc(trace->num_ids + 1, sizeof(*par->done));
+    seen = calloc(trace->num_ids + 1, sizeof(*seen));
+    if (par->thread_ops == NULL || par->num_thread_ops == NULL ||
+        par->seq == NULL || par->done == NULL || seen == NULL)
+        unix_error("calloc failed in new_par");
+    for (t = 0; t < num_threads; t++) {
+        par->thread_ops[t] = calloc(trace->num_ops, sizeof(**par->thread_ops));
+        if (par->thread_ops[t] == NULL)
+            unix_error("calloc failed in new_par");
+    }
+
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        if (index == (unsigned int)-1) {
+            /* free(NULL) depends on nothing */
+            t = 0;
+        } else {
+            par->seq[i] = seen[index]++;
+            t = index % num_threads;
+            if (cross && trace->ops[i].type == FREE)
+                t = (t + 1) % num_threads;
+        }
+        par->thread_ops[t][par->num_thread_ops[t]++] = i;
+    }
+    free(seen);
+    return par;
+}
+
+/*
+ * free_par - Free a parallel replay made by new_par
+ */
+static void free_par(par_t *par) {
+    for (unsigned int t = 0; t < par->num_threads; t++)
+        free(par->thread_ops[t]);
+    free(par->thread_ops);
+    free(par->num_thread_ops);
+    free(par->seq);
+    free(par->done);
+    free(par);
+}
+
+/*
+ * par_replay - Replay the ops of one thread of a parallel replay. Unless
+ *    the allocator is thread-safe, like mm.c built with MM_CONCURRENT, its
+ *    calls are serialized through mm_lock.
+ */
+static void *par_replay(void *ptr) {
+    par_t *par = ((par_thread_t *)ptr)->par;
+    unsigned int thread = ((par_thread_t *)ptr)->thread;
+    trace_t *trace = par->trace;
+    unsigned int i, j, index;
+    size_t size;
+    char *p;
+
+    pthread_barrier_wait(&par->start);
+    for (j = 0; j < par->num_thread_ops[thread]; j++) {
+        i = par->thread_ops[thread][j];
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if (index == (unsigned int)-1) {
+            backend->free(NULL);
+            continue;
+        }
+
+        /* Wait for the earlier ops on this id */
+        while (atomic_load_explicit(&par->done[index], memory_order_acquire) !=
+               par->seq[i])
+            sched_yield();
+
+        if (!backend->thread_safe)
+            pthread_mutex_lock(&mm_lock);
+        switch (trace->ops[i].type) {
+
+        case ALLOC:
+            p = backend->malloc(size);
+            if (p == NULL)
+                app_error("malloc error in par_replay");
+            trace->blocks[index] = p;
+            break;
+
+        case ALIGNED_ALLOC:
+            p = backend->aligned_alloc(op_align(&trace->ops[i]), size);
+            if (p == NULL)
+                app_error("aligned_alloc error in par_replay");
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC:
+            p = trace->blocks[index];
+            p = backend->realloc(p, size);
+            if (p == NULL && size != 0)
+                app_error("realloc error in par_replay");
+            trace->blocks[index] = p;
+            break;
+
+        case FREE:
+            backend->free(trace->blocks[index]);
+            break;
+
+        default:
+            app_error("Nonexistent request type in par_replay");
+        }
+        if (!backend->thread_safe)
+            pthread_mutex_unlock(&mm_lock);
+
+        atomic_store_explicit(&par->done[index], par->seq[i] + 1,
+                              memory_order_release);
+    }
+    return NULL;
+}
+
+/*
+ * eval_par_speed - Time a parallel replay. fsec only times the calling
+ *    thread, so this measures wall-clock time instead and keeps the fastest
+ *    of PAR_REPS runs.
+ */
+static double eval_par_speed(par_t *par) {
+    unsigned int t;
+    double best = DBL_MAX;
+    pthread_t *tids = calloc(par->num_threads, sizeof(*tids));
+    par_thread_t *args = calloc(par->num_threads, sizeof(*args));
+    if (tids == NULL || args == NULL)
+        unix_error("calloc failed in eval_par_speed");
+
+    for (int rep = 0; rep < PAR_REPS; rep++) {
+        struct timespec start, end;
+
+        reinit_trace(par->trace);
+        memset(par->done, 0, (par->trace->num_ids + 1) * sizeof(*par->done));
+        mem_reset_brk();
+        if (!backend->init())
+            app_error("mm_init failed in eval_par_speed");
+
+        setUBCheck(false);
+        pthread_barrier_init(&par->start, NULL, par->num_threads + 1);
+        for (t = 0; t < par->num_threads; t++) {
+            args[t].par = par;
+            args[t].thread = t;
+            if (pthread_create(&tids[t], NULL, par_replay, &args[t]) != 0)
+                unix_error("pthread_create failed in eval_par_speed");
+        }
+        /* The threads are held at the barrier until we get there */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_barrier_wait(&par->start);
+        for (t = 0; t < par->num_threads; t++)
+            pthread_join(tids[t], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        pthread_barrier_destroy(&par->start);
+        setUBCheck(true);
+
+        double secs = (double)(end.tv_sec - start.tv_sec) +
+                      (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+        if (secs < best)
+            best = secs;
+    }
+
+    free(tids);
+    free(args);
+    return best;
+}
+
+/*
+ * eval_par - Time the parallel replays of a trace: on one thread, on
+ *    par_threads threads with the ids split between them, and on
+ *    par_threads threads with every block freed by another thread.
+ */
+static void eval_par(trace_t *trace, stats_t *stats) {
+    par_t *par;
+
+    if (verbose > 1)
+        printf(", parallel replay");
+
+    par = new_par(trace, 1, false);
+    stats->par1_secs = eval_par_speed(par);
+    free_par(par);
+
+    par = new_par(trace, par_threads, false);
+    stats->par_secs = eval_par_speed(par);
+    free_par(par);
+
+    par = new_par(trace, par_threads, true);
+    stats->xfree_secs = eval_par_speed(par);
+    free_par(par);
+}
+
+/*
+ * libc_init - libc malloc needs no setup
+ */
+static bool libc_init(void) {
+    return true;
+}
+
+/*
+ * libc_usable_size - The usable size of a block of libc malloc
+ */
+static size_t libc_usable_size(void *ptr) {
+    return malloc_usable_size(ptr);
+}
+
+/*
+ * libc_malloc_batch - Allocate n blocks with libc malloc, one at a time
+ */
+static size_t libc_malloc_batch(size_t size, size_t n, void **out) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if ((out[i] = malloc(size)) == NULL)
+            break;
+    }
+    return i;
+}
+
+/*
+ * libc_free_sized - libc has no use for the size of a freed block
+ */
+static void libc_free_sized(void *ptr, size_t size) {
+    free(ptr);
+}
+
+/*
+ * libc_free_batch - Free n blocks with libc free, one at a time
+ */
+static void libc_free_batch(void **ptrs, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        free(ptrs[i]);
+}
+
+/*
+ * libc_checkheap - The heap of libc malloc is not checked
+ */
+static bool libc_checkheap(int line) {
+    return true;
+}
+
+/*
+ * libc_profile - The heap of libc malloc cannot be profiled
+ */
+static bool libc_profile(mm_profile_t *prof) {
+    return false;
+}
+
+/*
+ * select_backends - Also run the allocators in a comma-separated list of
+ *    names, or all of them for "all"
+ */
+static void select_backends(const char *list) {
+    char names[MAXLINE];
+    char *save = NULL;
+    size_t b;
+
+    strncpy(names, list, MAXLINE - 1);
+    names[MAXLINE - 1] = '\0';
+    for (char *name = strtok_r(names, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+        for (b = 0; b < NUM_BACKENDS; b++) {
+            if (strcmp(name, "all") == 0)
+                run_backend[b] = true;
+            else if (strcmp(name, backends[b]->name) == 0)
+                break;
+        }
+        if (strcmp(name, "all") == 0)
+            continue;
+        if (b == NUM_BACKENDS) {
+            fprintf(stderr, "Unknown allocator %s, choose from:", name);
+            for (b = 0; b < NUM_BACKENDS; b++)
+                fprintf(stderr, " %s", backends[b]->name);
+            fprintf(stderr, " all\n");
+            exit(1);
+        }
+        run_backend[b] = true;
+    }
+}
+
+/*
+ * print_backend_stats - Print the utilization and throughput of every
+ *    allocator that was run side by side, for each trace and on average
+ */
+static void print_backend_stats(size_t n, stats_t *const *all_stats) {
+    double util[NUM_BACKENDS] = {0}, tput[NUM_BACKENDS] = {0};
+    int util_weight[NUM_BACKENDS] = {0}, perf_weight[NUM_BACKENDS] = {0};
+    size_t i, b;
+
+    printf("\nComparison of allocators, util and Kops/s:\n");
+    for (b = 0; b < NUM_BACKENDS; b++) {
+        if (all_stats[b] != NULL)
+            printf("%16s", backends[b]->name);
+    }
+    printf("  trace\n");
+
+    for (i = 0; i < n; i++) {
+        for (b = 0; b < NUM_BACKENDS; b++) {
+            const stats_t *stats = all_stats[b];
+            if (stats == NULL)
+                continue;
+            if (!stats[i].valid) {
+                printf("%16s", "invalid");
+                continue;
+            }
+            if (backends[b]->emulated)
+                printf("%7.1f%%", stats[i].util * 100.0);
+            else
+                printf("%8s", "--");
+            if (sparse_mode)
+                printf("%8s", "--");
+            else
+                printf("%8.0f", stats[i].tput);
+            if (stats[i].weight == WALL || stats[i].weight == WUTIL) {
+                util[b] += stats[i].util;
+                util_weight[b]++;
+            }
+            if (stats[i].weight == WALL || stats[i].weight == WPERF) {
+                tput[b] += stats[i].tput;
+                perf_weight[b]++;
+            }
+        }
+        printf("  %s\n", all_stats[0][i].filename);
+    }
+
+    for (b = 0; b < NUM_BACKENDS; b++) {
+        if (all_stats[b] == NULL)
+            continue;
+        if (backends[b]->emulated && util_weight[b] > 0)
+            printf("%7.1f%%", util[b] * 100.0 / util_weight[b]);
+        else
+            printf("%8s", "--");
+        if (!sparse_mode && perf_weight[b] > 0)
+            printf("%8.0f", tput[b] / perf_weight[b]);
+        else
+            printf("%8s", "--");
+    }
+    printf("  average\n\n");
+}
+
+/*
+ * trace_name - The file name of a trace without its directory, which
+ *    identifies it in baselines
+ */
+static const char *trace_name(const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    return slash != NULL ? slash + 1 : filename;
+}
+
+/*
+ * write_baselines - Save the utilization and throughput of every valid
+ *    trace of every allocator that was run, for check_baselines
+ */
+static void write_baselines(const char *filename, size_t n,
+                            stats_t *const *all_stats) {
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL)
+        unix_error("Could not open %s", filename);
+
+    fprintf(fp, "# allocator\ttrace\tutil\tKops/s\n");
+    for (size_t b = 0; b < NUM_BACKENDS; b++) {
+        if (all_stats[b] == NULL)
+            continue;
+        for (size_t i = 0; i < n; i++) {
+            const stats_t *stats = &all_stats[b][i];
+            if (stats->valid)
+                fprintf(fp, "%s\t%s\t%.4f\t%.0f\n", backends[b]->name,
+                        trace_name(stats->filename), stats->util,
+                        sparse_mode ? 0.0 : stats->tput);
+        }
+    }
+    if (fclose(fp) != 0)
+        unix_error("Could not write %s", filename);
+}
+
+/*
+ * check_baselines - Compare the results with the baselines saved by
+ *    write_baselines, for the allocators and traces that were run. A trace
+ *    regresses if it is no longer valid or loses more than GATE_UTIL_SLACK
+ *    of utilization. Throughput varies too much between runs to gate single
+ *    traces, so it is only summed over the throughput-weighted traces of
+ *    each allocator, and a loss of more than GATE_TPUT_SLACK is reported
+ *    without failing the check. Returns false if any trace regressed.
+ */
+static bool check_baselines(const char *filename, size_t n,
+                            stats_t *const *all_stats) {
+    char line[2 * MAXLINE];
+    unsigned int checked = 0, regressions = 0;
+    double base_sum[NUM_BACKENDS] = {0}, sum[NUM_BACKENDS] = {0};
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+        unix_error("Could not open %s", filename);
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *save = NULL;
+        if (line[0] == '#')
+            continue;
+        const char *name = strtok_r(line, "\t", &save);
+        const char *trace = strtok_r(NULL, "\t", &save);
+        const char *util_str = strtok_r(NULL, "\t", &save);
+        const char *tput_str = strtok_r(NULL, "\t\n", &save);
+        if (tput_str == NULL)
+            app_error("Malformed baseline in %s", filename);
+        double base_util = strtod(util_str, NULL);
+        double base_tput = strtod(tput_str, NULL);
+
+        /* Find the allocator and trace, skip them if not run */
+        size_t b, i;
+        for (b = 0; b < NUM_BACKENDS; b++) {
+            if (strcmp(name, backends[b]->name) == 0)
+                break;
+        }
+        if (b == NUM_BACKENDS || all_stats[b] == NULL)
+            continue;
+        for (i = 0; i < n; i++) {
+            if (strcmp(trace, trace_name(all_stats[b][i].filename)) == 0)
+                break;
+        }
+        if (i == n)
+            continue;
+
+        const stats_t *stats = &all_stats[b][i];
+        checked++;
+        if (!stats->valid) {
+            printf("Regression: %s is no longer valid on %s\n", name, trace);
+            regressions++;
+            continue;
+        }
+        /* Only compare what was measured both times */
+        if (base_util > 0 && stats->util > 0 &&
+            stats->util < base_util - GATE_UTIL_SLACK) {
+            printf("Regression: %s utilization on %s fell from %.1f%% to "
+                   "%.1f%%\n",
+                   name, trace, base_util * 100.0, stats->util * 100.0);
+            regressions++;
+        }
+        if (base_tput > 0 && !sparse_mode && stats->tput > 0 &&
+            (stats->weight == WALL || stats->weight == WPERF)) {
+            base_sum[b] += base_tput;
+            sum[b] += stats->tput;
+        }
+    }
+    fclose(fp);
+
+    for (size_t b = 0; b < NUM_BACKENDS; b++) {
+        if (sum[b] < base_sum[b] * (1.0 - GATE_TPUT_SLACK))
+            printf("Note: %s throughput summed over the weighted traces fell "
+                   "from %.0f to %.0f Kops/s (not gated)\n",
+                   backends[b]->name, base_sum[b], sum[b]);
+    }
+
+    printf("Baseline check against %s: %u results compared, %u "
+           "regressions\n",
+           filename, checked, regressions);
+    return regressions == 0;
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
 
+/*
+ * print_realloc_stats - Print the realloc copy bytes saved by resizing in
+ *     place, for the traces that call realloc
+ */
+static void print_realloc_stats(size_t n, const stats_t *stats) {
+    bool header = false;
+    for (size_t i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].realloc_bytes == 0)
+            continue;
+        if (!header) {
+            printf("Realloc copies saved in place:\n");
+            printf("  %12s %12s %6s  %s\n", "saved bytes", "copy bytes",
+                   "saved", "trace");
+            header = true;
+        }
+        printf("  %12.0f %12.0f %5.1f%%  %s\n", stats[i].realloc_saved,
+               stats[i].realloc_bytes,
+               stats[i].realloc_saved / stats[i].realloc_bytes * 100.0,
+               stats[i].filename);
+    }
+    if (header)
+        printf("\n");
+}
+
+/*
+ * print_footprint_stats - Print the peak and final heap size of each trace,
+ *     next to the memory actually resident
+ */
+static void print_footprint_stats(size_t n, const stats_t *stats) {
+    printf("Heap footprint in KiB:\n");
+    printf("  %10s %10s %10s %10s  %s\n", "peak heap", "peak res",
+           "final heap", "final res", "trace");
+    for (size_t i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        printf("  %10.0f %10.0f %10.0f %10.0f  %s\n", stats[i].peak_heap / 1024,
+               stats[i].peak_resident / 1024, stats[i].final_heap / 1024,
+               stats[i].final_resident / 1024, stats[i].filename);
+    }
+    printf("\n");
+}
+
+/*
+ * print_batch_stats - Print how much of each trace the batch replay
+ *     batched, and its throughput next to the one of the plain replay
+ */
+static void print_batch_stats(size_t n, const stats_t *stats) {
+    printf("Batch replay:\n");
+    printf("  %8s %8s %10s %10s %8s  %s\n", "batched", "ops", "Kops",
+           "batch Kops", "speedup", "trace");
+    for (size_t i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].batch_secs == 0)
+            continue;
+        printf("  %8.0f %8.0f %10.0f %10.0f %7.2fx  %s\n",
+               stats[i].batched_ops, stats[i].ops, stats[i].tput,
+               stats[i].ops / (stats[i].batch_secs * 1000.0),
+               stats[i].secs / stats[i].batch_secs, stats[i].filename);
+    }
+    printf("\n");
+}
+
+/*
+ * print_par_stats - Print the throughput of the parallel replays, and their
+ *     scaling efficiency: the speedup over one thread divided by the number
+ *     of threads, for every allocator that was run next to mm. An allocator
+ *     that is not thread-safe is serialized by mm_lock, so it cannot scale.
+ */
+static void print_par_stats(size_t n, stats_t *const *all_stats) {
+    const stats_t *all[NUM_BACKENDS];
+    const stats_t *stats = all_stats[0];
+    double ops = 0, secs[NUM_BACKENDS][3] = {{0}};
+    bool complete[NUM_BACKENDS];
+    char label[MAXLINE];
+    int num = 0;
+
+    printf("Parallel replay on %u threads (Kops/s, efficiency):\n",
+           par_threads);
+    for (size_t b = 0; b < NUM_BACKENDS; b++) {
+        if (all_stats[b] == NULL)
+            continue;
+        complete[num] = true;
+        all[num++] = all_stats[b];
+        snprintf(label, sizeof(label), "%s%s", backends[b]->name,
+                 backends[b]->thread_safe ? "" : " (serialized)");
+        printf("  %-32s", label);
+    }
+    printf("\n");
+    for (int k = 0; k < num; k++)
+        printf("  %6s %6s %4s %6s %4s", "1-thr", "split", "eff", "cross",
+               "eff");
+    printf("  trace\n");
+    for (size_t i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].par_secs == 0)
+            continue;
+        ops += stats[i].ops;
+        for (int k = 0; k < num; k++) {
+            const stats_t *s = &all[k][i];
+            if (!s->valid || s->par_secs == 0) {
+                printf("  %6s %6s %4s %6s %4s", "--", "--", "--", "--", "--");
+                complete[k] = false;
+                continue;
+            }
+            secs[k][0] += s->par1_secs;
+            secs[k][1] += s->par_secs;
+            secs[k][2] += s->xfree_secs;
+            printf("  %6.0f %6.0f %3.0f%% %6.0f %3.0f%%",
+                   s->ops / (s->par1_secs * 1000.0),
+                   s->ops / (s->par_secs * 1000.0),
+                   100.0 * s->par1_secs / (s->par_secs * par_threads),
+                   s->ops / (s->xfree_secs * 1000.0),
+                   100.0 * s->par1_secs / (s->xfree_secs * par_threads));
+        }
+        printf("  %s\n", stats[i].filename);
+    }
+    for (int k = 0; k < num && ops > 0; k++) {
+        if (!complete[k])
+            printf("  %6s %6s %4s %6s %4s", "--", "--", "--", "--", "--");
+        else
+            printf("  %6.0f %6.0f %3.0f%% %6.0f %3.0f%%",
+                   ops / (secs[k][0] * 1000.0), ops / (secs[k][1] * 1000.0),
+                   100.0 * secs[k][0] / (secs[k][1] * par_threads),
+                   ops / (secs[k][2] * 1000.0),
+                   100.0 * secs[k][0] / (secs[k][2] * par_threads));
+    }
+    printf("  Total\n\n");
+}
+
+/*
+ * lat_percentile - Returns the upper bound of the histogram bucket holding
+ *     the q-quantile of count ops, or max if that is lower
+ */
+static uint64_t lat_percentile(const uint64_t *hist, uint64_t count,
+                               double q, uint64_t max) {
+    uint64_t seen = 0;
+    for (unsigned int b = 0; b < LAT_BUCKETS - 1; b++) {
+        seen += hist[b];
+        if ((double)seen >= q * (double)count) {
+            uint64_t bound = ((uint64_t)1 << (b + 1)) - 1;
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
+
+/*
+ * print_latency_stats - Print the p50/p99/max latency of each op type, per
+ *     trace and, over all traces, per size class, then the slowest ops
+ */
+static void print_latency_stats(size_t n, const stats_t *stats) {
+    static const char *type_names[LAT_TYPES] = {"malloc", "free", "realloc"};
+    static const char *size_names[LAT_SIZES] = {"<=16", "<=64", "<=256",
+                                                "<=1K", "<=4K", "<=16K",
+                                                "<=64K", ">64K"};
+    static uint64_t hist[LAT_TYPES][LAT_SIZES][LAT_BUCKETS];
+    uint64_t max[LAT_TYPES][LAT_SIZES] = {{0}};
+    uint64_t type_hist[LAT_BUCKETS];
+    uint64_t count, type_max;
+    unsigned int t, c, b;
+    size_t i;
+
+    memset(hist, 0, sizeof(hist));
+    printf("Latency in cycles (percentiles are log2 bucket bounds):\n");
+    printf(" ");
+    for (t = 0; t < LAT_TYPES; t++)
+        printf(" %-8s %6s %6s %8s", type_names[t], "p50", "p99", "max");
+    printf("  trace\n");
+
+    for (i = 0; i < n; i++) {
+        const latency_t *lat = stats[i].latency;
+        if (!stats[i].valid || lat == NULL)
+            continue;
+        printf(" ");
+        for (t = 0; t < LAT_TYPES; t++) {
+            memset(type_hist, 0, sizeof(type_hist));
+            count = type_max = 0;
+            for (c = 0; c < LAT_SIZES; c++) {
+                for (b = 0; b < LAT_BUCKETS; b++) {
+                    type_hist[b] += lat->hist[t][c][b];
+                    hist[t][c][b] += lat->hist[t][c][b];
+                    count += lat->hist[t][c][b];
+                }
+                if (lat->max[t][c] > type_max)
+                    type_max = lat->max[t][c];
+                if (lat->max[t][c] > max[t][c])
+                    max[t][c] = lat->max[t][c];
+            }
+            if (count == 0)
+                printf(" %-8s %6s %6s %8s", "", "-", "-", "-");
+            else
+                printf(" %-8s %6" PRIu64 " %6" PRIu64 " %8" PRIu64, "",
+                       lat_percentile(type_hist, count, 0.50, type_max),
+                       lat_percentile(type_hist, count, 0.99, type_max),
+                       type_max);
+        }
+        printf("  %s\n", stats[i].filename);
+    }
+
+    printf("\nLatency by size class, all traces:\n");
+    printf("  %-8s %6s %10s %6s %6s %8s\n", "op", "size", "ops", "p50", "p99",
+           "max");
+    for (t = 0; t < LAT_TYPES; t++) {
+        for (c = 0; c < LAT_SIZES; c++) {
+            count = 0;
+            for (b = 0; b < LAT_BUCKETS; b++)
+                count += hist[t][c][b];
+            if (count == 0)
+                continue;
+            printf("  %-8s %6s %10" PRIu64 " %6" PRIu64 " %6" PRIu64
+                   " %8" PRIu64 "\n",
+                   type_names[t], size_names[c], count,
+                   lat_percentile(hist[t][c], count, 0.50, max[t][c]),
+                   lat_percentile(hist[t][c], count, 0.99, max[t][c]),
+                   max[t][c]);
+        }
+    }
+
+    /* Merge the slowest ops of every trace */
+    printf("\nSlowest ops, all traces:\n");
+    printf("  %10s  %-8s %10s  %s\n", "cycles", "op", "size", "trace:line");
+    size_t *next = calloc(n, sizeof(*next));
+    if (next == NULL)
+        unix_error("calloc failed in print_latency_stats");
+    for (unsigned int k = 0; k < LAT_WORST; k++) {
+        const latency_t *worst = NULL;
+        size_t worst_i = 0;
+        for (i = 0; i < n; i++) {
+            const latency_t *lat = stats[i].latency;
+            if (!stats[i].valid || lat == NULL || next[i] >= lat->num_worst)
+                continue;
+            if (worst == NULL || lat->worst[next[i]].cycles >
+                                     worst->worst[next[worst_i]].cycles) {
+                worst = lat;
+                worst_i = i;
+            }
+        }
+        if (worst == NULL)
+            break;
+        const lat_op_t *op = &worst->worst[next[worst_i]++];
+        printf("  %10" PRIu64 "  %-8s %10zu  %s:%u\n", op->cycles,
+               type_names[op->type], op->size, stats[worst_i].filename,
+               LINENUM(op->opnum));
+    }
+    free(next);
+    printf("\n");
+}
+
+/*
+ * print_counter_stats - Print the hardware events of the fastest timed
+ *    replay of each trace, per op
+ */
+static void print_counter_stats(size_t n, const stats_t *stats) {
+    static const char *names[FC_NUM_COUNTERS] = {
+        [FC_INSTRUCTIONS] = "instr",     [FC_L1D_MISSES] = "L1D miss",
+        [FC_LLC_MISSES] = "LLC miss",    [FC_DTLB_MISSES] = "dTLB miss",
+        [FC_BRANCH_MISSES] = "br miss",
+    };
+    size_t i;
+    int c;
+
+    for (i = 0; i < n; i++) {
+        if (stats[i].valid && stats[i].counted)
+            break;
+    }
+    if (i == n) {
+        printf("\nHardware events per op: not counted\n");
+        return;
+    }
+
+    printf("\nHardware events per op:\n");
+    for (c = 0; c < FC_NUM_COUNTERS; c++)
+        printf("%10s", names[c]);
+    printf("  trace\n");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        for (c = 0; c < FC_NUM_COUNTERS; c++) {
+            if (stats[i].counted && stats[i].counters[c] >= 0.0 &&
+                stats[i].ops > 0)
+                printf("%10.3f", stats[i].counters[c] / stats[i].ops);
+            else
+                printf("%10s", "--");
+        }
+        printf("  %s\n", stats[i].filename);
+    }
+}
+
 /*
  * printresults - prints a performance summary for some malloc package and
  * returns a summary of the stats to the caller.
@@ -1599,6 +3173,9 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
         sumstats->secs = 0;
         sumstats->tput = 0;
     }
+
+    if (counters_mode && !sparse_mode && !tab_mode)
+        print_counter_stats(n, stats);
 }
 
 /*
@@ -1800,19 +3377,44 @@ static double measure_ref_throughput(bool checkpoint) {
  * usage - Explain the command line arguments
  */
 static void usage(char *prog) {
-    fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
+    fprintf(stderr,
+            "Usage: %s [-hlLeMVCdDb] [-a <list>] [-P <n>] [-H <k>] "
+            "[-f <file>]\n",
+            prog);
     fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-a <list>  Also run the allocators in a comma-separated "
+                    "<list>, or all.\n");
+    fprintf(stderr, "\t-b         Also replay runs of identical ops through "
+                    "the batch interface.\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
+    fprintf(stderr, "\t-e         Also count hardware events of the timed "
+                    "replays.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
     fprintf(stderr, "\t-c <file>  Run trace file <file> twice, check for "
                     "correctness only.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-g <file>  Check the results against the baselines "
+                    "in <file>.\n");
+    fprintf(stderr, "\t-G <file>  Save the results as baselines in <file>.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H <k>     Sample the heap every <k> ops into a CSV "
+                    "profile.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Also time every op and print latency "
+                    "histograms.\n");
+    fprintf(stderr, "\t-M         Back the dense heap by transparent huge "
+                    "pages.\n");
+    fprintf(stderr, "\t-o <file>  Write the heap profile to <file> (default "
+                    "%s).\n",
+            PROFILE_OUT);
+    fprintf(stderr, "\t-P <n>     Also replay each trace on <n> threads, "
+                    "with mm-concurrent.\n");
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-w <out>   Convert the -f trace to a binary trace "
+                    "<out> and exit.\n");
 }
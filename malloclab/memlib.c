@@ -18,6 +18,13 @@
  *  so the mapping sequence checks accounts for size and can perform two
  *  lookups if necessary.
  *
+ * The first map is a radix tree: each level is indexed by RADIX_BITS bits of
+ *  the page ID, from the most significant down, and the last level points to
+ *  the pages.  The tree only has as many levels as the highest page ID in use
+ *  needs, so a small heap takes few steps.  The page of the previous access
+ *  is remembered, so runs of accesses to one page skip the walk.  Pages are
+ *  carved from the bottom of the emulation memory and tree nodes from the top.
+ *
  * Storing in the sparse emulation goes through the above lookup process and
  *  then memcpy's the bytes into the block.
  *
@@ -31,8 +38,20 @@
  *  in non-emulation, as it was to the same page as actual heap data.  But
  *  sparse emulation has tighter checks.  Commonly, the CPU reports a
  *  BUS ERROR on these accesses, and should be debugged as segmentation faults.
+ *
+ * Besides the heap, the allocator can ask for separate mappings, a model of
+ *  mmap/mremap/munmap.  In dense mode, they are carved from the top of the
+ *  heap area downwards, and the break can only grow up to the lowest one.
+ *  Mappings are not emulated in sparse mode.
+ *
+ * The dense heap area can be backed by transparent huge pages: it is then
+ *  aligned to HUGE_PAGE_SIZE and advised with MADV_HUGEPAGE, so a heap that
+ *  is touched all over takes one TLB entry per huge page instead of 512.
+ *  mem_decommit then only releases whole huge pages, as releasing part of
+ *  one splits it.
  */
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* madvise, mincore */
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -63,16 +82,30 @@ extern void *sbrk(intptr_t);
 
 /* Data structure used to implement pages in sparse memory emulation */
 typedef struct MBLK {
-    size_t id;         /* Page ID.  Counts number of pages from start of heap */
-    struct MBLK *next; /* Link for hash table */
-    unsigned char initSet[SPARSE_PAGE_SIZE / 8];
-    unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
+    uint64_t initSet[SPARSE_PAGE_SIZE / 64]; /* Bytes written, one bit each */
+    unsigned char bytes[SPARSE_PAGE_SIZE];   /* Page contents */
 } mem_block_t;
 
+/* Bits of a page ID.  Counts number of pages from start of heap */
+#define PAGE_ID_BITS 52
+_Static_assert(((size_t)1 << PAGE_ID_BITS) * SPARSE_PAGE_SIZE ==
+                   MAX_SPARSE_HEAP,
+               "PAGE_ID_BITS does not match the sparse heap");
+
+#define RADIX_FANOUT (1 << RADIX_BITS)
+
+/* Node of the page table.  The children of the last level are pages */
+typedef struct RNODE {
+    void *child[RADIX_FANOUT];
+} radix_node_t;
+
 /* private global variables */
 static bool sparse = false;         /* Use sparse memory emulation */
+static bool use_huge = false;       /* Back the dense heap by huge pages */
+static size_t heap_page = 0;        /* Size of the pages backing the heap */
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
+static size_t mem_peak;             /* Highest footprint since the reset */
 static unsigned char *mem_max_addr; /* Maximum allowable heap address */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
@@ -82,11 +115,26 @@ static bool stats_printed =
     false; /* Has information been printed about allocation */
 
 /* Sparse memory representation */
-static mem_block_t *next_free_page = NULL; /* Next free page */
-static size_t num_pages = 0;               /* Total number of pages */
-static size_t num_free_pages = 0;          /* Number of free pages */
-static mem_block_t **page_table = NULL;    /* Hash table from page ID to page */
-static size_t num_buckets = 0;             /* Number of buckets in page table */
+static unsigned char *sparse_mem = NULL; /* Memory for pages and page table */
+static unsigned char *free_lo = NULL;    /* Unused part of sparse_mem */
+static unsigned char *free_hi = NULL;
+static size_t num_pages = 0;             /* Number of pages in use */
+static size_t num_nodes = 0;             /* Number of page table nodes */
+static radix_node_t *page_root = NULL;   /* Root of the page table */
+static unsigned int page_levels = 0;     /* Number of levels below the root */
+static size_t last_id = SIZE_MAX;        /* Page ID of the last access */
+static mem_block_t *last_page = NULL;    /* Page of the last access */
+
+/* Mappings, a model of mmap */
+typedef struct MMAP {
+    unsigned char *lo; /* Start of the mapping, page aligned */
+    size_t len;        /* Length in bytes, a multiple of the page size */
+    struct MMAP *next; /* Next lower mapping */
+} mem_map_t;
+
+static mem_map_t *mappings = NULL;   /* Mappings, highest address first */
+static unsigned char *mem_map_floor; /* Start of the lowest mapping */
+static size_t mapped_bytes = 0;      /* Total length of the mappings */
 
 #ifdef NO_CHECK_UB
 static const bool checkUB = false;
@@ -116,7 +164,66 @@ const char *__msan_default_options(void) {
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
+static void reset_sparse(void);
 static void print_stats(void);
+static void unmap_all(void);
+static bool thp_enabled(void);
+static unsigned char *map_huge(size_t len);
+
+/*
+ * mem_use_huge_pages - back the dense heap of the next mem_init by
+ *   transparent huge pages, or not
+ */
+void mem_use_huge_pages(bool huge) {
+    use_huge = huge;
+}
+
+/*
+ * thp_enabled - Can madvise get transparent huge pages? They are
+ *   disabled by "never" in sysfs, where madvise still succeeds.
+ */
+static bool thp_enabled(void) {
+    char mode[64];
+    FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (fp == NULL)
+        return false;
+    bool enabled = fgets(mode, sizeof(mode), fp) != NULL &&
+                   strstr(mode, "[never]") == NULL;
+    fclose(fp);
+    return enabled;
+}
+
+/*
+ * map_huge - reserve len bytes aligned to a huge page, preferably at
+ *   TRY_DENSE_HEAP_START, and advise them to be backed by huge pages.
+ *   Returns NULL if the kernel has no transparent huge pages, or they are
+ *   disabled.
+ */
+static unsigned char *map_huge(size_t len) {
+    if (!thp_enabled())
+        return NULL;
+
+    size_t slack = HUGE_PAGE_SIZE;
+    unsigned char *addr =
+        mmap(TRY_DENSE_HEAP_START, len + slack, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    /* Trim the reservation to an aligned start */
+    uintptr_t start = ((uintptr_t)addr + slack - 1) & ~(uintptr_t)(slack - 1);
+    unsigned char *lo = (unsigned char *)start;
+    if (lo > addr)
+        munmap(addr, (size_t)(lo - addr));
+    if (lo + len < addr + len + slack)
+        munmap(lo + len, (size_t)(addr + len + slack - (lo + len)));
+
+    if (madvise(lo, len, MADV_HUGEPAGE) != 0) {
+        munmap(lo, len);
+        return NULL;
+    }
+    return lo;
+}
 
 /*
  * mem_init - initialize the memory system model
@@ -125,49 +232,54 @@ void mem_init(bool do_sparse) {
     sparse = do_sparse;
     if (sparse) {
         /* Want sparse total allocation to approximately match the dense heap
-         * size */
-        /* Account for both page itself and its amortized contribution to the
-         * page table */
-        double fbytes_per_page =
-            sizeof(mem_block_t) + sizeof(mem_block_t *) / HASH_LOAD;
-        num_pages = (size_t)(MAX_DENSE_HEAP / fbytes_per_page);
-        num_buckets = (size_t)((double)num_pages / HASH_LOAD);
-        mmap_length = num_buckets * sizeof(mem_block_t *) + // Page table
-                      num_pages * sizeof(mem_block_t) +     // Pages
-                      sizeof(uint64_t);                     // Padding
+         * size.  The padding lets mem_read load a whole word at the end of
+         * the last page. */
+        mmap_length = MAX_DENSE_HEAP + sizeof(uint64_t);
         setUBCheck(true);
     } else {
         /* Dense allocation */
-        next_free_page = NULL;
-        num_pages = 0;
-        page_table = NULL;
-        num_buckets = 0;
+        sparse_mem = NULL;
         mmap_length = MAX_DENSE_HEAP;
     }
 
+    void *addr = NULL;
+    heap_page = mem_pagesize();
+    if (!sparse && use_huge) {
+        if ((addr = map_huge(mmap_length)) != NULL)
+            heap_page = HUGE_PAGE_SIZE;
+        else
+            fprintf(stderr, "WARNING: no transparent huge pages, the heap "
+                            "uses normal pages\n");
+    }
+
     int dev_zero = open("/dev/zero", O_RDWR);
     void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
-    void *addr = mmap(start,                  /* suggested start*/
-                      mmap_length,            /* length */
-                      PROT_READ | PROT_WRITE, /* permissions */
-                      MAP_PRIVATE,            /* private or shared? */
-                      dev_zero,               /* fd */
-                      0);                     /* offset */
+    if (addr == NULL)
+        addr = mmap(start,                  /* suggested start*/
+                    mmap_length,            /* length */
+                    PROT_READ | PROT_WRITE, /* permissions */
+                    MAP_PRIVATE,            /* private or shared? */
+                    dev_zero,               /* fd */
+                    0);                     /* offset */
+    close(dev_zero);
     if (addr == MAP_FAILED) {
         fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
         exit(1);
     }
     if (sparse) {
-        /* Use initial space for page table */
-        page_table = (mem_block_t **)addr;
+        /* Emulated pages and page table come from the mapping */
+        sparse_mem = addr;
         heap = SPARSE_HEAP_START;
         mem_max_addr = heap + MAX_SPARSE_HEAP;
+        reset_sparse();
     } else {
         heap = addr;
         mem_max_addr = heap + MAX_DENSE_HEAP;
     }
     stats_printed = false;
     mem_brk = heap;
+    mem_peak = 0;
+    mem_map_floor = mem_max_addr;
 }
 
 /*
@@ -175,11 +287,14 @@ void mem_init(bool do_sparse) {
  */
 void mem_deinit(void) {
     print_stats();
-    munmap(heap, mmap_length);
-    next_free_page = NULL;
-    num_free_pages = 0;
-    page_table = NULL;
-    num_buckets = 0;
+    unmap_all();
+    munmap(sparse ? sparse_mem : heap, mmap_length);
+    sparse_mem = NULL;
+    free_lo = free_hi = NULL;
+    page_root = NULL;
+    page_levels = 0;
+    last_id = SIZE_MAX;
+    last_page = NULL;
 }
 
 /*
@@ -187,13 +302,9 @@ void mem_deinit(void) {
  */
 void mem_reset_brk(void) {
     print_stats();
+    unmap_all();
     if (sparse) {
-        /* Clear page table */
-        size_t ptb = num_buckets * sizeof(mem_block_t *);
-        memset((void *)page_table, 0, ptb);
-        /* First page is just beyond page table */
-        next_free_page = (mem_block_t *)((unsigned char *)page_table + ptb);
-        num_free_pages = num_pages;
+        reset_sparse();
     } else {
 #ifdef USE_ASAN
         /* Mark the entire heap as unaddressable */
@@ -209,24 +320,51 @@ void mem_reset_brk(void) {
 #endif
     }
     mem_brk = heap;
+    mem_peak = 0;
+}
+
+/*
+ * update_peak - record the current footprint if it is the highest so far
+ */
+static void update_peak(void) {
+    size_t footprint = (size_t)(mem_brk - heap) + mapped_bytes;
+    if (footprint > mem_peak)
+        mem_peak = footprint;
+}
+
+/*
+ * decommit_pages - release the physical pages of the given size entirely
+ *   within [lo, hi) of the dense heap. Their contents read as zero
+ *   afterwards.
+ */
+static void decommit_pages(unsigned char *lo, unsigned char *hi,
+                           uintptr_t page) {
+    uintptr_t start = ((uintptr_t)lo + page - 1) & ~(page - 1);
+    uintptr_t end = (uintptr_t)hi & ~(page - 1);
+    if (sparse || start >= end)
+        return;
+    if (madvise((void *)start, end - start, MADV_DONTNEED) != 0) {
+        fprintf(stderr, "ERROR: madvise failed in decommit_pages\n");
+    }
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * A negative incr shrinks the heap, and the pages above the new break are
+ * released.
  */
 void *mem_sbrk(intptr_t incr) {
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
-    if (incr < 0) {
+    if (incr < 0 && mem_brk + incr < heap) {
         ok = false;
         fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
-    } else if (mem_brk + incr > mem_max_addr) {
+                "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld "
+                "below its start\n",
+                (long)-incr);
+    } else if (mem_brk + incr > mem_map_floor) {
         ok = false;
         ptrdiff_t alloc = mem_brk - heap + incr;
         fprintf(stderr,
@@ -235,7 +373,8 @@ void *mem_sbrk(intptr_t incr) {
                 alloc, alloc);
     }
 #if !defined DEBUG && !defined USE_MSAN && !defined USE_ASAN
-    else if (!sparse && sbrk(incr) == (void *)-1) {
+    /* Never shrink the real break, which libc's malloc may have moved */
+    else if (!sparse && incr >= 0 && sbrk(incr) == (void *)-1) {
         ok = false;
         fprintf(
             stderr,
@@ -244,11 +383,20 @@ void *mem_sbrk(intptr_t incr) {
 #endif
 
     if (ok) {
+        mem_brk += incr;
+        if (incr >= 0) {
 #ifdef USE_ASAN
-        /* Mark the extended section of the heap as addressable */
-        __asan_unpoison_memory_region(mem_brk, (size_t)incr);
+            /* Mark the extended section of the heap as addressable */
+            __asan_unpoison_memory_region(old_brk, (size_t)incr);
 #endif
-        mem_brk += incr;
+            update_peak();
+        } else {
+#ifdef USE_ASAN
+            /* Mark the released section of the heap as unaddressable */
+            __asan_poison_memory_region(mem_brk, (size_t)-incr);
+#endif
+            decommit_pages(mem_brk, old_brk, mem_pagesize());
+        }
         return (void *)old_brk;
     } else {
         errno = ENOMEM;
@@ -277,6 +425,216 @@ size_t mem_heapsize(void) {
     return (size_t)(mem_brk - heap);
 }
 
+/*
+ * mem_heap_peak() - returns the highest footprint in bytes since the last
+ *   reset, counting both the heap and the mappings
+ */
+size_t mem_heap_peak(void) {
+    return mem_peak;
+}
+
+/*
+ * find_mapping - returns the mapping of len bytes starting at addr, and the
+ *   next higher mapping in *above (NULL if none)
+ */
+static mem_map_t *find_mapping(const void *addr, size_t len,
+                               mem_map_t **above) {
+    size_t page = mem_pagesize();
+    len = (len + page - 1) & ~(page - 1);
+    *above = NULL;
+    for (mem_map_t *m = mappings; m; m = m->next) {
+        if (m->lo == addr)
+            return m->len == len ? m : NULL;
+        *above = m;
+    }
+    return NULL;
+}
+
+/*
+ * mem_map - simple model of an anonymous mmap.  Returns a page aligned
+ *   region of len bytes (rounded up to pages), or NULL if there is no room
+ *   above the break or in sparse mode.
+ */
+void *mem_map(size_t len) {
+    size_t page = mem_pagesize();
+    len = (len + page - 1) & ~(page - 1);
+    if (sparse || len == 0)
+        return NULL;
+
+    /* Take the highest gap that fits */
+    unsigned char *top = mem_max_addr;
+    mem_map_t **link = &mappings;
+    while (*link && (size_t)(top - ((*link)->lo + (*link)->len)) < len) {
+        top = (*link)->lo;
+        link = &(*link)->next;
+    }
+    if (*link == NULL && top - mem_brk < (ptrdiff_t)len)
+        return NULL;
+
+    mem_map_t *m = malloc(sizeof(mem_map_t));
+    if (m == NULL)
+        return NULL;
+    m->lo = top - len;
+    m->len = len;
+    m->next = *link;
+    *link = m;
+    if (m->lo < mem_map_floor)
+        mem_map_floor = m->lo;
+
+#ifdef USE_ASAN
+    __asan_unpoison_memory_region(m->lo, len);
+#endif
+    mapped_bytes += len;
+    update_peak();
+    return m->lo;
+}
+
+/*
+ * mem_unmap - release a region returned by mem_map or mem_remap
+ */
+void mem_unmap(void *addr, size_t len) {
+    mem_map_t *above;
+    mem_map_t *m = find_mapping(addr, len, &above);
+    if (m == NULL) {
+        fprintf(stderr, "ERROR: mem_unmap of %p:%zu, which is not mapped\n",
+                addr, len);
+        return;
+    }
+
+    decommit_pages(m->lo, m->lo + m->len, mem_pagesize());
+#ifdef USE_ASAN
+    __asan_poison_memory_region(m->lo, m->len);
+#endif
+    if (above)
+        above->next = m->next;
+    else
+        mappings = m->next;
+    if (m->lo == mem_map_floor)
+        mem_map_floor = above ? above->lo : mem_max_addr;
+    mapped_bytes -= m->len;
+    free(m);
+}
+
+/*
+ * mem_remap - simple model of mremap.  Resizes a mapping in place if the
+ *   pages above it are free, and moves it otherwise.  Unlike mremap, moving
+ *   copies the contents.  Returns the new address, or NULL (and leaves the
+ *   mapping untouched) if there is no room.
+ */
+void *mem_remap(void *addr, size_t old_len, size_t new_len) {
+    mem_map_t *above;
+    mem_map_t *m = find_mapping(addr, old_len, &above);
+    if (m == NULL) {
+        fprintf(stderr, "ERROR: mem_remap of %p:%zu, which is not mapped\n",
+                addr, old_len);
+        return NULL;
+    }
+
+    size_t page = mem_pagesize();
+    new_len = (new_len + page - 1) & ~(page - 1);
+    unsigned char *limit = above ? above->lo : mem_max_addr;
+    if (new_len <= m->len || m->lo + new_len <= limit) {
+        if (new_len < m->len) {
+            decommit_pages(m->lo + new_len, m->lo + m->len, mem_pagesize());
+#ifdef USE_ASAN
+            __asan_poison_memory_region(m->lo + new_len, m->len - new_len);
+        } else {
+            __asan_unpoison_memory_region(m->lo, new_len);
+#endif
+        }
+        mapped_bytes = mapped_bytes - m->len + new_len;
+        m->len = new_len;
+        update_peak();
+        return m->lo;
+    }
+
+    unsigned char *lo = mem_map(new_len);
+    if (lo == NULL)
+        return NULL;
+    memcpy(lo, addr, m->len);
+    mem_unmap(addr, m->len);
+    return lo;
+}
+
+/*
+ * mem_mapped - returns whether [addr, addr + len) lies within one mapping
+ */
+bool mem_mapped(const void *addr, size_t len) {
+    const unsigned char *lo = addr;
+    for (mem_map_t *m = mappings; m; m = m->next) {
+        if (lo >= m->lo && lo + len <= m->lo + m->len)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * unmap_all - release every mapping
+ */
+static void unmap_all(void) {
+    while (mappings)
+        mem_unmap(mappings->lo, mappings->len);
+}
+
+/*
+ * mem_decommit - release the pages entirely within [addr, addr + len) of
+ *   the heap. The contents of those pages become undefined. This is a no-op
+ *   in sparse mode.
+ */
+void mem_decommit(void *addr, size_t len) {
+    unsigned char *lo = (unsigned char *)addr;
+    if (lo < heap || lo + len > mem_brk) {
+        fprintf(stderr, "ERROR: mem_decommit of %p..%p is outside the heap\n",
+                addr, (void *)(lo + len));
+        return;
+    }
+    decommit_pages(lo, lo + len, heap_page);
+}
+
+/*
+ * count_resident - returns how many of npages pages from lo are resident
+ */
+static size_t count_resident(unsigned char *lo, size_t npages) {
+    if (npages == 0)
+        return 0;
+
+    unsigned char *vec = malloc(npages);
+    if (vec == NULL || mincore(lo, npages * mem_pagesize(), vec) != 0) {
+        free(vec);
+        return 0;
+    }
+    size_t resident = 0;
+    for (size_t i = 0; i < npages; i++)
+        resident += vec[i] & 1;
+    free(vec);
+    return resident;
+}
+
+/*
+ * mem_resident - returns the number of heap and mapped bytes backed by
+ *   physical memory. In sparse mode, this is the size of the emulated pages
+ *   in use.
+ */
+size_t mem_resident(void) {
+    if (sparse)
+        return num_pages * SPARSE_PAGE_SIZE;
+
+    size_t page = mem_pagesize();
+    size_t npages = ((size_t)(mem_brk - heap) + page - 1) / page;
+    size_t resident = count_resident(heap, npages);
+    for (mem_map_t *m = mappings; m; m = m->next)
+        resident += count_resident(m->lo, m->len / page);
+    return resident * page;
+}
+
+/*
+ * mem_heap_pagesize() - returns the size of the pages backing the heap,
+ *   HUGE_PAGE_SIZE if they are transparent huge pages
+ */
+size_t mem_heap_pagesize(void) {
+    return heap_page ? heap_page : mem_pagesize();
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -396,6 +754,27 @@ void *mem_memcpy(void *dst, const void *src, size_t num_bytes) {
     return savedst;
 }
 
+/* Emulation of memmove */
+void *mem_memmove(void *dst, const void *src, size_t num_bytes) {
+    /* A forward copy is safe unless dst overlaps the end of src */
+    if ((unsigned char *)dst <= (const unsigned char *)src ||
+        (unsigned char *)dst >= (const unsigned char *)src + num_bytes)
+        return mem_memcpy(dst, src, num_bytes);
+
+    size_t word_size = sizeof(uint64_t);
+    while (num_bytes >= word_size) {
+        num_bytes -= word_size;
+        uint64_t data =
+            mem_read((const unsigned char *)src + num_bytes, word_size);
+        mem_write((unsigned char *)dst + num_bytes, data, word_size);
+    }
+    if (num_bytes) {
+        uint64_t data = mem_read(src, num_bytes);
+        mem_write(dst, data, num_bytes);
+    }
+    return dst;
+}
+
 /* Emulation of memset */
 void *mem_memset(void *dst, int c, size_t num_bytes) {
     void *savedst = dst;
@@ -450,11 +829,10 @@ static void print_stats(void) {
     if (!show_stats || vbytes == 0 || stats_printed)
         return;
     if (sparse) {
-        size_t ppages = num_pages - num_free_pages;
-        size_t pbytes = ppages * SPARSE_PAGE_SIZE;
-        printf("Allocated %zu/%zu pages (%zu bytes) to cover %zu heap bytes "
-               "(%.4f%% density).  Max address = %p\n",
-               ppages, num_pages, pbytes, vbytes,
+        size_t pbytes = num_pages * SPARSE_PAGE_SIZE;
+        printf("Allocated %zu pages (%zu bytes) and %zu page table nodes to "
+               "cover %zu heap bytes (%.4f%% density).  Max address = %p\n",
+               num_pages, pbytes, num_nodes, vbytes,
                100.0 * (double)pbytes / (double)vbytes, (void *)mem_brk);
     } else {
         printf("Allocated %zu heap bytes.  Max address = %p\n", vbytes,
@@ -477,35 +855,88 @@ static void *page_start(size_t id) {
     return (void *)((unsigned char *)SPARSE_HEAP_START + offset);
 }
 
+/* Report that the emulation has used up its memory and exit */
+static void out_of_sparse_memory(void) {
+    /*
+     * This will often fail due to student code that either accesses
+     *  too many memory locations, such as checking every byte in a
+     *  block.  Or more commonly due to poor utilization, such as
+     *  leaking or not finding the huge allocations.
+     */
+    fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
+    exit(1);
+}
+
+/* Allocate an empty page table node from the top of the free memory */
+static radix_node_t *new_node(void) {
+    if ((size_t)(free_hi - free_lo) < sizeof(radix_node_t))
+        out_of_sparse_memory();
+    free_hi -= sizeof(radix_node_t);
+    radix_node_t *node = (radix_node_t *)free_hi;
+    memset(node, 0, sizeof(*node));
+    num_nodes++;
+    return node;
+}
+
+/* Allocate an unwritten page from the bottom of the free memory */
+static mem_block_t *new_page(void) {
+    if ((size_t)(free_hi - free_lo) < sizeof(mem_block_t))
+        out_of_sparse_memory();
+    mem_block_t *block = (mem_block_t *)free_lo;
+    free_lo += sizeof(mem_block_t);
+    memset(block->initSet, 0, sizeof(block->initSet));
+    num_pages++;
+    return block;
+}
+
+/* Drop all pages and start with an empty page table */
+static void reset_sparse(void) {
+    free_lo = sparse_mem;
+    free_hi = sparse_mem + MAX_DENSE_HEAP;
+    num_pages = 0;
+    num_nodes = 0;
+    page_root = new_node();
+    page_levels = 0;
+    last_id = SIZE_MAX;
+    last_page = NULL;
+}
+
+/* Look up a page in the page table.  Allocate it if necessary */
+static mem_block_t *find_page(size_t id) {
+    unsigned int shift;
+
+    /* Add levels on top until the root covers the ID */
+    while (RADIX_BITS * (page_levels + 1) < PAGE_ID_BITS &&
+           (id >> (RADIX_BITS * (page_levels + 1))) != 0) {
+        radix_node_t *root = new_node();
+        root->child[0] = page_root;
+        page_root = root;
+        page_levels++;
+    }
+
+    radix_node_t *node = page_root;
+    for (shift = RADIX_BITS * page_levels; shift > 0; shift -= RADIX_BITS) {
+        void **slot = &node->child[(id >> shift) & (RADIX_FANOUT - 1)];
+        if (*slot == NULL)
+            *slot = new_node();
+        node = *slot;
+    }
+
+    void **slot = &node->child[id & (RADIX_FANOUT - 1)];
+    if (*slot == NULL)
+        *slot = new_page();
+    return *slot;
+}
+
 /* Get memory to store value.  Allocate page if necessary */
 static void *get_mem(const void *addr, size_t size, bool isWrite) {
     size_t id = page_id(addr);
-    size_t b = id % num_buckets; // A very simple hash function
-    unsigned int i;
-
-    mem_block_t *block = page_table[b];
-    while (block && block->id != id)
-        block = block->next;
-    if (!block) {
-        /* Need to allocate a new block */
-        if (num_free_pages == 0) {
-            /*
-             * This will often fail due to student code that either accesses
-             *  too many memory locations, such as checking every byte in a
-             *  block.  Or more commonly due to poor utilization, such as
-             *  leaking or not finding the huge allocations.
-             */
-            fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
-            exit(1);
-        }
-        block = next_free_page++;
-        num_free_pages--;
-        block->id = id;
-        block->next = page_table[b];
-        for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
-            block->initSet[i] = 0;
-        page_table[b] = block;
+
+    if (id != last_id) {
+        last_page = find_page(id);
+        last_id = id;
     }
+    mem_block_t *block = last_page;
 
     // Convert an emulated address into an offset
     void *saddr = page_start(id);
@@ -513,34 +944,42 @@ static void *get_mem(const void *addr, size_t size, bool isWrite) {
     assert(offset >= 0);
 
 #ifndef NO_CHECK_UB
-    // Compute the bit vector lookup for this 'offset'
-    size_t offsetIdx = (size_t)offset / 8;
-    size_t offsetBit = (size_t)offset & 0x7ul;
-
-    // For each byte in this access, update the bitvector that tracks
-    //  the use / initialization of emulated bytes.
-    for (i = 0; i < size; i++) {
-        if (isWrite) {
-            block->initSet[offsetIdx] |= (0x1 << offsetBit);
-        } else if (checkUB &&
-                   (block->initSet[offsetIdx] & (0x1 << offsetBit)) == 0) {
-            // The student code has attempted to read an address that was
-            //  never written to.  Students should set a breakpoint on this
-            //  line / check and then backtrace to where their code has
-            //  made the memory access.
-            fprintf(stderr,
-                    "Attempt to read uninitialized address %p, see %s:%d for "
-                    "details\n",
-                    (addr + i), __FILE__, __LINE__);
-            abort();
-        }
-        offsetBit++;
-        if (offsetBit == 8) {
-            offsetBit = 0;
-            offsetIdx++;
-        }
-        if (offsetIdx == (SPARSE_PAGE_SIZE / 8))
-            break;
+    // Bits of the bit vector that tracks the use / initialization of the
+    //  emulated bytes of this access, up to the end of the page.  They can
+    //  straddle two words of the vector.
+    assert(size <= sizeof(uint64_t));
+    size_t nbytes = size;
+    if ((size_t)offset + nbytes > SPARSE_PAGE_SIZE)
+        nbytes = SPARSE_PAGE_SIZE - (size_t)offset;
+    uint64_t bits = ((uint64_t)1 << nbytes) - 1;
+    size_t wordIdx = (size_t)offset / 64;
+    size_t wordBit = (size_t)offset % 64;
+    uint64_t loMask = bits << wordBit;
+    uint64_t hiMask = wordBit + nbytes > 64 ? bits >> (64 - wordBit) : 0;
+
+    if (isWrite) {
+        block->initSet[wordIdx] |= loMask;
+        if (hiMask != 0)
+            block->initSet[wordIdx + 1] |= hiMask;
+    } else if (checkUB &&
+               ((block->initSet[wordIdx] & loMask) != loMask ||
+                (hiMask != 0 &&
+                 (block->initSet[wordIdx + 1] & hiMask) != hiMask))) {
+        // Find the first byte that was never written
+        size_t i = 0;
+        while (i < nbytes &&
+               (block->initSet[((size_t)offset + i) / 64] >>
+                ((size_t)offset + i) % 64) & 1)
+            i++;
+        // The student code has attempted to read an address that was
+        //  never written to.  Students should set a breakpoint on this
+        //  line / check and then backtrace to where their code has
+        //  made the memory access.
+        fprintf(stderr,
+                "Attempt to read uninitialized address %p, see %s:%d for "
+                "details\n",
+                (const unsigned char *)addr + i, __FILE__, __LINE__);
+        abort();
     }
 #endif
 
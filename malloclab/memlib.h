@@ -23,16 +23,26 @@ void mem_init(bool sparse);
  */
 void mem_deinit(void);
 
+/**
+ * @brief Backs the dense heap by transparent huge pages.
+ *
+ * Takes effect at the next mem_init(). If the kernel has no transparent huge
+ * pages, the heap falls back to normal pages with a warning.
+ *
+ * @param[in] huge Whether to use huge pages
+ */
+void mem_use_huge_pages(bool huge);
+
 /**
  * @brief Extends the heap by incr bytes.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. A negative incr
+ * shrinks the heap, and the pages above the new break are released.
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
  *         breakpoint)
- * @pre `incr > 0`
+ * @pre `mem_heapsize() + incr >= 0`
  */
 void *mem_sbrk(intptr_t incr);
 
@@ -63,6 +73,80 @@ void *mem_heap_hi(void);
  */
 size_t mem_heapsize(void);
 
+/**
+ * @brief Returns the highest footprint since the heap was last reset.
+ * @return The peak size of the heap plus the mappings, in bytes
+ */
+size_t mem_heap_peak(void);
+
+/**
+ * @brief Maps a region of memory outside of the heap.
+ *
+ * This function is a simple model of an anonymous mmap(). Regions are taken
+ * from the top of the heap area downwards, and the heap cannot grow past
+ * them. Mappings are not available in sparse mode.
+ *
+ * @param[in] len The length of the region, rounded up to the page size
+ * @return The page aligned start of the region, or NULL if there is no room
+ */
+void *mem_map(size_t len);
+
+/**
+ * @brief Unmaps a region returned by mem_map() or mem_remap().
+ * @param[in] addr Start of the region
+ * @param[in] len Length of the region, as it was mapped
+ */
+void mem_unmap(void *addr, size_t len);
+
+/**
+ * @brief Resizes a mapped region, moving it if it cannot grow in place.
+ *
+ * This function is a simple model of mremap() with MREMAP_MAYMOVE. The
+ * contents are preserved up to the smaller of both lengths.
+ *
+ * @param[in] addr Start of the region
+ * @param[in] old_len Length of the region, as it was mapped
+ * @param[in] new_len New length of the region
+ * @return The new start of the region, or NULL if there is no room, in which
+ *         case the region is left untouched
+ */
+void *mem_remap(void *addr, size_t old_len, size_t new_len);
+
+/**
+ * @brief Checks whether a range lies within a single mapped region.
+ * @param[in] addr Start of the range
+ * @param[in] len Length of the range in bytes
+ * @return True if the range is mapped
+ */
+bool mem_mapped(const void *addr, size_t len);
+
+/**
+ * @brief Releases the physical pages of a heap range.
+ *
+ * Only the pages entirely within the range are released, and their contents
+ * become undefined. These are huge pages if the heap is backed by them. The
+ * range stays part of the heap and can be written again. This is a no-op in
+ * sparse mode.
+ *
+ * @param[in] addr Start of the range
+ * @param[in] len Length of the range in bytes
+ */
+void mem_decommit(void *addr, size_t len);
+
+/**
+ * @brief Returns the number of heap and mapped bytes backed by physical
+ *        memory.
+ * @return The resident size of the heap and the mappings, in bytes
+ */
+size_t mem_resident(void);
+
+/**
+ * @brief Returns the size of the pages backing the heap.
+ * @return HUGE_PAGE_SIZE if the heap is backed by transparent huge pages,
+ *         and the system page size otherwise
+ */
+size_t mem_heap_pagesize(void);
+
 /**
  * @brief Returns the system page size.
  * @return The page size of the system, in bytes
@@ -112,6 +196,15 @@ void mem_write128(void *addr, __int128_t val);
  */
 void *mem_memcpy(void *dst, const void *src, size_t n);
 
+/**
+ * @brief Emulation of memmove
+ * @param[in] dst
+ * @param[in] src
+ * @param[in] n
+ * @return
+ */
+void *mem_memmove(void *dst, const void *src, size_t n);
+
 /**
  * @brief Emulation of memset
  * @param[in] dst
@@ -0,0 +1,31 @@
+/*
+ * mm-backend.c - The table of entry points through which mdriver calls an
+ *     allocator.  Compiled with the same MM_NAMESPACE as the allocator, it
+ *     refers to that allocator's functions.
+ */
+#include "mm-backend.h"
+
+#ifndef MM_BACKEND_NAME
+#define MM_BACKEND_NAME "mm"
+#endif
+
+const mm_backend_t mm_backend = {
+    .name = MM_BACKEND_NAME,
+    .emulated = true,
+#ifdef MM_CONCURRENT
+    .thread_safe = true,
+#else
+    .thread_safe = false,
+#endif
+    .init = mm_init,
+    .malloc = mm_malloc,
+    .free = mm_free,
+    .realloc = mm_realloc,
+    .aligned_alloc = mm_aligned_alloc,
+    .usable_size = mm_usable_size,
+    .malloc_batch = mm_malloc_batch,
+    .free_sized = mm_free_sized,
+    .free_batch = mm_free_batch,
+    .checkheap = mm_checkheap,
+    .profile = mm_profile,
+};
@@ -0,0 +1,43 @@
+/**
+ * @file mm-backend.h
+ * @brief The allocator interface that mdriver calls through
+ *
+ * mdriver runs each allocator it is linked with through a table of its
+ * entry points. mm-backend.c builds the table of one allocator. It is
+ * compiled along with each allocator, with the same MM_NAMESPACE, and
+ * MM_BACKEND_NAME set to the name mdriver shows.
+ */
+#ifndef MM_BACKEND_H__
+#define MM_BACKEND_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mm.h"
+
+/** @brief Entry points and properties of an allocator */
+typedef struct {
+    const char *name; /**< Name to select and report it by */
+    bool emulated;    /**< Is its heap the one in memlib.c? */
+    bool thread_safe; /**< Can it be called from several threads? */
+    bool (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*aligned_alloc)(size_t alignment, size_t size);
+    size_t (*usable_size)(void *ptr);
+    size_t (*malloc_batch)(size_t size, size_t n, void **out);
+    void (*free_sized)(void *ptr, size_t size);
+    void (*free_batch)(void **ptrs, size_t n);
+    bool (*checkheap)(int line);
+    bool (*profile)(mm_profile_t *prof);
+} mm_backend_t;
+
+#ifdef MM_NAMESPACE
+#define mm_backend MM_NAMESPACED(MM_NAMESPACE, mm_backend)
+#endif
+
+/** @brief The table of the allocator built with the same MM_NAMESPACE */
+extern const mm_backend_t mm_backend;
+
+#endif /* mm-backend.h */
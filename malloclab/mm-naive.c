@@ -11,6 +11,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -30,6 +31,12 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define aligned_alloc mm_aligned_alloc
+#define posix_memalign mm_posix_memalign
+#define malloc_usable_size mm_usable_size
+#define malloc_batch mm_malloc_batch
+#define free_sized mm_free_sized
+#define free_batch mm_free_batch
 #define memset mem_memset
 #define memcpy mem_memcpy
 #endif /* def DRIVER */
@@ -172,6 +179,71 @@ void *calloc(size_t nmemb, size_t size) {
     return newptr;
 }
 
+/*
+ * aligned_alloc - Pad the heap so the payload of the next block lands on
+ *      the alignment, and allocate it.  The padding is never reused either.
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment <= ALIGNMENT)
+        return malloc(size);
+    if ((alignment & (alignment - 1)) != 0)
+        return NULL;
+
+    size_t payload = (size_t)mem_heap_hi() + 1 + HEADER_SIZE;
+    size_t pad = roundup(payload, alignment) - payload;
+    if (pad > 0 && mem_sbrk((intptr_t)pad) == (void *)-1)
+        return NULL;
+    return malloc(size);
+}
+
+/*
+ * posix_memalign - aligned_alloc, with errors reported as return values.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    void *p = aligned_alloc(alignment, size);
+    if (p == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+/*
+ * malloc_usable_size - The whole block but its header is usable.
+ */
+size_t malloc_usable_size(void *ptr) {
+    if (ptr == NULL)
+        return 0;
+    return payload_to_header(ptr)->size - HEADER_SIZE;
+}
+
+/*
+ * malloc_batch - Allocate the blocks one at a time.
+ */
+size_t malloc_batch(size_t size, size_t n, void **out) {
+    size_t i = 0;
+    while (i < n && (out[i] = malloc(size)) != NULL)
+        i++;
+    return i;
+}
+
+/*
+ * free_sized - Nothing to free, whatever the size.
+ */
+void free_sized(void *ptr, size_t size) {
+    free(ptr);
+}
+
+/*
+ * free_batch - Nothing to free either.
+ */
+void free_batch(void **ptrs, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        free(ptrs[i]);
+}
+
 /*
  * mm_checkheap - There are no bugs in my code, so I don't need to
  *      check, so nah! (But if I did, I could call this function using
@@ -182,6 +254,14 @@ bool mm_checkheap(int lineno) {
     return true;
 }
 
+/*
+ * mm_profile - Nothing is ever freed, so there is no fragmentation to
+ *      profile.
+ */
+bool mm_profile(mm_profile_t *prof) {
+    return false;
+}
+
 /***********************************************************************
  * Support functions
  ***********************************************************************/
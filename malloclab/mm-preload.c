@@ -0,0 +1,226 @@
+/*
+ * mm-preload.c - Runs a real program on the allocator in mm.c.  Built as
+ *     a shared library with mm.c and memlib.c, it replaces the malloc
+ *     family of a program, so both allocators can be timed on the same
+ *     workload:
+ *
+ *         time prog args...
+ *         time LD_PRELOAD=./libmm.so prog args...
+ *
+ *     mm.c is built with MM_CONCURRENT, as the program may have threads
+ *     and fork while they allocate, and with DRIVER, so that its entry
+ *     points are the mm_* functions that mdriver calls.  The functions
+ *     here set up the memory system and the allocator on the first
+ *     request and forward to them.
+ *
+ *     The heap is the dense heap of memlib.c, so a program can use at most
+ *     MAX_DENSE_HEAP bytes.  memlib.c allocates its own bookkeeping with
+ *     malloc() while mm.c is running; those requests, and the frees of the
+ *     blocks they return, go to libc through glibc's __libc_* entry points.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "memlib.h"
+#include "mm.h"
+
+/* mm.c must not be entered when its thread-local data is touched */
+#define TLS_MODEL __attribute__((tls_model("initial-exec")))
+
+/* The allocator in libc */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+/* Interposed functions, not all of which stdlib.h declares */
+void *malloc(size_t size);
+void free(void *ptr);
+void *realloc(void *ptr, size_t size);
+void *calloc(size_t nmemb, size_t size);
+void *reallocarray(void *ptr, size_t nmemb, size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+void *memalign(size_t alignment, size_t size);
+void *valloc(size_t size);
+void *pvalloc(size_t size);
+size_t malloc_usable_size(void *ptr);
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static bool mm_ready = false;         /* Did mm_init() succeed? */
+static char *heap_lo = NULL;          /* Bounds of the memory of mm.c */
+static char *heap_hi = NULL;
+static size_t (*libc_usable_size)(void *) = NULL; /* For blocks of libc */
+static _Thread_local bool in_mm TLS_MODEL = false; /* Inside mm.c? */
+
+/* Function prototypes */
+static void init(void);
+static bool enter(void);
+static void leave(void);
+static bool owned(const void *ptr);
+
+/*
+ * init - Set up the memory system and the allocator
+ */
+static void init(void) {
+    /* glibc has no __libc_ entry point for it */
+    libc_usable_size =
+        (size_t(*)(void *))dlsym(RTLD_NEXT, "malloc_usable_size");
+
+    mem_init(false);
+    heap_lo = mem_heap_lo();
+    heap_hi = heap_lo + MAX_DENSE_HEAP;
+    if (!mm_init()) {
+        fprintf(stderr, "mm-preload: mm_init failed\n");
+        return;
+    }
+    mm_ready = true;
+}
+
+/*
+ * enter - Start a request.  Returns false if it must go to libc, because
+ *     mm.c is already running on this thread or could not be set up.
+ */
+static bool enter(void) {
+    if (in_mm)
+        return false;
+    in_mm = true;
+    pthread_once(&init_once, init);
+    if (!mm_ready) {
+        in_mm = false;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * leave - Done with a request
+ */
+static void leave(void) {
+    in_mm = false;
+}
+
+/*
+ * owned - Was the block returned by mm.c?
+ */
+static bool owned(const void *ptr) {
+    return mm_ready && (const char *)ptr >= heap_lo &&
+           (const char *)ptr < heap_hi;
+}
+
+/*
+ * The interposed functions
+ */
+void *malloc(size_t size) {
+    if (!enter())
+        return __libc_malloc(size);
+    void *p = mm_malloc(size);
+    leave();
+    if (p == NULL && size != 0)
+        errno = ENOMEM;
+    return p;
+}
+
+void free(void *ptr) {
+    if (owned(ptr))
+        mm_free(ptr);
+    else
+        __libc_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr != NULL && !owned(ptr))
+        return __libc_realloc(ptr, size);
+    if (!enter())
+        return __libc_realloc(ptr, size);
+    void *p = mm_realloc(ptr, size);
+    leave();
+    if (p == NULL && size != 0)
+        errno = ENOMEM;
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (!enter())
+        return __libc_calloc(nmemb, size);
+    void *p = mm_calloc(nmemb, size);
+    leave();
+    if (p == NULL && nmemb != 0 && size != 0)
+        errno = ENOMEM;
+    return p;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, bytes);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    if (!enter()) {
+        void *p = __libc_memalign(alignment, size);
+        if (p == NULL)
+            return ENOMEM;
+        *memptr = p;
+        return 0;
+    }
+    int err = mm_posix_memalign(memptr, alignment, size);
+    leave();
+    return err;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    void *p;
+
+    /* memalign() rounds up an alignment that is not a power of 2 */
+    size_t align = sizeof(void *);
+    while (align < alignment)
+        align <<= 1;
+    int err = posix_memalign(&p, align, size);
+    if (err != 0) {
+        errno = err;
+        return NULL;
+    }
+    return p;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if (ptr == NULL)
+        return 0;
+    if (owned(ptr))
+        return mm_usable_size(ptr);
+
+    /* A block of libc, maybe from before mm.c was set up by init */
+    if (enter())
+        leave();
+    return libc_usable_size != NULL ? libc_usable_size(ptr) : 0;
+}
@@ -20,6 +20,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -45,11 +46,23 @@
 /// Use FIFO when inserting a free block to its list if defined, otherwise LIFO
 // #define INSERT_POLICY_FIFO
 
+/**
+ * Index free blocks with a red-black tree keyed on (size, address) if defined,
+ * otherwise with a splay tree keyed on size
+ */
+#define TREE_POLICY_RB
+
 #ifdef DRIVER
 #define malloc mm_malloc
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define aligned_alloc mm_aligned_alloc
+#define posix_memalign mm_posix_memalign
+#define malloc_usable_size mm_usable_size
+#define malloc_batch mm_malloc_batch
+#define free_sized mm_free_sized
+#define free_batch mm_free_batch
 #define memset mem_memset
 #define memcpy mem_memcpy
 #endif /* def DRIVER */
@@ -136,6 +149,13 @@ static const size_t chunksize = (1 << 12);
  */
 static const word_t alloc_mask = 0x1;
 
+/**
+ * Mask of the color bit in the header of a free block in the red-black tree.
+ * Set if the block is red. write_block clears it, so a block must be removed
+ * from the tree before it is rewritten.
+ */
+static const word_t red_mask = 0x2;
+
 /**
  * The size mask is used to clear the last 4 bits to get the size of a block
  */
@@ -175,15 +195,17 @@ static void tree_insert(block_t *block);
 static block_t *tree_find(block_t *block);
 static block_t *tree_find_nearest(size_t size);
 static void tree_remove(block_t *block);
+#ifdef TREE_POLICY_RB
+static bool is_red(block_t *block);
+static bool tree_less(block_t *a, block_t *b);
+#endif
 
 /* Global variables */
 
-block_t *tree;
+static block_t *tree;
 
-#ifdef DEBUG
 /** @brief Pointer to first block heap */
 static block_t *heap_start = NULL;
-#endif
 
 /*
  * ---------------------------------------------------------------------------
@@ -449,8 +471,7 @@ static block_t *coalesce_block(block_t *block) {
     block_t *next = NULL;
     if (extract_size(*prev_footer))
         prev = footer_to_header(prev_footer);
-    if (extract_size(*prev_footer))
-        next = find_next(block);
+    next = find_next(block);
 
     // prev block is free
     if (prev && !get_alloc(prev)) {
@@ -536,12 +557,16 @@ static void split_block(block_t *block, size_t asize) {
     dbg_assert(get_size(block) >= min_block_size);
 
     size_t block_size = get_size(block);
-    if ((block_size - asize) >= (size_t)(min_block_size * SPLIT_FACTOR)) {
+    if ((block_size - asize) >=
+        (size_t)((double)min_block_size * SPLIT_FACTOR)) {
         write_block(block, asize, true);
 
         block_t *block_next = find_next(block);
         write_block(block_next, block_size - asize, false);
         tree_insert(block_next);
+
+        // a block shrunk by realloc may be followed by a free block
+        coalesce_block(block_next);
     }
 
     dbg_ensures(get_alloc(block));
@@ -563,31 +588,188 @@ static block_t *find_fit(size_t asize) {
 }
 
 /**
- * @brief
+ * @brief Checks the blocks of the heap, from heap_start to the epilogue
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * Every block must be aligned, at least min_block_size bytes, and have a
+ * footer matching its header. No two free blocks may be next to each other.
  *
- * @param[in] line
- * @return
+ * @param[out] n_free The number of free blocks
+ * @return True if all blocks are valid
+ */
+static bool check_blocks(size_t *n_free) {
+    block_t *block = heap_start;
+    bool prev_free = false;
+    *n_free = 0;
+    while (get_size(block) != 0) {
+        size_t size = get_size(block);
+        if ((uintptr_t)header_to_payload(block) % dsize != 0 ||
+            size % dsize != 0 || size < min_block_size) {
+            printf("checkheap: bad block of %zu bytes at 0x%lx\n", size,
+                   (uintptr_t)block);
+            return false;
+        }
+        if ((char *)block + size > (char *)mem_heap_hi() - 7) {
+            printf("checkheap: block at 0x%lx runs past the heap\n",
+                   (uintptr_t)block);
+            return false;
+        }
+
+        word_t footer = *header_to_footer(block);
+        if (extract_size(footer) != size ||
+            extract_alloc(footer) != get_alloc(block)) {
+            printf("checkheap: header and footer differ at 0x%lx\n",
+                   (uintptr_t)block);
+            return false;
+        }
+
+        bool free_block = !get_alloc(block);
+        if (free_block && prev_free) {
+            printf("checkheap: free blocks not coalesced at 0x%lx\n",
+                   (uintptr_t)block);
+            return false;
+        }
+        if (free_block)
+            ++*n_free;
+        prev_free = free_block;
+        block = find_next(block);
+    }
+
+    if ((char *)block != (char *)mem_heap_hi() - 7) {
+        printf("checkheap: epilogue at 0x%lx is not at the end of the heap\n",
+               (uintptr_t)block);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Checks a subtree of the free block tree
+ *
+ * Every node must be a free block linked back to its parent, and lie
+ * between low and high in the order of the tree. With TREE_POLICY_RB, no
+ * red node may have a red child, and every path down to a leaf must cross
+ * the same number of black nodes.
+ *
+ * @param[in] node The root of the subtree, NULL for a leaf
+ * @param[in] parent The parent node is linked to
+ * @param[in] low A node that must come before the subtree, or NULL
+ * @param[in] high A node that must come after the subtree, or NULL
+ * @param[in] limit The number of nodes there may still be
+ * @param[in,out] count Incremented by the number of nodes of the subtree
+ * @return The number of black nodes on the paths down from node, -1 if the
+ *         subtree is invalid
+ */
+static int check_subtree(block_t *node, block_t *parent, block_t *low,
+                         block_t *high, size_t limit, size_t *count) {
+    if (!node)
+        return 0;
+
+    if (++*count > limit) {
+        printf("checkheap: the tree has more nodes than free blocks\n");
+        return -1;
+    }
+    if (get_alloc(node)) {
+        printf("checkheap: allocated block 0x%lx in the tree\n",
+               (uintptr_t)node);
+        return -1;
+    }
+    if (node->list.parent != parent) {
+        printf("checkheap: wrong parent link at 0x%lx\n", (uintptr_t)node);
+        return -1;
+    }
+
+#ifdef TREE_POLICY_RB
+    bool ordered = (!low || tree_less(low, node)) &&
+                   (!high || tree_less(node, high));
+#else
+    bool ordered = (!low || get_size(low) <= get_size(node)) &&
+                   (!high || get_size(node) <= get_size(high));
+#endif
+    if (!ordered) {
+        printf("checkheap: block 0x%lx of %zu bytes is out of order\n",
+               (uintptr_t)node, get_size(node));
+        return -1;
+    }
+
+#ifdef TREE_POLICY_RB
+    if (is_red(node) && (is_red(node->list.left) || is_red(node->list.right))) {
+        printf("checkheap: red block 0x%lx has a red child\n",
+               (uintptr_t)node);
+        return -1;
+    }
+#endif
+
+    int left = check_subtree(node->list.left, node, low, node, limit, count);
+    if (left < 0)
+        return -1;
+    int right =
+        check_subtree(node->list.right, node, node, high, limit, count);
+    if (right < 0)
+        return -1;
+
+#ifdef TREE_POLICY_RB
+    if (left != right) {
+        printf("checkheap: black heights %d and %d differ below 0x%lx\n",
+               left, right, (uintptr_t)node);
+        return -1;
+    }
+    return left + !is_red(node);
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Checks the heap and the tree of free blocks
+ *
+ * The blocks are checked by check_blocks and the tree by check_subtree. The
+ * root of the tree must be black, and the tree must hold exactly the free
+ * blocks of the heap: as many of them, each once, with no allocated block.
+ *
+ * @param[in] line The line checkheap was called from
+ * @return True if the heap and the tree are consistent
  */
 bool mm_checkheap(int line) {
-    // TODO:
-    //      block_t *block = heap_start;
-    //      size_t size = 0;
-    //      while (block && (size = get_size(block))) {
-    //          if (get_size(block) < min_free_block_size)
-    //              printf("Block size to small (%ld) at 0x%lx (line %d)\n",
-    //              size,
-    //                     (uintptr_t)block, line);
-    //          block = find_next(block);
-    //      }
+    if (!heap_start)
+        return true;
+
+    size_t n_free;
+    if (!check_blocks(&n_free)) {
+        printf("checkheap failed at line %d\n", line);
+        return false;
+    }
+
+#ifdef TREE_POLICY_RB
+    if (is_red(tree)) {
+        printf("checkheap: the root of the tree is red\n");
+        printf("checkheap failed at line %d\n", line);
+        return false;
+    }
+#endif
 
+    size_t n_tree = 0;
+    if (check_subtree(tree, NULL, NULL, NULL, n_free, &n_tree) < 0) {
+        printf("checkheap failed at line %d\n", line);
+        return false;
+    }
+    if (n_tree != n_free) {
+        printf("checkheap: %zu free blocks, but %zu in the tree\n", n_free,
+               n_tree);
+        printf("checkheap failed at line %d\n", line);
+        return false;
+    }
     return true;
 }
 
+/**
+ * @brief Heap profiling is not supported by this allocator
+ * @param[out] prof Unused
+ * @return False
+ */
+bool mm_profile(mm_profile_t *prof) {
+    return false;
+}
+
 #ifdef DEBUG
 extern void print_heap(void);
 void print_heap(void) {
@@ -618,12 +800,10 @@ void print_heap(void) {
 bool mm_init(void) {
     // reset global variables
     tree_init();
-#ifdef DEBUG
     heap_start = NULL;
-#endif
 
     // Create the initial heap containing only the seglist + two epilogue
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
+    word_t *start = (word_t *)(mem_sbrk((intptr_t)(2 * wsize)));
     memset(start, 0, 2 * wsize);
 
     if (start == (void *)-1)
@@ -632,10 +812,8 @@ bool mm_init(void) {
     start[0] = pack(0, true); // Heap prologue (block footer)
     start[1] = pack(0, true); // Heap epilogue (block header)
 
-#ifdef DEBUG
     // Heap starts with first "block header", currently the epilogue
     heap_start = (block_t *)&(start[1]);
-#endif
 
     // Extend the empty heap with a free block of chunksize bytes
     // extend_heap will set free_list_start to this block
@@ -850,6 +1028,111 @@ void *calloc(size_t elements, size_t size) {
     return bp;
 }
 
+/**
+ * @brief Allocate a block whose payload is aligned to a power of two
+ *
+ * A block with room for the alignment is allocated, and the slack before the
+ * aligned payload is given back to the tree as a free block.
+ *
+ * @param[in] alignment Alignment of the payload, a power of two
+ * @param[in] size Size of the payload in bytes
+ * @return The aligned payload. NULL if out of memory or the alignment is
+ *         invalid.
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment <= dsize)
+        return malloc(size);
+    if ((alignment & (alignment - 1)) != 0 || size == 0)
+        return NULL;
+
+    size_t asize = round_up(size + dsize, dsize);
+    asize = max(asize, min_block_size);
+
+    void *bp = malloc(asize + alignment + min_block_size);
+    if (bp == NULL)
+        return NULL;
+
+    // Leave at least a minimum block before the aligned payload
+    block_t *block = payload_to_header(bp);
+    size_t block_size = get_size(block);
+    uintptr_t payload = round_up((uintptr_t)bp + min_block_size, alignment);
+    block_t *target = payload_to_header((void *)payload);
+    size_t prefix = (size_t)((char *)target - (char *)block);
+
+    write_block(target, block_size - prefix, true);
+    write_block(block, prefix, false);
+    tree_insert(block);
+    coalesce_block(block);
+
+    split_block(target, asize);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return (void *)payload;
+}
+
+/**
+ * @brief Allocate an aligned block, reporting errors as return values
+ *
+ * @param[out] memptr Where to store the aligned payload
+ * @param[in] alignment Alignment, a power of two multiple of sizeof(void *)
+ * @param[in] size Size of the payload in bytes
+ * @return 0 on success, EINVAL or ENOMEM otherwise
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    void *bp = aligned_alloc(alignment, size);
+    if (bp == NULL && size != 0)
+        return ENOMEM;
+    *memptr = bp;
+    return 0;
+}
+
+/**
+ * @brief Get the number of usable bytes of an allocated payload
+ * @param[in] bp A payload returned by *alloc, or NULL
+ * @return The payload size of its block. 0 if bp is NULL.
+ */
+size_t malloc_usable_size(void *bp) {
+    if (bp == NULL)
+        return 0;
+    return get_payload_size(payload_to_header(bp));
+}
+
+/**
+ * @brief Allocate n blocks of the same size, one at a time
+ * @param[in] size Size of each payload in bytes
+ * @param[in] n Number of blocks
+ * @param[out] out Array receiving the payloads
+ * @return Number of blocks allocated, less than n if out of memory
+ */
+size_t malloc_batch(size_t size, size_t n, void **out) {
+    size_t i = 0;
+    while (i < n && (out[i] = malloc(size)) != NULL)
+        ++i;
+    return i;
+}
+
+/**
+ * @brief Free a block of a known size, like free
+ * @param[in] bp A payload returned by *alloc
+ * @param[in] size The size last requested for the block
+ */
+void free_sized(void *bp, size_t size) {
+    free(bp);
+}
+
+/**
+ * @brief Free n blocks, one at a time
+ * @param[in] ptrs Payloads returned by *alloc, or NULL
+ * @param[in] n Number of payloads
+ */
+void free_batch(void **ptrs, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        free(ptrs[i]);
+}
+
 /*
  * ---------------------------------------------------------------------------
  *                        TREE-RELATED FUNCTIONS
@@ -894,6 +1177,7 @@ static void right_rotate(block_t *x) {
     x->list.parent = y;
 }
 
+#ifndef TREE_POLICY_RB
 static void splay(block_t *x) {
     while (x->list.parent) {
         if (!x->list.parent->list.parent) {
@@ -919,6 +1203,7 @@ static void splay(block_t *x) {
         }
     }
 }
+#endif
 
 static void replace(block_t *u, block_t *v) {
     if (!u->list.parent)
@@ -947,6 +1232,234 @@ void tree_init(void) {
     tree = NULL;
 }
 
+#ifdef TREE_POLICY_RB
+/**
+ * @brief Returns whether a node of the red-black tree is red
+ * @param[in] block A free block, or NULL for a leaf
+ * @return True if the block is red. Leaves are black.
+ */
+static bool is_red(block_t *block) {
+    return block && (block->header & red_mask);
+}
+
+/**
+ * @brief Colors a node of the red-black tree
+ * @param[in] block A free block, or NULL for a leaf
+ * @param[in] red True to color it red, false for black
+ */
+static void set_red(block_t *block, bool red) {
+    if (!block)
+        return;
+    if (red)
+        block->header |= red_mask;
+    else
+        block->header &= ~red_mask;
+}
+
+/**
+ * @brief Orders free blocks by size, then by address
+ *
+ * Every block has a distinct key, so equal sizes need no special cases and
+ * the best fit of a size is always the lowest block of that size.
+ *
+ * @param[in] a
+ * @param[in] b
+ * @return True if a comes before b
+ */
+static bool tree_less(block_t *a, block_t *b) {
+    size_t a_size = get_size(a);
+    size_t b_size = get_size(b);
+    return a_size < b_size || (a_size == b_size && a < b);
+}
+
+/**
+ * @brief Restores the red-black properties after inserting a red node
+ * @param[in] z The inserted node
+ */
+static void insert_fixup(block_t *z) {
+    while (is_red(z->list.parent)) {
+        block_t *p = z->list.parent;
+        // the root is black, so a red parent has a parent
+        block_t *g = p->list.parent;
+        if (p == g->list.left) {
+            block_t *u = g->list.right;
+            if (is_red(u)) {
+                set_red(p, false);
+                set_red(u, false);
+                set_red(g, true);
+                z = g;
+            } else {
+                if (z == p->list.right) {
+                    z = p;
+                    left_rotate(z);
+                    p = z->list.parent;
+                }
+                set_red(p, false);
+                set_red(g, true);
+                right_rotate(g);
+            }
+        } else {
+            block_t *u = g->list.left;
+            if (is_red(u)) {
+                set_red(p, false);
+                set_red(u, false);
+                set_red(g, true);
+                z = g;
+            } else {
+                if (z == p->list.left) {
+                    z = p;
+                    right_rotate(z);
+                    p = z->list.parent;
+                }
+                set_red(p, false);
+                set_red(g, true);
+                left_rotate(g);
+            }
+        }
+    }
+    set_red(tree, false);
+}
+
+/**
+ * @brief Restores the red-black properties after removing a black node
+ * @param[in] x The node that took its place, NULL for a leaf
+ * @param[in] parent The parent of x
+ */
+static void remove_fixup(block_t *x, block_t *parent) {
+    while (x != tree && !is_red(x)) {
+        // x is one black short, so its sibling is a real node
+        if (x == parent->list.left) {
+            block_t *w = parent->list.right;
+            if (is_red(w)) {
+                set_red(w, false);
+                set_red(parent, true);
+                left_rotate(parent);
+                w = parent->list.right;
+            }
+            if (!is_red(w->list.left) && !is_red(w->list.right)) {
+                set_red(w, true);
+                x = parent;
+                parent = x->list.parent;
+            } else {
+                if (!is_red(w->list.right)) {
+                    set_red(w->list.left, false);
+                    set_red(w, true);
+                    right_rotate(w);
+                    w = parent->list.right;
+                }
+                set_red(w, is_red(parent));
+                set_red(parent, false);
+                set_red(w->list.right, false);
+                left_rotate(parent);
+                x = tree;
+            }
+        } else {
+            block_t *w = parent->list.left;
+            if (is_red(w)) {
+                set_red(w, false);
+                set_red(parent, true);
+                right_rotate(parent);
+                w = parent->list.left;
+            }
+            if (!is_red(w->list.left) && !is_red(w->list.right)) {
+                set_red(w, true);
+                x = parent;
+                parent = x->list.parent;
+            } else {
+                if (!is_red(w->list.left)) {
+                    set_red(w->list.right, false);
+                    set_red(w, true);
+                    left_rotate(w);
+                    w = parent->list.left;
+                }
+                set_red(w, is_red(parent));
+                set_red(parent, false);
+                set_red(w->list.left, false);
+                right_rotate(parent);
+                x = tree;
+            }
+        }
+    }
+    set_red(x, false);
+}
+
+void tree_insert(block_t *block) {
+    dbg_assert(!get_alloc(block));
+    block_t *p = NULL;
+    block_t *tmp = tree;
+    while (tmp) {
+        p = tmp;
+        if (tree_less(block, tmp))
+            tmp = tmp->list.left;
+        else
+            tmp = tmp->list.right;
+    }
+
+    block->list.parent = p;
+    block->list.left = block->list.right = NULL;
+    if (!p)
+        tree = block;
+    else if (tree_less(block, p))
+        p->list.left = block;
+    else
+        p->list.right = block;
+    set_red(block, true);
+    insert_fixup(block);
+}
+
+block_t *tree_find_nearest(size_t key) {
+    // lowest block among the smallest ones of at least key bytes
+    block_t *z = tree;
+    block_t *n = NULL;
+    while (z) {
+        if (get_size(z) >= key) {
+            n = z;
+            z = z->list.left;
+        } else
+            z = z->list.right;
+    }
+    return n;
+}
+
+void tree_remove(block_t *block) {
+    dbg_assert(!get_alloc(block));
+
+    // y is the node unlinked from its place, x the node that moves into it
+    block_t *y = block;
+    bool y_red = is_red(y);
+    block_t *x;
+    block_t *x_parent;
+    if (!block->list.left) {
+        x = block->list.right;
+        x_parent = block->list.parent;
+        replace(block, x);
+    } else if (!block->list.right) {
+        x = block->list.left;
+        x_parent = block->list.parent;
+        replace(block, x);
+    } else {
+        y = subtree_minimum(block->list.right);
+        y_red = is_red(y);
+        x = y->list.right;
+        if (y->list.parent == block)
+            x_parent = y;
+        else {
+            x_parent = y->list.parent;
+            replace(y, y->list.right);
+            y->list.right = block->list.right;
+            y->list.right->list.parent = y;
+        }
+        replace(block, y);
+        y->list.left = block->list.left;
+        y->list.left->list.parent = y;
+        set_red(y, is_red(block));
+    }
+
+    if (!y_red)
+        remove_fixup(x, x_parent);
+}
+#else
+
 void tree_insert(block_t *block) {
     dbg_assert(!get_alloc(block));
     size_t key = get_size(block);
@@ -1008,6 +1521,7 @@ void tree_remove(block_t *block) {
         y->list.left->list.parent = y;
     }
 }
+#endif
 
 /*
  *****************************************************************************
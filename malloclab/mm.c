@@ -56,34 +56,92 @@
  * The prologue and epilogue are size-0 block (marked as allocated) that denote
  * the start and the end of the memory blocks.
  *
- * The segregation lists are grouped lists that keep records of all free blocks.
- * Every group has a lower and an upper bound of the block size. All blocks
- * whose sizes are within this interval are stored in the corresponding lists.
- * The group sizes are [2^4, 2^5), [2^5, 2^6), ..., [2^14, infinity).
- * See get_seg_list().
- *
- * When malloc() is called, a free block with enough size is searched linearly
- * within a group. Extra size of this block is used as a new free block.
+ * The segregation lists keep records of all free blocks. Every list has a
+ * lower and an upper bound of the block size. Below 256 bytes there is one list
+ * per block size. Larger sizes use a two-level index: the power-of-two groups
+ * [2^8, 2^9), ..., [2^23, 2^24) are each split into 8 lists of equal width,
+ * and the last list holds everything from 2^24 up. See get_seg_index().
+ * A bitmap records which lists are non-empty.
+ *
+ * When malloc() is called, a few blocks of the list of the requested size are
+ * searched for the best fit. If none fits, the first block of the next
+ * non-empty list is used, found with the bitmap in constant time.
+ * Extra size of this block is used as a new free block.
  * If no available block is found, we extend the heap. Instead of extending the
  * heap by a fixed size (chunksize), the amount to extend is 4 times the block
  * size.
  *
+ * Requests of at most 128 bytes whose block would shrink without a header are
+ * served from slabs instead. A slab is a 4096-byte aligned allocated block cut
+ * into headerless slots of one size, with a bitmap of its free slots. A heap
+ * wide bitmap marks which 4096-byte frames are slabs, so free() can tell a
+ * slot from a block. Empty slabs are freed back to the heap.
+ *
+ * Requests of at least MAP_THRESHOLD bytes get their own mapping from memlib
+ * instead, so they neither crowd the largest seglist nor fragment the heap.
+ * They are resized by remapping and unmapped when freed. If no mapping is
+ * available, they fall back to the heap.
+ *
+ * aligned_alloc() looks for a free block with room for an aligned block, and
+ * splits off the slack before it as a free block rather than wasting it.
+ * malloc_batch() carves many blocks of one size out of a single fit, and
+ * free_batch() sorts its pointers so that neighboring blocks are merged and
+ * coalesced once.
+ *
  * When free() is called, the block is marked as free. And if the previous or
  * next consecutive block is/are also free, they are merged as a single free
- * block and added to the seglist.
+ * block and added to the seglist. Every release_interval frees, memory goes
+ * back to the OS: a free block of at least 128 KiB at the end of the heap is
+ * trimmed to chunksize with a negative sbrk, and the pages inside a few free
+ * blocks of at least 256 KiB are decommitted. Releasing on this clock rather
+ * than on every free keeps a program that frees and reuses its peak from
+ * paying for page faults over and over (single-threaded mode only).
+ *
+ * If memlib backs the heap by huge pages, a large extension of the heap is
+ * rounded up to end on a huge page when that costs little, and the trimmed
+ * heap ends on a huge page, so that trimming does not split one.
+ *
+ * In single-threaded mode, blocks of at most QUICK_BINS * dsize bytes are not
+ * coalesced when freed. They stay marked allocated on a quick list of their
+ * size, and malloc() hands them out again before searching the seglists. A
+ * quick list is consolidated (its blocks freed and coalesced) when it holds
+ * QUICK_BIN_LIMIT blocks, and all of them are consolidated before the heap is
+ * extended, so deferring only trades a little fragmentation for speed.
  *
  * Each list in a group is a circular doubly-linked list. New blocks are
  * inserted in a LIFO order.
  *
+ * If MM_CONCURRENT is defined, the allocator is thread-safe. The heap is
+ * shared by ARENA_COUNT arenas, each with its own lock and seglists, and
+ * every thread is mapped to a home arena by hashing its id. An arena grows
+ * in regions, each bracketed by its own prologue and epilogue, so blocks
+ * never coalesce across arenas:
+ * -------------------------------------------------------------------------
+ * | arenas | seg lists | region | prologue | blocks | epilogue | region |...
+ * -------------------------------------------------------------------------
+ * The newest region is extended in place if it is at the end of the heap.
+ * The owning arena is stored in the high bits of every header. Small blocks
+ * freed by a thread are kept in a lock-free per-thread cache (tcache) and
+ * reused for requests of the same size. Blocks freed by a thread other than
+ * the owner are batched and handed to the owning arena, which frees them
+ * the next time it is locked. Both are given back when the thread exits.
+ * All locks are taken around fork(), so the child never inherits a lock held
+ * by another thread.
+ *
  * @see mm_malloc
  * @see mm_free
  * @see mm_realloc
  * @see mm_calloc
+ * @see mm_aligned_alloc
+ * @see mm_usable_size
+ * @see mm_malloc_batch
+ * @see mm_free_batch
  *
  * @author Jiyang Tang <jiyangta@andrew.cmu.edu>
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -96,6 +154,37 @@
 #include "memlib.h"
 #include "mm.h"
 
+/**
+ * Build the thread-safe allocator with per-thread arenas and caches
+ * (also enabled with -DMM_CONCURRENT)
+ */
+// #define MM_CONCURRENT
+
+#ifdef MM_CONCURRENT
+#include <pthread.h>
+#include <stdatomic.h>
+
+/**
+ * Number of arenas in the heap
+ */
+#define ARENA_COUNT 8
+
+/**
+ * Number of tcache bins, one per dsize class up to 256 bytes
+ */
+#define TCACHE_BINS 32
+
+/**
+ * Max number of blocks in a tcache bin
+ */
+#define TCACHE_BIN_LIMIT 7
+
+/**
+ * Number of blocks freed for another arena before they are handed over
+ */
+#define REMOTE_BATCH 16
+#endif
+
 #ifdef DEBUG
 /**
  * Print the entire heap at the end of malloc() and free() if true
@@ -113,13 +202,37 @@
  */
 #define BETTER_FIT_LIMIT 20
 
+/**
+ * Requests with a block of at least this many bytes get their own mapping
+ */
+#define MAP_THRESHOLD (1 << 20)
+
+#ifndef MM_CONCURRENT
+/**
+ * Number of quick lists, one per dsize class up to 256 bytes
+ */
+#define QUICK_BINS 16
+
+/**
+ * Max number of blocks in a quick list, a full list is consolidated
+ */
+#define QUICK_BIN_LIMIT 7
+#endif
+
 #ifdef DRIVER
 #define malloc mm_malloc
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define aligned_alloc mm_aligned_alloc
+#define posix_memalign mm_posix_memalign
+#define malloc_usable_size mm_usable_size
+#define malloc_batch mm_malloc_batch
+#define free_sized mm_free_sized
+#define free_batch mm_free_batch
 #define memset mem_memset
 #define memcpy mem_memcpy
+#define memmove mem_memmove
 #endif /* def DRIVER */
 
 /*
@@ -197,11 +310,78 @@ static const size_t min_block_size = 4 * wsize;
 static const size_t miniblock_size = dsize;
 
 /**
- * Number of segregation lists
+ * Number of exact size classes, one per dsize below 256 bytes
+ *
+ * @see get_seg_index
+ */
+static const size_t n_small_segs = 15;
+
+/**
+ * Log2 of the smallest size in the first power-of-two group (256 bytes)
+ */
+static const unsigned int first_group_log = 8;
+
+/**
+ * Number of power-of-two groups. Blocks of 2^24 bytes and more all go to the
+ * last list.
+ */
+static const size_t n_groups = 16;
+
+/**
+ * Each power-of-two group is split into 2^sub_seg_log lists of equal width
+ */
+static const unsigned int sub_seg_log = 3;
+
+/**
+ * Number of segregation lists (n_small_segs + n_groups * 2^sub_seg_log)
  *
  * @see get_seg_list
  */
-static const size_t n_segs = 13;
+static const size_t n_segs = 143;
+
+/**
+ * Number of words in the bitmap of non-empty seglists
+ */
+static const size_t n_seg_bitmap_words = 3;
+
+#ifndef MM_CONCURRENT
+/**
+ * Size and alignment of a slab in bytes
+ *
+ * @see slab_t
+ */
+static const size_t slab_size = 4096;
+
+/**
+ * Requests up to this size are served from slabs
+ */
+static const size_t max_slot_size = 128;
+
+/**
+ * Number of slab classes, one per dsize up to max_slot_size
+ */
+static const size_t n_slab_classes = 8;
+
+/**
+ * A free block of at least this size at the end of the heap is trimmed
+ */
+static const size_t trim_threshold = (1 << 17);
+
+/**
+ * The pages inside a free block of at least this size are decommitted
+ */
+static const size_t decommit_threshold = (1 << 18);
+
+/**
+ * Memory is released to the OS once every this many frees
+ */
+static const size_t release_interval = 4096;
+
+/**
+ * At most this many free blocks are decommitted at a time
+ */
+static const size_t max_decommits = 4;
+#endif
 
 /**
  * The minimum size in bytes when extending the heap.
@@ -230,10 +410,38 @@ static const word_t prev_alloc_mask = 0x2;
  */
 static const word_t mini_mask = 0x4;
 
+/**
+ * Mask of the mapped bit.
+ *
+ * The mapped bit indicates that the block has its own mapping instead of
+ * living in the heap.
+ *
+ * @see mapping_t
+ */
+static const word_t mapped_mask = 0x8;
+
+#ifdef MM_CONCURRENT
+/**
+ * The owning arena of a block is stored in header bits 48-55
+ */
+static const unsigned int arena_shift = 48;
+
+/**
+ * Mask of the arena id of a block
+ */
+static const word_t arena_mask = (word_t)0xFF << 48;
+
+/**
+ * The size mask is used to clear the last 4 bits and the arena id to get the
+ * size of a block
+ */
+static const word_t size_mask = ~(word_t)0xF & ~((word_t)0xFF << 48);
+#else
 /**
  * The size mask is used to clear the last 4 bits to get the size of a block
  */
 static const word_t size_mask = ~(word_t)0xF;
+#endif
 
 /**
  * The pointer mask is used to clear the last 3 bits to get the next pointer of
@@ -267,22 +475,229 @@ typedef struct seg_list {
     block_t *start;
 } seg_list_t;
 
+/**
+ * @brief Header of a slab, a slab_size-aligned allocated block cut into
+ *        headerless slots of the same size
+ *
+ * The slab's block header sits in the last word before the alignment
+ * boundary, so the slab_t starts at the boundary and the slots follow it.
+ */
+typedef struct slab {
+    /// Neighbors in the list of slabs with free slots of the same size
+    struct slab *next;
+    struct slab *prev;
+    /// Bit i is set if slot i is free (enough for slab_size / dsize slots)
+    word_t free_map[4];
+    /// Size of a slot in bytes
+    size_t slot_size;
+    /// Number of free slots
+    size_t n_free;
+} slab_t;
+
+/**
+ * @brief A block with its own mapping, followed by its payload up to the last
+ *        word of the mapping, so that its size is a multiple of dsize
+ */
+typedef struct mapping {
+    /// Neighbors in the NULL-terminated list of mappings
+    struct mapping *next;
+    struct mapping *prev;
+    /// Length of the mapping in bytes
+    size_t length;
+    /// Always allocated, with the mapped bit set
+    block_t block;
+} mapping_t;
+
+#ifdef MM_CONCURRENT
+/**
+ * @brief Header of a region, a self-contained part of the heap owned by an
+ *        arena. Followed by the region's blocks and epilogue.
+ */
+typedef struct region {
+    /// Older region of the same arena
+    struct region *next;
+    /// Epilogue of this region
+    block_t *end;
+    /// Prologue footer, keeps the first block 16-byte aligned
+    word_t prologue;
+} region_t;
+
+/**
+ * @brief A part of the heap with its own lock and seglists
+ */
+typedef struct arena {
+    /// Protects everything below and the blocks of the arena
+    pthread_mutex_t lock;
+    /// Segregation lists of this arena
+    seg_list_t *seg_lists;
+    /// Bitmap of the non-empty seglists of this arena
+    word_t *seg_bitmap;
+    /// All regions of this arena, newest first
+    region_t *regions;
+    /// Blocks freed by other threads, linked through their payload
+    _Atomic(block_t *) remote_frees;
+    /// Id stored in the headers of blocks of this arena
+    word_t id;
+} arena_t;
+
+/**
+ * @brief Per-thread allocator state
+ */
+typedef struct thread_cache {
+    /// mm_init generation the cache belongs to
+    size_t epoch;
+    /// Arena this thread allocates from
+    arena_t *home;
+    /// Free blocks of the home arena by size class, still marked allocated
+    block_t *bins[TCACHE_BINS];
+    size_t bin_count[TCACHE_BINS];
+    /// Blocks of other arenas waiting to be handed over, by arena
+    block_t *remote[ARENA_COUNT];
+    size_t remote_count[ARENA_COUNT];
+} thread_cache_t;
+#endif
+
 /* Global variables */
 
 /**
  * @brief Segregation lists used in this implementation
  *
+ * In concurrent mode these are the lists of the arena locked by the thread
+ *
  * @see get_seg_list
  * @see mm_init
  */
+#ifdef MM_CONCURRENT
+static _Thread_local seg_list_t *seg_lists = NULL;
+#else
 static seg_list_t *seg_lists = NULL;
+#endif
+
+/**
+ * @brief Bit i is set if seg_lists[i] is not empty
+ *
+ * Stored right after the seglists.
+ *
+ * @see find_fit
+ */
+#ifdef MM_CONCURRENT
+static _Thread_local word_t *seg_bitmap = NULL;
+#else
+static word_t *seg_bitmap = NULL;
+#endif
+
+/**
+ * @brief All mappings, newest first
+ *
+ * In concurrent mode, protected by heap_lock.
+ */
+static mapping_t *mappings = NULL;
+
+#ifndef MM_CONCURRENT
+/**
+ * @brief Slabs with free slots by slot size, NULL-terminated lists
+ *
+ * Stored right after the seglist bitmap.
+ */
+static slab_t **slab_lists = NULL;
+
+/**
+ * Start of the heap, frames of slab_size bytes are counted from here
+ */
+static char *slab_base = NULL;
+
+/**
+ * @brief Recently freed small blocks by size, NULL-terminated lists
+ *
+ * The blocks stay marked allocated so that nothing coalesces with them.
+ * Stored right after slab_lists.
+ *
+ * @see quick_push
+ */
+static block_t **quick_lists = NULL;
 
-#ifdef DEBUG
+/**
+ * Number of blocks in each quick list, stored right after quick_lists
+ */
+static size_t *quick_counts = NULL;
+
+/**
+ * @brief Bit i is set if frame i of the heap is a slab
+ *
+ * Stored in an allocated block, regrown as the heap grows.
+ */
+static word_t *slab_frames = NULL;
+
+/**
+ * Number of frames covered by slab_frames
+ */
+static size_t slab_frames_cap = 0;
+
+/**
+ * Number of frees since mm_init, the clock of release_memory()
+ */
+static size_t n_frees = 0;
+#endif
+
+#ifdef MM_CONCURRENT
+/**
+ * Arenas, at the beginning of the heap
+ */
+static arena_t *arenas = NULL;
+
+/**
+ * Serializes heap extension
+ */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Incremented by mm_init to invalidate the thread caches of an older heap
+ */
+static atomic_size_t heap_epoch = 0;
+
+/**
+ * Arena locked by this thread, NULL if none
+ */
+static _Thread_local arena_t *cur_arena = NULL;
+
+/**
+ * Arena id bits packed into headers written by this thread
+ */
+static _Thread_local word_t cur_arena_bits = 0;
+
+/**
+ * State of this thread
+ */
+static _Thread_local thread_cache_t tcache;
+
+/**
+ * Set once the thread cache of this thread is flushed at thread exit, the
+ * frees after that bypass it
+ */
+static _Thread_local bool tcache_shutdown = false;
+
+/**
+ * Key whose destructor flushes the state of an exiting thread
+ */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Registers the fork handlers, once per process
+ */
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+#endif
+
+#if !defined MM_CONCURRENT || defined DEBUG
 /**
  * Pointer to first block (not prologue/epilogue) on the heap
+ *
+ * Single-threaded mode only, the heap ends at the epilogue.
  */
 static block_t *heap_start = NULL;
+#endif
 
+#ifdef DEBUG
 /**
  * @brief Heap size in bytes
  *
@@ -313,6 +728,21 @@ static void *sbrk_wrapper(size_t incr) {
     return ret;
 }
 
+#ifndef MM_CONCURRENT
+/**
+ * Shrinks the heap by decr bytes, releasing its pages
+ * @param decr Size to shrink
+ * @see sbrk_wrapper
+ */
+static void sbrk_trim(size_t decr) {
+    mem_sbrk(-(intptr_t)decr);
+
+#ifdef DEBUG
+    heap_size -= decr;
+#endif
+}
+#endif
+
 /**
  * @brief Returns the maximum of two integers.
  * @param[in] x
@@ -348,7 +778,11 @@ static size_t round_up(size_t size, size_t n) {
  */
 static word_t pack(size_t size, size_t alloc) {
     dbg_assert((size & alloc_mask) == 0);
+#ifdef MM_CONCURRENT
+    return size | alloc | cur_arena_bits;
+#else
     return size | alloc;
+#endif
 }
 
 /**
@@ -367,13 +801,44 @@ static size_t extract_size(word_t word) {
     return (word & size_mask);
 }
 
+/**
+ * @brief Reads the header of a block
+ *
+ * In concurrent mode, the header of an allocated block is read by its user
+ * without the arena lock while the arena updates its prev_alloc bit, so the
+ * header is accessed atomically. Its other bits never change meanwhile.
+ *
+ * @param[in] block
+ * @return The header word
+ */
+static word_t get_header(block_t *block) {
+#ifdef MM_CONCURRENT
+    return __atomic_load_n(&block->header, __ATOMIC_RELAXED);
+#else
+    return block->header;
+#endif
+}
+
+/**
+ * @brief Writes the header of a block
+ * @param[out] block
+ * @param[in] header The header word
+ */
+static void set_header(block_t *block, word_t header) {
+#ifdef MM_CONCURRENT
+    __atomic_store_n(&block->header, header, __ATOMIC_RELAXED);
+#else
+    block->header = header;
+#endif
+}
+
 /**
  * @brief Extracts the size of a block from its header.
  * @param[in] block
  * @return The size of the block
  */
 static size_t get_size(block_t *block) {
-    return extract_size(block->header);
+    return extract_size(get_header(block));
 }
 
 /**
@@ -397,7 +862,7 @@ static bool extract_alloc(word_t header) {
  * @return The allocation status of the block
  */
 static bool get_alloc(block_t *block) {
-    return extract_alloc(block->header);
+    return extract_alloc(get_header(block));
 }
 
 /**
@@ -409,7 +874,17 @@ static bool get_alloc(block_t *block) {
  * @return The allocation status of the previous consecutive block
  */
 static bool get_prev_alloc(block_t *block) {
-    return (bool)(block->header & prev_alloc_mask);
+    return (bool)(get_header(block) & prev_alloc_mask);
+}
+
+/**
+ * Check if a block has its own mapping (the mapped bit)
+ *
+ * @param block An allocated block
+ * @return True if the block is in a mapping rather than in the heap
+ */
+static bool get_mapped(block_t *block) {
+    return (bool)(get_header(block) & mapped_mask);
 }
 
 /**
@@ -488,7 +963,7 @@ static size_t get_payload_size(block_t *block) {
  */
 static void write_epilogue(block_t *block, bool prev_alloc) {
     dbg_requires(block != NULL);
-    block->header = pack(0, ((size_t)prev_alloc << 1) | 1);
+    set_header(block, pack(0, ((size_t)prev_alloc << 1) | 1));
 }
 
 /**
@@ -587,7 +1062,7 @@ static void write_block(block_t *block, size_t size, bool prev_alloc,
     if (size < min_block_size)
         bits |= mini_mask;
 
-    block->header = pack(size, bits);
+    set_header(block, pack(size, bits));
 
     // allocated blocks do not have a footer
     // miniblocks don't have a footer
@@ -618,38 +1093,55 @@ static void set_next_prev_alloc(block_t *block) {
         write_epilogue(next, get_alloc(block));
 }
 
+/**
+ * @brief Choose which segregation list to use according to the block size
+ *
+ * This is a two-level index: blocks smaller than 256 bytes have one list per
+ * size. Larger sizes are grouped by their highest bit, and each group is split
+ * by the next sub_seg_log bits into lists of equal width.
+ *
+ * @param size Size in bytes
+ * @return Index of the suitable segregation list
+ */
+static size_t get_seg_index(size_t size) {
+    if (size < ((size_t)1 << first_group_log))
+        return size / dsize - 1;
+
+    unsigned int group_log = 63 - (unsigned int)__builtin_clzl(size);
+    if (group_log >= first_group_log + n_groups)
+        return n_segs - 1;
+
+    size_t sub = (size >> (group_log - sub_seg_log)) &
+                 (((size_t)1 << sub_seg_log) - 1);
+    return n_small_segs + ((group_log - first_group_log) << sub_seg_log) + sub;
+}
+
 /**
  * @brief Choose which segregation list to use according to the block size
  * @param size Size in bytes
- * @return Suitable segregation list. NULL if not found.
+ * @return Suitable segregation list
  */
 static seg_list_t *get_seg_list(size_t size) {
-    if (size >= 16 && size < 32) {
-        return seg_lists;
-    } else if (size >= 32 && size < 48) {
-        return seg_lists + 1;
-    } else if (size >= 48 && size < 64) {
-        return seg_lists + 2;
-    } else if (size >= 64 && size < 96) {
-        return seg_lists + 3;
-    } else if (size >= 96 && size < 128) {
-        return seg_lists + 4;
-    } else if (size >= 128 && size < 256) {
-        return seg_lists + 5;
-    } else if (size >= 256 && size < 384) {
-        return seg_lists + 6;
-    } else if (size >= 384 && size < 512) {
-        return seg_lists + 7;
-    } else if (size >= 512 && size < 1024) {
-        return seg_lists + 8;
-    } else if (size >= 1024 && size < 2048) {
-        return seg_lists + 9;
-    } else if (size >= 2048 && size < 4096) {
-        return seg_lists + 10;
-    } else if (size >= 4096 && size < 8192) {
-        return seg_lists + 11;
-    }
-    return seg_lists + 12;
+    return seg_lists + get_seg_index(size);
+}
+
+/**
+ * @brief Find the first non-empty seglist starting from an index
+ * @param index Index of the first seglist to consider
+ * @return Index of the seglist, n_segs if all of them are empty
+ */
+static size_t next_seg_index(size_t index) {
+    if (index >= n_segs)
+        return n_segs;
+
+    size_t i = index / 64;
+    word_t bits = seg_bitmap[i] & (~(word_t)0 << (index % 64));
+    while (!bits) {
+        if (++i == n_seg_bitmap_words)
+            return n_segs;
+        bits = seg_bitmap[i];
+    }
+    return i * 64 + (size_t)__builtin_ctzl(bits);
 }
 
 /**
@@ -662,10 +1154,13 @@ static seg_list_t *get_seg_list(size_t size) {
 static void add_block_to_free_list(block_t *block) {
     dbg_assert(get_alloc(block) == 0);
 
-    seg_list_t *list = get_seg_list(get_size(block));
-    dbg_assert(list);
+    size_t index = get_seg_index(get_size(block));
+    seg_list_t *list = seg_lists + index;
     dbg_assert(block != list->start);
 
+    if (!list->start)
+        seg_bitmap[index / 64] |= (word_t)1 << (index % 64);
+
     // miniblock
     if (get_size(block) < min_block_size) {
         // if list is empty
@@ -710,8 +1205,8 @@ static void remove_block_from_free_list(block_t *block) {
     dbg_assert(block);
     dbg_assert(get_alloc(block) == 0);
 
-    seg_list_t *list = get_seg_list(get_size(block));
-    dbg_assert(list);
+    size_t index = get_seg_index(get_size(block));
+    seg_list_t *list = seg_lists + index;
 
     block_t *next = block->list.next;
     if (get_size(block) < min_block_size)
@@ -721,6 +1216,7 @@ static void remove_block_from_free_list(block_t *block) {
     // this block is the only block on the list
     if (next == block) {
         list->start = NULL;
+        seg_bitmap[index / 64] &= ~((word_t)1 << (index % 64));
     } else {
         // miniblock
         if (get_size(block) < min_block_size) {
@@ -759,7 +1255,7 @@ static void remove_block_from_free_list(block_t *block) {
  * Get a pointer to the end of the heap
  * (the return value points to the epilogue)
  */
-static inline block_t *get_heap_end() {
+static inline block_t *get_heap_end(void) {
     return (block_t *)((char *)heap_start + heap_size);
 }
 
@@ -771,13 +1267,10 @@ static inline block_t *get_heap_end() {
  */
 extern void print_heap(void);
 void print_heap(void) {
-    // print seg lists
-    size_t lower_bound = 16;
-    printf("lower\tstart\n");
-    for (size_t i = 0; i < n_segs; ++i) {
-        printf("%zu\t0x%lx\n", lower_bound, (uintptr_t)seg_lists[i].start);
-        lower_bound *= 2;
-    }
+    // print non-empty seg lists
+    printf("index\tstart\n");
+    for (size_t i = next_seg_index(0); i < n_segs; i = next_seg_index(i + 1))
+        printf("%zu\t0x%lx\n", i, (uintptr_t)seg_lists[i].start);
 
     printf("\n");
 
@@ -922,10 +1415,51 @@ static block_t *coalesce_prev(block_t *block) {
     return block;
 }
 
+#ifdef MM_CONCURRENT
+/**
+ * @brief Acquire memory for a new free block of the current arena
+ *
+ * The newest region of the arena is extended in place if it ends at the end
+ * of the heap. Otherwise a new region is created after it.
+ *
+ * @param[in] size Size of the block, a multiple of dsize
+ * @return Where to write the block header. The prev_alloc bit already there
+ *         is valid. NULL if failed.
+ */
+static block_t *arena_sbrk(size_t size) {
+    region_t *region = cur_arena->regions;
+    block_t *block = NULL;
+
+    pthread_mutex_lock(&heap_lock);
+    if (region && (char *)region->end + wsize == (char *)mem_heap_hi() + 1) {
+        if (sbrk_wrapper(size) != (void *)-1)
+            block = region->end; // the old epilogue right now
+    } else {
+        region = sbrk_wrapper(sizeof(region_t) + size + wsize);
+        if (region != (void *)-1) {
+            region->next = cur_arena->regions;
+            region->prologue = pack(0, prev_alloc_mask | alloc_mask);
+            cur_arena->regions = region;
+
+            // nothing precedes the first block but the prologue
+            block = (block_t *)((char *)region + sizeof(region_t));
+            write_epilogue(block, true);
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    if (block)
+        region->end = (block_t *)((char *)block + size);
+    return block;
+}
+#endif
+
 /**
  * @brief Extend the heap
  *
- * The size increment will be scaled up to the multiple of dsize.
+ * The size increment will be scaled up to the multiple of dsize. If the heap
+ * is backed by huge pages, an increment of at least a huge page is rounded
+ * up to end on one, if that adds at most an eighth.
  *
  * The newly acquired memory block is automatically added to its corresponding
  * seglist
@@ -936,15 +1470,29 @@ static block_t *coalesce_prev(block_t *block) {
  * @return The the newly acquired free memory as a block. NULL if failed.
  */
 static block_t *extend_heap(size_t size) {
-    void *bp;
-
     // Allocate an even number of words to maintain alignment
     size = round_up(size, dsize);
+#ifdef MM_CONCURRENT
+    block_t *block = arena_sbrk(size);
+    if (block == NULL)
+        return NULL;
+#else
+    size_t page = mem_heap_pagesize();
+    if (page > chunksize && size >= page) {
+        uintptr_t brk = (uintptr_t)mem_heap_hi() + 1;
+        size_t padded = round_up(brk + size, page) - brk;
+        if (padded - size <= size / 8)
+            size = padded;
+    }
+
+    void *bp;
     if ((bp = sbrk_wrapper(size)) == (void *)-1)
         return NULL;
 
-    // Initialize the new free block
     block_t *block = payload_to_header(bp); // the old epilogue right now
+#endif
+
+    // Initialize the new free block
     write_block(block, size, get_prev_alloc(block), false);
 
     // Create the new epilogue
@@ -983,7 +1531,7 @@ static void split_block(block_t *block, size_t asize) {
         write_block(next, block_size - asize, true, false);
         set_next_prev_alloc(next);
 
-        block = coalesce_next(next);
+        next = coalesce_next(next);
         add_block_to_free_list(next);
     }
 
@@ -991,14 +1539,12 @@ static void split_block(block_t *block, size_t asize) {
 }
 
 /**
- * Try to find the smallest available free block which has the least size that
- * is >= asize
+ * Try to find a free block which has the least size that is >= asize
  *
- * The function fallbacks to the lists with larger sizes if no available
- * candidate is found in the corresponding list.
- *
- * This is a better-fit search. The number of extra blocks to search is set by
- * BETTER_FIT_LIMIT.
+ * Blocks in the list of asize may be smaller than asize, so at most
+ * BETTER_FIT_LIMIT of them are searched for the best fit. Otherwise, the first
+ * block of the next non-empty list is large enough, and it is found with the
+ * seglist bitmap.
  *
  * If no block is found, returns NULL.
  *
@@ -1006,69 +1552,972 @@ static void split_block(block_t *block, size_t asize) {
  * @return The block if found.
  */
 static block_t *find_fit(size_t asize) {
-    seg_list_t *list = get_seg_list(asize);
-    dbg_assert(list);
+    size_t index = get_seg_index(asize);
+    seg_list_t *list = seg_lists + index;
 
     block_t *ret = NULL;
-    size_t best_size = INT64_MAX;
-
-    // fallback to lists with larger sizes if cannot find an available block
-    // in the current list
-    size_t n_search = 0;
-    while (list < seg_lists + n_segs) {
-        block_t *block = list->start;
-        while (block) {
-            size_t block_size = get_size(block);
-            if (asize <= block_size && best_size > block_size) {
-                best_size = block_size;
-                ret = block;
-            }
-
-            // search BETTER_FIT_LIMIT extra blocks after the first candidate is
-            // found
-            if (ret)
-                ++n_search;
-
-            if (block_size == asize ||
-                n_search >= BETTER_FIT_LIMIT) // best found or end of search
-                break;
-
-            if (block_size == miniblock_size)
-                block = get_miniblock_next_pointer(block);
-            else
-                block = block->list.next;
-
-            if (block == list->start) // current list is over
+    size_t best_size = SIZE_MAX;
+
+    block_t *block = list->start;
+    for (size_t n_search = 0; block && n_search < BETTER_FIT_LIMIT;
+         ++n_search) {
+        size_t block_size = get_size(block);
+        if (asize <= block_size && best_size > block_size) {
+            best_size = block_size;
+            ret = block;
+            if (block_size == asize) // best found
                 break;
         }
 
-        if (ret) // early stop if already found
+        if (block_size == miniblock_size)
+            block = get_miniblock_next_pointer(block);
+        else
+            block = block->list.next;
+
+        if (block == list->start) // current list is over
             break;
-        ++list;
     }
-    return ret;
+    if (ret)
+        return ret;
+
+    // every block in a larger list fits
+    index = next_seg_index(index + 1);
+    if (index == n_segs)
+        return NULL;
+    return seg_lists[index].start;
 }
 
+#ifndef MM_CONCURRENT
 /**
- * @brief Check the entire heap for any error in blocks or seglists.
+ * @brief Return the memory of large free blocks to the OS
  *
- * 1. Check if all block_t pointers are valid
- * 2. Check if any block is outside of the heap
- * 3. Check if the heap ends (epilogue) prematurely
- * 4. Check if any block's size is too small (< min_block_size)
- * 5. Check if every free block is in its corresponding seglist
- * 6. Check if two consecutive free blocks are coalesced
- * 7. Check if all miniblocks have their mini bit set
- * 8. Check prev_alloc bit
+ * The last block is trimmed to chunksize if it is free and large enough, or
+ * up to the next huge page if the heap is backed by them.
+ * The pages between the free list pointers and the footer of up to
+ * max_decommits free blocks of at least decommit_threshold bytes are
+ * decommitted.
+ */
+static void release_memory(void) {
+    block_t *epilogue = (block_t *)((char *)mem_heap_hi() + 1 - wsize);
+    if (!get_prev_alloc(epilogue)) {
+        block_t *last = find_prev(epilogue);
+        size_t size = get_size(last);
+        size_t keep = chunksize;
+        size_t page = mem_heap_pagesize();
+        if (page > chunksize) {
+            // the heap ends after the epilogue
+            uintptr_t end = (uintptr_t)last + chunksize + wsize;
+            keep += round_up(end, page) - end;
+        }
+        if (size >= trim_threshold && size > keep) {
+            remove_block_from_free_list(last);
+            write_block(last, keep, get_prev_alloc(last), false);
+            write_epilogue(find_next(last), false);
+            add_block_to_free_list(last);
+            sbrk_trim(size - keep);
+        }
+    }
+
+    size_t n_released = 0;
+    for (size_t index = next_seg_index(get_seg_index(decommit_threshold));
+         index < n_segs && n_released < max_decommits;
+         index = next_seg_index(index + 1)) {
+        block_t *block = seg_lists[index].start;
+        do {
+            size_t size = get_size(block);
+            if (size >= decommit_threshold) {
+                mem_decommit((char *)block + min_block_size,
+                             size - min_block_size - wsize);
+                ++n_released;
+            }
+            block = block->list.next;
+        } while (block != seg_lists[index].start &&
+                 n_released < max_decommits);
+    }
+}
+#endif
+
+/**
+ * @brief Mark a run of consecutive allocated blocks as a single free block,
+ *        coalesce it and add it to its seglist
+ * @param[in] block The first block of the run
+ * @param[in] size Total size of the run
+ * @param[in] count Number of blocks in the run
+ */
+static void free_run(block_t *block, size_t size, size_t count) {
+    // Mark the run as free
+    write_block(block, size, get_prev_alloc(block), false);
+    set_next_prev_alloc(block);
+
+    // Try to coalesce the run with its neighbors
+    block = coalesce_block(block);
+
+    add_block_to_free_list(block);
+
+#ifndef MM_CONCURRENT
+    size_t before = n_frees;
+    n_frees += count;
+    if (n_frees / release_interval != before / release_interval)
+        release_memory();
+#endif
+}
+
+/**
+ * @brief Mark an allocated block as free, coalesce it and add it to its
+ *        seglist
+ * @param[in] block An allocated block in the heap
+ */
+static void free_block(block_t *block) {
+    free_run(block, get_size(block), 1);
+}
+
+#ifndef MM_CONCURRENT
+/**
+ * @brief Take a block of exactly asize bytes from its quick list
+ * @param[in] asize Block size
+ * @return An allocated block. NULL if the quick list is empty.
+ */
+static block_t *quick_pop(size_t asize) {
+    if (asize > QUICK_BINS * dsize)
+        return NULL;
+
+    size_t bin = asize / dsize - 1;
+    block_t *block = quick_lists[bin];
+    if (block) {
+        quick_lists[bin] = block->list.next;
+        --quick_counts[bin];
+    }
+    return block;
+}
+
+/**
+ * @brief Free and coalesce the blocks of a quick list
+ * @param[in] bin Index of the quick list
+ */
+static void consolidate_quick_list(size_t bin) {
+    while (quick_lists[bin]) {
+        block_t *block = quick_lists[bin];
+        quick_lists[bin] = block->list.next;
+        free_block(block);
+    }
+    quick_counts[bin] = 0;
+}
+
+/**
+ * @brief Free and coalesce the blocks of all quick lists
+ * @return True if any block was freed
+ */
+static bool consolidate_quick_lists(void) {
+    bool freed = false;
+    for (size_t bin = 0; bin < QUICK_BINS; ++bin) {
+        if (quick_counts[bin]) {
+            consolidate_quick_list(bin);
+            freed = true;
+        }
+    }
+    return freed;
+}
+
+/**
+ * @brief Keep a freed small block on its quick list, uncoalesced, for the
+ *        next request of its size
  *
- * This is a debug utility, nothing is done in release mode.
+ * A full quick list is consolidated first.
  *
- * @param[in] line The line number of this function's caller
- * @return True if the entire heap is valid
+ * @param[in] block An allocated block
+ * @return True if the block was kept. False if it is too large.
  */
-bool mm_checkheap(int line) {
+static bool quick_push(block_t *block) {
+    size_t size = get_size(block);
+    if (size > QUICK_BINS * dsize)
+        return false;
+
+    size_t bin = size / dsize - 1;
+    if (quick_counts[bin] >= QUICK_BIN_LIMIT)
+        consolidate_quick_list(bin);
+
+    block->list.next = quick_lists[bin];
+    quick_lists[bin] = block;
+    ++quick_counts[bin];
+    return true;
+}
+#endif
+
+/**
+ * @brief Allocate a block of asize bytes, extending the heap if needed
+ * @param[in] asize Block size
+ * @return The allocated block. NULL if out of memory.
+ */
+static block_t *alloc_block(size_t asize) {
+    // Search the free list for a fit
+    block_t *block = find_fit(asize);
+
+#ifndef MM_CONCURRENT
+    // Coalesce the quick lists before growing the heap
+    if (block == NULL && consolidate_quick_lists())
+        block = find_fit(asize);
+#endif
+
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL) {
+        // Always request at least chunksize
+        block = extend_heap(max(asize, chunksize));
+        // extend_heap returns an error
+        if (block == NULL)
+            return NULL;
+    }
+
+    // The block should be marked as free
+    dbg_assert(!get_alloc(block));
+
+    // Mark block as allocated
+    remove_block_from_free_list(block);
+    size_t block_size = get_size(block);
+    write_block(block, block_size, get_prev_alloc(block), true);
+    set_next_prev_alloc(block);
+
+    // Try to split the block if too large
+    split_block(block, asize);
+    return block;
+}
+
+/**
+ * @brief Grow an allocated block without copying its payload elsewhere
+ *
+ * In order of preference:
+ * 1. Absorb the next block if it is free and large enough
+ * 2. Extend the heap just enough if the block (and its free next block) is
+ *    the last one before the epilogue (single-threaded mode only)
+ * 3. Absorb the free previous block (and the free next block) and move the
+ *    payload back with memmove
+ *
+ * @param[in] block An allocated block
+ * @param[in] asize The new block size, larger than the current one
+ * @return The grown block, which is the previous block in case 3. NULL if the
+ *         block cannot grow in place.
+ */
+static block_t *grow_block(block_t *block, size_t asize) {
+    size_t size = get_size(block);
+    block_t *next = find_next(block);
+    size_t next_size = get_alloc(next) ? 0 : get_size(next);
+
+#ifndef MM_CONCURRENT
+    // the end of the heap can be moved
+    bool next_is_last = next_size && get_size(find_next(next)) == 0;
+    if (size + next_size < asize && (get_size(next) == 0 || next_is_last)) {
+        if (extend_heap(asize - size - next_size) == NULL)
+            return NULL;
+        next_size = get_size(next);
+    }
+#endif
+
+    if (size + next_size >= asize) {
+        remove_block_from_free_list(next);
+        write_block(block, size + next_size, get_prev_alloc(block), true);
+        set_next_prev_alloc(block);
+        split_block(block, asize);
+        return block;
+    }
+
+    if (get_prev_alloc(block))
+        return NULL;
+
+    block_t *prev = find_prev(block);
+    size_t total = get_size(prev) + size + next_size;
+    if (total < asize)
+        return NULL;
+
+    remove_block_from_free_list(prev);
+    if (next_size)
+        remove_block_from_free_list(next);
+    write_block(prev, total, get_prev_alloc(prev), true);
+    memmove(header_to_payload(prev), header_to_payload(block),
+            get_payload_size(block));
+    set_next_prev_alloc(prev);
+    split_block(prev, asize);
+    return prev;
+}
+
+/**
+ * @brief Add a mapping to the list of mappings
+ * @param[in] mapping A mapping not in the list
+ */
+static void link_mapping(mapping_t *mapping) {
+    mapping->prev = NULL;
+    mapping->next = mappings;
+    if (mappings)
+        mappings->prev = mapping;
+    mappings = mapping;
+}
+
+/**
+ * @brief Remove a mapping from the list of mappings
+ * @param[in] mapping A mapping in the list
+ */
+static void unlink_mapping(mapping_t *mapping) {
+    if (mapping->prev)
+        mapping->prev->next = mapping->next;
+    else
+        mappings = mapping->next;
+    if (mapping->next)
+        mapping->next->prev = mapping->prev;
+}
+
+/**
+ * @brief Get the mapping of a block with the mapped bit set
+ * @param[in] block A mapped block
+ * @return The mapping containing the block
+ */
+static mapping_t *block_to_mapping(block_t *block) {
+    return (mapping_t *)((char *)block - offsetof(mapping_t, block));
+}
+
+/**
+ * @brief Write the header of the block of a mapping
+ * @param[in] mapping A mapping whose length is set
+ */
+static void write_mapped_block(mapping_t *mapping) {
+    size_t size = mapping->length - offsetof(mapping_t, block) - wsize;
+    set_header(&mapping->block,
+               pack(size, mapped_mask | prev_alloc_mask | alloc_mask));
+}
+
+/**
+ * @brief Allocate a block of asize bytes in its own mapping
+ * @param[in] asize Block size
+ * @return The allocated block. NULL if no mapping is available.
+ */
+static block_t *map_block(size_t asize) {
+    size_t length =
+        round_up(asize + offsetof(mapping_t, block) + wsize, mem_pagesize());
+
+#ifdef MM_CONCURRENT
+    pthread_mutex_lock(&heap_lock);
+#endif
+    mapping_t *mapping = mem_map(length);
+    if (mapping) {
+        mapping->length = length;
+        write_mapped_block(mapping);
+        link_mapping(mapping);
+    }
+#ifdef MM_CONCURRENT
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    return mapping ? &mapping->block : NULL;
+}
+
+/**
+ * @brief Resize the mapping of a mapped block, which may move it
+ * @param[in] block A mapped block
+ * @param[in] asize The new block size
+ * @return The resized block. NULL if the mapping cannot be resized, in which
+ *         case the block is left untouched.
+ */
+static block_t *remap_block(block_t *block, size_t asize) {
+    mapping_t *mapping = block_to_mapping(block);
+    size_t length =
+        round_up(asize + offsetof(mapping_t, block) + wsize, mem_pagesize());
+
+#ifdef MM_CONCURRENT
+    pthread_mutex_lock(&heap_lock);
+#endif
+    unlink_mapping(mapping);
+    mapping_t *remapped = mem_remap(mapping, mapping->length, length);
+    if (remapped) {
+        remapped->length = length;
+        write_mapped_block(remapped);
+        mapping = remapped;
+    }
+    link_mapping(mapping);
+#ifdef MM_CONCURRENT
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    return remapped ? &remapped->block : NULL;
+}
+
+/**
+ * @brief Unmap a mapped block
+ * @param[in] block A mapped block
+ */
+static void unmap_block(block_t *block) {
+    mapping_t *mapping = block_to_mapping(block);
+
+#ifdef MM_CONCURRENT
+    pthread_mutex_lock(&heap_lock);
+#endif
+    unlink_mapping(mapping);
+    mem_unmap(mapping, mapping->length);
+#ifdef MM_CONCURRENT
+    pthread_mutex_unlock(&heap_lock);
+#endif
+}
+
+/**
+ * @brief Allocate a block of asize bytes at a given address inside a free
+ *        block
+ *
+ * The space before the target is left as a free block.
+ *
+ * @param[in] block A free block containing the target block
+ * @param[in] target Address of the block to allocate
+ * @param[in] asize Block size
+ * @return The allocated block
+ */
+static block_t *carve_block(block_t *block, block_t *target, size_t asize) {
+    dbg_requires(!get_alloc(block));
+
+    remove_block_from_free_list(block);
+    size_t size = get_size(block);
+    bool prev_alloc = get_prev_alloc(block);
+
+    size_t prefix = (size_t)((char *)target - (char *)block);
+    if (prefix) {
+        write_block(block, prefix, prev_alloc, false);
+        add_block_to_free_list(block);
+        prev_alloc = false;
+    }
+
+    write_block(target, size - prefix, prev_alloc, true);
+    set_next_prev_alloc(target);
+    split_block(target, asize);
+    return target;
+}
+
+/**
+ * @brief Find where a block with an aligned payload fits in a free block
+ * @param[in] block A free block
+ * @param[in] align Alignment of the payload, a power of two
+ * @param[in] asize Block size
+ * @return The aligned block inside the block. NULL if it does not fit.
+ */
+static block_t *aligned_fit(block_t *block, size_t align, size_t asize) {
+    uintptr_t payload = round_up((uintptr_t)header_to_payload(block), align);
+    block_t *target = payload_to_header((void *)payload);
+    if ((char *)target + asize > (char *)block + get_size(block))
+        return NULL;
+    return target;
+}
+
+/**
+ * @brief Allocate a block of asize bytes whose payload is align-aligned
+ *
+ * The space before the block is left free for other allocations.
+ *
+ * @param[in] align Alignment of the payload, a power of two
+ * @param[in] asize Block size
+ * @return The allocated block. NULL if out of memory.
+ */
+static block_t *alloc_aligned_block(size_t align, size_t asize) {
+    // search a few free blocks large enough to contain an aligned block,
+    // skipping the singly-linked miniblock list
+    size_t n_search = 0;
+    size_t first = get_seg_index(max(asize, min_block_size));
+    for (size_t index = next_seg_index(first); index < n_segs;
+         index = next_seg_index(index + 1)) {
+        block_t *block = seg_lists[index].start;
+        do {
+            block_t *target = aligned_fit(block, align, asize);
+            if (target)
+                return carve_block(block, target, asize);
+            if (++n_search >= BETTER_FIT_LIMIT)
+                break;
+            block = block->list.next;
+        } while (block != seg_lists[index].start);
+        if (n_search >= BETTER_FIT_LIMIT)
+            break;
+    }
+
+    // every block in a list above the worst slack fits
+    size_t index = next_seg_index(get_seg_index(asize + align - dsize) + 1);
+    if (index < n_segs) {
+        block_t *block = seg_lists[index].start;
+        return carve_block(block, aligned_fit(block, align, asize), asize);
+    }
+
+#ifdef MM_CONCURRENT
+    // the new space may start anywhere, so leave room for the worst slack
+    size_t extendsize = asize + align - dsize;
+#else
+    // coalesce the quick lists and search again before growing the heap
+    if (consolidate_quick_lists())
+        return alloc_aligned_block(align, asize);
+
+    // extend the heap up to the end of the next aligned block
+    char *epilogue = (char *)mem_heap_hi() + 1 - wsize;
+    uintptr_t payload = round_up((uintptr_t)epilogue + wsize, align);
+    size_t extendsize = payload - wsize + asize - (uintptr_t)epilogue;
+#endif
+    block_t *block = extend_heap(extendsize);
+    if (block == NULL)
+        return NULL;
+    return carve_block(block, aligned_fit(block, align, asize), asize);
+}
+
+#ifndef MM_CONCURRENT
+/**
+ * @brief Get the number of slots in a slab
+ * @param[in] slot_size Size of a slot in bytes
+ * @return Number of slots
+ */
+static size_t slab_slots(size_t slot_size) {
+    return (slab_size - wsize - sizeof(slab_t)) / slot_size;
+}
+
+/**
+ * @brief Get the slab frame index of an address
+ * @param[in] ptr An address in the heap
+ * @return Index of the slab_size frame containing ptr
+ */
+static size_t slab_frame_index(void *ptr) {
+    return (size_t)((char *)ptr - slab_base) / slab_size;
+}
+
+/**
+ * @brief Mark a heap frame as a slab, growing the frame bitmap if needed
+ * @param[in] slab The slab
+ * @return False if out of memory
+ */
+static bool add_slab_frame(slab_t *slab) {
+    size_t index = slab_frame_index(slab);
+    if (index >= slab_frames_cap) {
+        size_t cap = max(2 * slab_frames_cap, round_up(index + 1, 512));
+        block_t *block = alloc_block(round_up(cap / 8 + wsize, dsize));
+        if (block == NULL)
+            return false;
+
+        word_t *frames = (word_t *)header_to_payload(block);
+        for (size_t i = 0; i < cap / 64; ++i)
+            frames[i] = i < slab_frames_cap / 64 ? slab_frames[i] : 0;
+        if (slab_frames)
+            free_block(payload_to_header(slab_frames));
+
+        slab_frames = frames;
+        slab_frames_cap = cap;
+    }
+
+    slab_frames[index / 64] |= (word_t)1 << (index % 64);
+    return true;
+}
+
+/**
+ * @brief Find the slab containing a pointer
+ * @param[in] bp A pointer returned by malloc
+ * @return The slab. NULL if bp is not a slab slot.
+ */
+static slab_t *get_slab(void *bp) {
+    size_t index = slab_frame_index(bp);
+    if (index >= slab_frames_cap ||
+        !((slab_frames[index / 64] >> (index % 64)) & 1))
+        return NULL;
+    return (slab_t *)((uintptr_t)bp & ~(uintptr_t)(slab_size - 1));
+}
+
+/**
+ * @brief Add a slab to the list of its slot size
+ * @param[in] slab A slab with free slots
+ */
+static void push_slab(slab_t *slab) {
+    slab_t **list = slab_lists + slab->slot_size / dsize - 1;
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+/**
+ * @brief Remove a slab from the list of its slot size
+ * @param[in] slab A slab in the list
+ */
+static void pop_slab(slab_t *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        slab_lists[slab->slot_size / dsize - 1] = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+/**
+ * @brief Create an empty slab and add it to the list of its slot size
+ * @param[in] slot_size Size of a slot in bytes
+ * @return The slab. NULL if out of memory.
+ */
+static slab_t *new_slab(size_t slot_size) {
+    block_t *block = alloc_aligned_block(slab_size, slab_size);
+    if (block == NULL)
+        return NULL;
+
+    slab_t *slab = (slab_t *)header_to_payload(block);
+    if (!add_slab_frame(slab)) {
+        free_block(block);
+        return NULL;
+    }
+
+    size_t n_slots = slab_slots(slot_size);
+    for (size_t i = 0; i < 4; ++i) {
+        if (n_slots >= (i + 1) * 64)
+            slab->free_map[i] = ~(word_t)0;
+        else if (n_slots > i * 64)
+            slab->free_map[i] = ((word_t)1 << (n_slots - i * 64)) - 1;
+        else
+            slab->free_map[i] = 0;
+    }
+    slab->slot_size = slot_size;
+    slab->n_free = n_slots;
+    push_slab(slab);
+    return slab;
+}
+
+/**
+ * @brief Allocate a slot from a slab
+ * @param[in] size Requested size, at most max_slot_size
+ * @return The slot. NULL if out of memory.
+ */
+static void *slab_alloc(size_t size) {
+    size_t slot_size = round_up(size, dsize);
+    slab_t *slab = slab_lists[slot_size / dsize - 1];
+    if (slab == NULL) {
+        slab = new_slab(slot_size);
+        if (slab == NULL)
+            return NULL;
+    }
+
+    size_t i = 0;
+    while (!slab->free_map[i])
+        ++i;
+    size_t slot = i * 64 + (size_t)__builtin_ctzl(slab->free_map[i]);
+    slab->free_map[i] &= slab->free_map[i] - 1;
+
+    if (--slab->n_free == 0)
+        pop_slab(slab);
+    return (char *)(slab + 1) + slot * slot_size;
+}
+
+/**
+ * @brief Allocate up to n slots of the same size from slabs
+ *
+ * Slots are taken a bitmap word at a time, and a slab is popped off its list
+ * once rather than checked after every slot.
+ *
+ * @param[in] size Requested size, at most max_slot_size
+ * @param[in] n Number of slots
+ * @param[out] out Array receiving the slots
+ * @return Number of slots allocated, less than n if out of memory
+ */
+static size_t slab_alloc_batch(size_t size, size_t n, void **out) {
+    size_t slot_size = round_up(size, dsize);
+    size_t done = 0;
+    while (done < n) {
+        slab_t *slab = slab_lists[slot_size / dsize - 1];
+        if (slab == NULL && (slab = new_slab(slot_size)) == NULL)
+            break;
+
+        char *slots = (char *)(slab + 1);
+        for (size_t i = 0; done < n && slab->n_free > 0; ++i) {
+            word_t bits = slab->free_map[i];
+            while (bits && done < n) {
+                size_t slot = i * 64 + (size_t)__builtin_ctzl(bits);
+                bits &= bits - 1;
+                out[done++] = slots + slot * slot_size;
+                --slab->n_free;
+            }
+            slab->free_map[i] = bits;
+        }
+
+        if (slab->n_free == 0)
+            pop_slab(slab);
+    }
+    return done;
+}
+
+/**
+ * @brief Free a slot, and return its slab to the heap if the slab is empty
+ * @param[in] slab The slab containing bp
+ * @param[in] bp The slot
+ */
+static void slab_free(slab_t *slab, void *bp) {
+    size_t slot = (size_t)((char *)bp - (char *)(slab + 1)) / slab->slot_size;
+    slab->free_map[slot / 64] |= (word_t)1 << (slot % 64);
+
+    if (slab->n_free++ == 0)
+        push_slab(slab);
+
+    if (slab->n_free == slab_slots(slab->slot_size)) {
+        pop_slab(slab);
+        size_t index = slab_frame_index(slab);
+        slab_frames[index / 64] &= ~((word_t)1 << (index % 64));
+        free_block(payload_to_header(slab));
+    }
+}
+#endif
+
+#ifdef MM_CONCURRENT
+/**
+ * @brief Get the arena owning a block
+ * @param[in] block A block in the heap
+ * @return The owning arena
+ */
+static arena_t *get_arena(block_t *block) {
+    return arenas + ((get_header(block) & arena_mask) >> arena_shift);
+}
+
+/**
+ * @brief Lock an arena and make its seglists the current ones
+ *
+ * The blocks handed over by other threads are freed first.
+ *
+ * @param[in] arena The arena to lock
+ */
+static void arena_lock(arena_t *arena) {
+    pthread_mutex_lock(&arena->lock);
+    cur_arena = arena;
+    cur_arena_bits = arena->id << arena_shift;
+    seg_lists = arena->seg_lists;
+    seg_bitmap = arena->seg_bitmap;
+
+    block_t *block = atomic_exchange_explicit(&arena->remote_frees, NULL,
+                                              memory_order_acquire);
+    while (block) {
+        block_t *next = block->list.next;
+        free_block(block);
+        block = next;
+    }
+}
+
+/**
+ * @brief Unlock the arena locked by this thread
+ */
+static void arena_unlock(void) {
+    arena_t *arena = cur_arena;
+    cur_arena = NULL;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * @brief Hand the blocks freed for another arena over to it
+ * @param[in] id Id of the owning arena
+ */
+static void remote_flush(size_t id) {
+    block_t *first = tcache.remote[id];
+    if (!first)
+        return;
+
+    block_t *last = first;
+    while (last->list.next)
+        last = last->list.next;
+
+    arena_t *owner = arenas + id;
+    block_t *head =
+        atomic_load_explicit(&owner->remote_frees, memory_order_relaxed);
+    do {
+        last->list.next = head;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &owner->remote_frees, &head, first, memory_order_release,
+        memory_order_relaxed));
+
+    tcache.remote[id] = NULL;
+    tcache.remote_count[id] = 0;
+}
+
+/**
+ * @brief Give the thread cache back when a thread exits
+ *
+ * The cached blocks are freed into the home arena and the blocks of other
+ * arenas are handed over, unless they belong to an older heap. Blocks freed
+ * later in the thread's teardown, such as by the destructors of other keys,
+ * are freed into their arena right away.
+ *
+ * @param[in] arg Unused
+ */
+static void tcache_flush(void *arg) {
+    (void)arg;
+    tcache_shutdown = true;
+    if (tcache.epoch != atomic_load_explicit(&heap_epoch, memory_order_acquire))
+        return;
+
+    arena_lock(tcache.home);
+    for (size_t bin = 0; bin < TCACHE_BINS; ++bin) {
+        while (tcache.bins[bin]) {
+            block_t *cached = tcache.bins[bin];
+            tcache.bins[bin] = cached->list.next;
+            free_block(cached);
+        }
+        tcache.bin_count[bin] = 0;
+    }
+    arena_unlock();
+
+    for (size_t i = 0; i < ARENA_COUNT; ++i)
+        remote_flush(i);
+}
+
+/**
+ * @brief Create the key whose destructor flushes the thread caches
+ */
+static void tcache_key_create(void) {
+    if (pthread_key_create(&tcache_key, tcache_flush))
+        fprintf(stderr, "mm: cannot flush thread caches at thread exit\n");
+}
+
+/**
+ * @brief Get the home arena of this thread
+ *
+ * The thread state is reset if the heap was reinitialized since its last
+ * use, since the cached blocks belong to the old heap. It is flushed by
+ * tcache_flush when the thread exits.
+ *
+ * @return The home arena
+ */
+static arena_t *thread_arena(void) {
+    size_t epoch = atomic_load_explicit(&heap_epoch, memory_order_acquire);
+    if (tcache.epoch != epoch) {
+        tcache = (thread_cache_t){.epoch = epoch};
+
+        // Fibonacci hashing spreads consecutive thread ids over the arenas
+        uint64_t hash = (uint64_t)pthread_self() * 0x9E3779B97F4A7C15;
+        tcache.home = arenas + (hash >> 32) % ARENA_COUNT;
+
+        // any non-NULL value makes the key's destructor run at thread exit
+        pthread_once(&tcache_key_once, tcache_key_create);
+        pthread_setspecific(tcache_key, &tcache);
+    }
+    return tcache.home;
+}
+
+/**
+ * @brief Free a block of another arena
+ *
+ * The block stays allocated until REMOTE_BATCH blocks for the same arena are
+ * collected, or this thread needs to lock its home arena.
+ *
+ * @param[in] block An allocated block
+ * @return False if the block is of the home arena or this thread is exiting
+ */
+static bool remote_free(block_t *block) {
+    arena_t *owner = get_arena(block);
+    if (owner == tcache.home || tcache_shutdown)
+        return false;
+
+    size_t id = (size_t)owner->id;
+    block->list.next = tcache.remote[id];
+    tcache.remote[id] = block;
+    if (++tcache.remote_count[id] >= REMOTE_BATCH)
+        remote_flush(id);
+    return true;
+}
+
+/**
+ * @brief Take a free block of exactly asize bytes from the thread cache
+ * @param[in] asize Block size
+ * @return The block, still marked allocated. NULL if none.
+ */
+static block_t *tcache_pop(size_t asize) {
+    if (asize > TCACHE_BINS * dsize || tcache_shutdown)
+        return NULL;
+
+    size_t bin = asize / dsize - 1;
+    block_t *block = tcache.bins[bin];
+    if (block) {
+        tcache.bins[bin] = block->list.next;
+        --tcache.bin_count[bin];
+    }
+    return block;
+}
+
+/**
+ * @brief Keep a freed block of the home arena in the thread cache
+ *
+ * A full bin is first returned to the arena under a single lock.
+ *
+ * @param[in] block An allocated block
+ * @return False if the block cannot be cached
+ */
+static bool tcache_push(block_t *block) {
+    size_t size = get_size(block);
+    if (size > TCACHE_BINS * dsize || get_arena(block) != tcache.home ||
+        tcache_shutdown)
+        return false;
+
+    size_t bin = size / dsize - 1;
+    if (tcache.bin_count[bin] >= TCACHE_BIN_LIMIT) {
+        arena_lock(tcache.home);
+        while (tcache.bins[bin]) {
+            block_t *cached = tcache.bins[bin];
+            tcache.bins[bin] = cached->list.next;
+            free_block(cached);
+        }
+        tcache.bin_count[bin] = 0;
+        arena_unlock();
+    }
+
+    block->list.next = tcache.bins[bin];
+    tcache.bins[bin] = block;
+    ++tcache.bin_count[bin];
+    return true;
+}
+
+/**
+ * @brief Take every lock of the allocator before fork()
+ *
+ * The arenas are locked in id order and heap_lock last, as heap_lock is
+ * taken with an arena locked when the heap is extended.
+ */
+static void fork_prepare(void) {
+    for (size_t i = 0; arenas && i < ARENA_COUNT; ++i)
+        pthread_mutex_lock(&arenas[i].lock);
+    pthread_mutex_lock(&heap_lock);
+}
+
+/**
+ * @brief Release the locks taken by fork_prepare in the parent
+ */
+static void fork_parent(void) {
+    pthread_mutex_unlock(&heap_lock);
+    for (size_t i = ARENA_COUNT; arenas && i-- > 0;)
+        pthread_mutex_unlock(&arenas[i].lock);
+}
+
+/**
+ * @brief Reinitialize the locks in the child of fork()
+ *
+ * Only the forking thread runs in the child. Its cached blocks are given
+ * back to their arenas and its state is reset, so the next request picks
+ * a home arena again.
+ */
+static void fork_child(void) {
+    pthread_mutex_init(&heap_lock, NULL);
+    for (size_t i = 0; arenas && i < ARENA_COUNT; ++i)
+        pthread_mutex_init(&arenas[i].lock, NULL);
+
+    cur_arena = NULL;
+    if (arenas)
+        tcache_flush(NULL);
+    tcache = (thread_cache_t){0};
+    tcache_shutdown = false;
+}
+
+/**
+ * @brief Register the fork handlers, so that a child does not inherit a
+ *        lock held by another thread of its parent
+ */
+static void atfork_register(void) {
+    if (pthread_atfork(fork_prepare, fork_parent, fork_child))
+        fprintf(stderr, "mm: cannot register the fork handlers\n");
+}
+#endif
+
 #ifdef DEBUG
-    block_t *block = heap_start;
+/**
+ * @brief Check the blocks between a prologue and an epilogue
+ *
+ * @see mm_checkheap
+ *
+ * @param[in] start The first block
+ * @param[in] end The epilogue
+ * @return True if all blocks are valid
+ */
+static bool check_blocks(block_t *start, block_t *end) {
+    block_t *block = start;
     bool prev_free = false;
     while (true) {
         if (!block) {
@@ -1077,7 +2526,7 @@ bool mm_checkheap(int line) {
             return false;
         }
 
-        if (block > get_heap_end()) {
+        if (block > end) {
             printf("checkheap: block is outside of heap (0x%lx)\n",
                    (uintptr_t)block);
             return false;
@@ -1086,7 +2535,7 @@ bool mm_checkheap(int line) {
         size_t size = get_size(block);
         if (size == 0) {
             // check if epilogue is at the end of heap
-            if ((uintptr_t)block == (uintptr_t)get_heap_end()) {
+            if ((uintptr_t)block == (uintptr_t)end) {
                 break;
             } else {
                 printf("checkheap: unexpected block with size 0 (0x%lx)\n",
@@ -1106,6 +2555,14 @@ bool mm_checkheap(int line) {
             return false;
         }
 
+#ifdef MM_CONCURRENT
+        if (get_arena(block) != cur_arena) {
+            printf("checkheap: block at 0x%lx belongs to arena %lu\n",
+                   (uintptr_t)block, (unsigned long)get_arena(block)->id);
+            return false;
+        }
+#endif
+
         if (prev_free && get_prev_alloc(block)) {
             printf("Incorrect prev_alloc at 0x%lx\n", (uintptr_t)block);
             return false;
@@ -1150,6 +2607,167 @@ bool mm_checkheap(int line) {
         block = find_next(block);
     }
     return true;
+}
+
+/**
+ * @brief Check if the seglist bitmap matches the seglists
+ * @return True if a bit is set exactly for every non-empty seglist
+ */
+static bool check_seg_bitmap(void) {
+    for (size_t i = 0; i < n_segs; ++i) {
+        bool bit = (seg_bitmap[i / 64] >> (i % 64)) & 1;
+        if (bit != (seg_lists[i].start != NULL)) {
+            printf("checkheap: bitmap bit of seglist %zu is wrong\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifndef MM_CONCURRENT
+/**
+ * @brief Check if the slabs with free slots are consistent
+ * @return True if every listed slab is marked in the frame bitmap, is in the
+ *         list of its slot size and has as many free slots as its bitmap
+ */
+static bool check_slabs(void) {
+    for (size_t i = 0; i < n_slab_classes; ++i) {
+        for (slab_t *slab = slab_lists[i]; slab; slab = slab->next) {
+            size_t n_free = 0;
+            for (size_t j = 0; j < 4; ++j)
+                n_free += (size_t)__builtin_popcountl(slab->free_map[j]);
+
+            if (get_slab(slab + 1) != slab ||
+                slab->slot_size != (i + 1) * dsize || slab->n_free == 0 ||
+                slab->n_free != n_free) {
+                printf("checkheap: slab at 0x%lx is corrupted\n",
+                       (uintptr_t)slab);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Check that the quick lists hold allocated blocks of their size, and
+ *        no more than QUICK_BIN_LIMIT of them
+ * @return True if the quick lists are consistent
+ */
+static bool check_quick_lists(void) {
+    for (size_t i = 0; i < QUICK_BINS; ++i) {
+        size_t n = 0;
+        for (block_t *block = quick_lists[i]; block; block = block->list.next) {
+            if (!get_alloc(block) || get_size(block) != (i + 1) * dsize) {
+                printf("checkheap: quick block at 0x%lx is corrupted\n",
+                       (uintptr_t)block);
+                return false;
+            }
+            ++n;
+        }
+        if (n != quick_counts[i] || n > QUICK_BIN_LIMIT) {
+            printf("checkheap: quick list %zu has a wrong count\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+/**
+ * @brief Check if the list of mappings is consistent
+ * @return True if every mapping is page aligned, linked both ways and holds
+ *         an allocated mapped block of its length
+ */
+static bool check_mappings(void) {
+    bool ok = true;
+#ifdef MM_CONCURRENT
+    pthread_mutex_lock(&heap_lock);
+#endif
+    mapping_t *prev = NULL;
+    for (mapping_t *mapping = mappings; mapping; mapping = mapping->next) {
+        block_t *block = &mapping->block;
+        if (mapping->prev != prev ||
+            (uintptr_t)mapping % mem_pagesize() != 0 || !get_alloc(block) ||
+            !get_mapped(block) ||
+            get_size(block) + offsetof(mapping_t, block) + wsize !=
+                mapping->length ||
+            !mem_mapped(mapping, mapping->length)) {
+            printf("checkheap: mapping at 0x%lx is corrupted\n",
+                   (uintptr_t)mapping);
+            ok = false;
+            break;
+        }
+        prev = mapping;
+    }
+#ifdef MM_CONCURRENT
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    return ok;
+}
+#endif
+
+#ifdef MM_CONCURRENT
+/**
+ * @brief Check all regions of the arena locked by this thread
+ * @return True if all regions are valid
+ */
+static bool check_arena(void) {
+#ifdef DEBUG
+    if (!check_seg_bitmap())
+        return false;
+    for (region_t *region = cur_arena->regions; region; region = region->next) {
+        block_t *start = (block_t *)((char *)region + sizeof(region_t));
+        if (!check_blocks(start, region->end))
+            return false;
+    }
+#endif
+    return true;
+}
+#endif
+
+/**
+ * @brief Check the entire heap for any error in blocks or seglists.
+ *
+ * 1. Check if all block_t pointers are valid
+ * 2. Check if any block is outside of the heap
+ * 3. Check if the heap ends (epilogue) prematurely
+ * 4. Check if any block's size is too small (< min_block_size)
+ * 5. Check if every free block is in its corresponding seglist
+ * 6. Check if two consecutive free blocks are coalesced
+ * 7. Check if all miniblocks have their mini bit set
+ * 8. Check prev_alloc bit
+ * 9. Check if every block belongs to its arena (concurrent mode only)
+ * 10. Check if the seglist bitmap matches the seglists
+ * 11. Check the slabs with free slots (single-threaded mode only)
+ * 12. Check the list of mappings and their blocks
+ *
+ * In concurrent mode, only the arena locked by the caller is checked if any.
+ * Otherwise every arena is locked and checked in turn.
+ *
+ * This is a debug utility, nothing is done in release mode.
+ *
+ * @param[in] line The line number of this function's caller
+ * @return True if the entire heap is valid
+ */
+bool mm_checkheap(int line) {
+#ifdef DEBUG
+#ifdef MM_CONCURRENT
+    if (cur_arena)
+        return check_arena();
+
+    for (size_t i = 0; arenas && i < ARENA_COUNT; ++i) {
+        arena_lock(arenas + i);
+        bool ok = check_arena();
+        arena_unlock();
+        if (!ok)
+            return false;
+    }
+    return check_mappings();
+#else
+    return check_seg_bitmap() && check_slabs() && check_quick_lists() &&
+           check_mappings() && check_blocks(heap_start, get_heap_end());
+#endif
 #else
     /* // Print the longest seglist
     size_t max_n = 0;
@@ -1173,14 +2791,124 @@ bool mm_checkheap(int line) {
         }
     }
     if (max_n > 50)
-        printf("seg %ld: %ld\n", 1UL << idx, max_n);
+        printf("seg %ld: %ld\n", idx, max_n);
     */
     return true;
 #endif
 }
 
 /**
- * Initialize segregation lists
+ * @brief Count a block of the heap in a snapshot
+ *
+ * @see mm_profile
+ *
+ * @param[in,out] prof The snapshot
+ * @param[in] block A block between a prologue and an epilogue
+ */
+static void profile_block(mm_profile_t *prof, block_t *block) {
+    size_t size = get_size(block);
+    if (get_alloc(block)) {
+        prof->alloc_blocks++;
+        prof->alloc_bytes += size;
+        return;
+    }
+
+    prof->free_blocks++;
+    prof->free_bytes += size;
+    prof->largest_free = max(prof->largest_free, size);
+    size_t bucket = 63 - (size_t)__builtin_clzl(size);
+    if (bucket >= MM_PROFILE_BUCKETS)
+        bucket = MM_PROFILE_BUCKETS - 1;
+    prof->free_hist[bucket]++;
+}
+
+/**
+ * @brief Count the blocks between a prologue and an epilogue, walking them
+ *        like check_blocks
+ * @param[in,out] prof The snapshot
+ * @param[in] start The first block
+ */
+static void profile_blocks(mm_profile_t *prof, block_t *start) {
+    for (block_t *block = start; get_size(block); block = find_next(block))
+        profile_block(prof, block);
+}
+
+/**
+ * @brief Count the blocks in each of the current seglists
+ * @param[in,out] prof The snapshot
+ */
+static void profile_seg_lists(mm_profile_t *prof) {
+    for (size_t i = next_seg_index(0); i < n_segs; i = next_seg_index(i + 1)) {
+        block_t *curr = seg_lists[i].start;
+        while (curr) {
+            prof->list_blocks[i]++;
+            curr = get_miniblock_next_pointer(curr);
+            if (curr == seg_lists[i].start) // the end of the circular list
+                break;
+        }
+    }
+}
+
+/**
+ * @brief Walk the heap and take a snapshot of its fragmentation
+ *
+ * Every block of the heap is counted, and the free blocks are also counted
+ * by seglist. Blocks in the quick lists (or in the thread cache of the
+ * caller, in concurrent mode) are allocated but counted as cached, and the
+ * free slots of the slabs are counted apart.
+ *
+ * @param[out] prof The snapshot
+ * @return True, the snapshot is always taken
+ */
+bool mm_profile(mm_profile_t *prof) {
+    memset(prof, 0, sizeof(*prof));
+    prof->num_lists = n_segs;
+
+#ifdef MM_CONCURRENT
+    for (size_t i = 0; arenas && i < ARENA_COUNT; ++i) {
+        arena_lock(arenas + i);
+        for (region_t *region = cur_arena->regions; region;
+             region = region->next)
+            profile_blocks(prof,
+                           (block_t *)((char *)region + sizeof(region_t)));
+        profile_seg_lists(prof);
+        arena_unlock();
+    }
+
+    if (tcache.epoch == atomic_load_explicit(&heap_epoch,
+                                             memory_order_acquire)) {
+        for (size_t i = 0; i < TCACHE_BINS; ++i)
+            for (block_t *block = tcache.bins[i]; block;
+                 block = block->list.next)
+                prof->cached_bytes += get_size(block);
+        for (size_t i = 0; i < ARENA_COUNT; ++i)
+            for (block_t *block = tcache.remote[i]; block;
+                 block = block->list.next)
+                prof->cached_bytes += get_size(block);
+    }
+    pthread_mutex_lock(&heap_lock);
+#else
+    profile_blocks(prof, heap_start);
+    profile_seg_lists(prof);
+
+    for (size_t i = 0; i < n_slab_classes; ++i)
+        for (slab_t *slab = slab_lists[i]; slab; slab = slab->next)
+            prof->slab_free += slab->n_free * slab->slot_size;
+    for (size_t i = 0; i < QUICK_BINS; ++i)
+        for (block_t *block = quick_lists[i]; block; block = block->list.next)
+            prof->cached_bytes += get_size(block);
+#endif
+
+    for (mapping_t *mapping = mappings; mapping; mapping = mapping->next)
+        prof->mapped_bytes += mapping->length;
+#ifdef MM_CONCURRENT
+    pthread_mutex_unlock(&heap_lock);
+#endif
+    return true;
+}
+
+/**
+ * Initialize segregation lists and their bitmap
  * @param start Starting address of the seg list
  */
 static void init_seg_lists(void *start) {
@@ -1188,6 +2916,11 @@ static void init_seg_lists(void *start) {
     for (size_t i = 0; i < n_segs; ++i) {
         seg_lists[i].start = NULL;
     }
+
+    seg_bitmap = (word_t *)(seg_lists + n_segs);
+    for (size_t i = 0; i < n_seg_bitmap_words; ++i) {
+        seg_bitmap[i] = 0;
+    }
 }
 
 /**
@@ -1202,8 +2935,43 @@ static void init_seg_lists(void *start) {
 bool mm_init(void) {
     // reset global variables
     seg_lists = NULL;
+    mappings = NULL;
+
+#ifdef MM_CONCURRENT
+    size_t arenas_size = round_up(sizeof(arena_t) * ARENA_COUNT, dsize);
+    size_t lists_size = round_up(
+        sizeof(seg_list_t) * n_segs + sizeof(word_t) * n_seg_bitmap_words,
+        dsize);
+    char *heap = sbrk_wrapper(arenas_size + lists_size * ARENA_COUNT);
+    if (heap == (void *)-1)
+        return false;
+
+    arenas = (arena_t *)heap;
+    for (size_t i = 0; i < ARENA_COUNT; ++i) {
+        arena_t *arena = arenas + i;
+        if (pthread_mutex_init(&arena->lock, NULL))
+            return false;
+        init_seg_lists(heap + arenas_size + i * lists_size);
+        arena->seg_lists = seg_lists;
+        arena->seg_bitmap = seg_bitmap;
+        arena->regions = NULL;
+        atomic_init(&arena->remote_frees, NULL);
+        arena->id = i;
+    }
+    cur_arena = NULL;
+    seg_lists = NULL;
+    seg_bitmap = NULL;
 
-    size_t seg_size = round_up(sizeof(seg_list_t) * n_segs, dsize);
+    // invalidate the thread caches of the previous heap
+    atomic_fetch_add_explicit(&heap_epoch, 1, memory_order_release);
+    pthread_once(&atfork_once, atfork_register);
+#else
+    size_t seg_size = round_up(sizeof(seg_list_t) * n_segs +
+                                   sizeof(word_t) * n_seg_bitmap_words +
+                                   sizeof(slab_t *) * n_slab_classes +
+                                   (sizeof(block_t *) + sizeof(size_t)) *
+                                       QUICK_BINS,
+                               dsize);
     word_t *start = (word_t *)(sbrk_wrapper(2 * wsize + seg_size));
     memset(start, 0, 2 * wsize + seg_size);
 
@@ -1212,15 +2980,30 @@ bool mm_init(void) {
 
     init_seg_lists(start);
 
+    slab_lists = (slab_t **)(seg_bitmap + n_seg_bitmap_words);
+    for (size_t i = 0; i < n_slab_classes; ++i)
+        slab_lists[i] = NULL;
+    quick_lists = (block_t **)(slab_lists + n_slab_classes);
+    quick_counts = (size_t *)(quick_lists + QUICK_BINS);
+    for (size_t i = 0; i < QUICK_BINS; ++i) {
+        quick_lists[i] = NULL;
+        quick_counts[i] = 0;
+    }
+    slab_base = mem_heap_lo();
+    slab_frames = NULL;
+    slab_frames_cap = 0;
+    n_frees = 0;
+
     // prologue/epilogue
     start = (word_t *)((char *)start + seg_size);
     write_epilogue((block_t *)start, true);
     write_epilogue((block_t *)(start + 1), true);
 
-#ifdef DEBUG
     // Heap starts with first "block header", currently the epilogue
     heap_start = (block_t *)(start + 1);
+#ifdef DEBUG
     heap_size = 0; // not including the seglist
+#endif
 #endif
 
     return true;
@@ -1245,8 +3028,7 @@ void *malloc(size_t size) {
     printf("malloc %ld\n", size);
 #endif
 
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
+    size_t asize; // Adjusted block size
     block_t *block;
     void *bp = NULL;
 
@@ -1256,37 +3038,64 @@ void *malloc(size_t size) {
         return bp;
     }
 
+#ifndef MM_CONCURRENT
+    // Small requests are served from slabs if saving the header makes their
+    // block smaller
+    if (size <= max_slot_size &&
+        round_up(size, dsize) < round_up(size + wsize, dsize)) {
+        bp = slab_alloc(size);
+        if (bp) {
+            dbg_ensures(mm_checkheap(__LINE__));
+            return bp;
+        }
+    }
+#endif
+
     // Adjust block size to include overhead and to meet alignment requirements
     asize = round_up(size + wsize, dsize);
 
-    // Search the free list for a fit
-    block = find_fit(asize);
-
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        // extend_heap returns an error
-        if (block == NULL)
-            return bp;
+    // Huge requests get their own mapping if one is available
+    if (asize >= MAP_THRESHOLD) {
+        block = map_block(asize);
+        if (block) {
+            dbg_ensures(mm_checkheap(__LINE__));
+            return header_to_payload(block);
+        }
     }
 
-    // The block should be marked as free
-    dbg_assert(!get_alloc(block));
+#ifdef MM_CONCURRENT
+    // Reuse a cached block of the same size without locking
+    arena_t *arena = thread_arena();
+    block = tcache_pop(asize);
+    if (block)
+        return header_to_payload(block);
 
-    // Mark block as allocated
-    remove_block_from_free_list(block);
-    size_t block_size = get_size(block);
-    write_block(block, block_size, get_prev_alloc(block), true);
-    set_next_prev_alloc(block);
+    for (size_t i = 0; i < ARENA_COUNT; ++i)
+        remote_flush(i);
+    arena_lock(arena);
+#else
+    // Reuse a recently freed block of the same size
+    block = quick_pop(asize);
+    if (block) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return header_to_payload(block);
+    }
+#endif
 
-    // Try to split the block if too large
-    split_block(block, asize);
+    block = alloc_block(asize);
+    if (block == NULL) {
+#ifdef MM_CONCURRENT
+        arena_unlock();
+#endif
+        return bp;
+    }
 
     bp = header_to_payload(block);
 
     dbg_ensures(mm_checkheap(__LINE__));
+#ifdef MM_CONCURRENT
+    arena_unlock();
+#endif
 
 #ifdef PRINT_HEAP
     printf("===========================\n");
@@ -1296,6 +3105,34 @@ void *malloc(size_t size) {
     return bp;
 }
 
+/**
+ * @brief Free an allocated block that is neither a slab nor mapped
+ * @param[in] block An allocated block in the heap
+ */
+static void free_heap_block(block_t *block) {
+#ifdef MM_CONCURRENT
+    // Small blocks go to the thread cache, blocks of other arenas are handed
+    // over in batches
+    thread_arena();
+    if (tcache_push(block) || remote_free(block))
+        return;
+    arena_lock(get_arena(block));
+#else
+    // Small blocks wait on a quick list
+    if (quick_push(block)) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+#endif
+
+    free_block(block);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+#ifdef MM_CONCURRENT
+    arena_unlock();
+#endif
+}
+
 /**
  * @brief Free a previously allocated memory block
  * @param[in] bp The pointer to the memory payload
@@ -1310,22 +3147,27 @@ void free(void *bp) {
     if (bp == NULL)
         return;
 
+#ifndef MM_CONCURRENT
+    slab_t *slab = get_slab(bp);
+    if (slab) {
+        slab_free(slab, bp);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+#endif
+
     block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
 
     // The block should be marked as allocated
     dbg_assert(get_alloc(block));
 
-    // Mark the block as free
-    write_block(block, size, get_prev_alloc(block), false);
-    set_next_prev_alloc(block);
-
-    // Try to coalesce the block with its neighbors
-    block = coalesce_block(block);
-
-    add_block_to_free_list(block);
+    if (get_mapped(block)) {
+        unmap_block(block);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
 
-    dbg_ensures(mm_checkheap(__LINE__));
+    free_heap_block(block);
 #ifdef PRINT_HEAP
     printf("===========================\n");
     print_heap();
@@ -1333,11 +3175,40 @@ void free(void *bp) {
 #endif
 }
 
+/**
+ * @brief Move the payload of a block to a new block of the given size
+ *
+ * @param[in] ptr Pointer to the payload of an allocated block
+ * @param[in] size Size of the new block's payload
+ * @return The new payload. NULL if out of memory, in which case the original
+ *         block is left untouched.
+ */
+static void *move_block(void *ptr, size_t size) {
+    void *newptr = malloc(size);
+
+    // If malloc fails, the original block is left untouched
+    if (newptr == NULL)
+        return NULL;
+
+    // Copy the old data
+    size_t copysize = get_payload_size(payload_to_header(ptr));
+    if (size < copysize)
+        copysize = size;
+    memcpy(newptr, ptr, copysize);
+
+    // Free the old block
+    free(ptr);
+
+    return newptr;
+}
+
 /**
  * @brief Extend/shrink a block of memory with its content preserved
  *
- * If the size is larger than the previous size, a new memory block is acquired
- * and the previous content is copied there.
+ * If the size is larger than the previous size, the block is grown in place if
+ * its neighbors allow it (see grow_block). Otherwise a new memory block is
+ * acquired and the previous content is copied there. A mapped block is
+ * remapped instead, or copied into the heap if it becomes small.
  * If the size is smaller than the previous size, the previous memory block is
  * reused.
  *
@@ -1347,8 +3218,6 @@ void free(void *bp) {
  */
 void *realloc(void *ptr, size_t size) {
     block_t *block = payload_to_header(ptr);
-    size_t copysize;
-    void *newptr;
 
     // If size == 0, then free block and return NULL
     if (size == 0) {
@@ -1360,32 +3229,61 @@ void *realloc(void *ptr, size_t size) {
     if (ptr == NULL)
         return malloc(size);
 
+#ifndef MM_CONCURRENT
+    // A slab slot is kept if it is large enough, and moved otherwise
+    slab_t *slab = get_slab(ptr);
+    if (slab) {
+        if (size <= slab->slot_size)
+            return ptr;
+
+        void *newptr = malloc(size);
+        if (newptr == NULL)
+            return NULL;
+        memcpy(newptr, ptr, slab->slot_size);
+        free(ptr);
+        return newptr;
+    }
+#endif
+
+    size_t asize = round_up(size + wsize, dsize);
+
+    // A mapped block is remapped, unless it becomes small enough for the heap
+    if (get_mapped(block)) {
+        if (asize >= MAP_THRESHOLD) {
+            block_t *remapped = remap_block(block, asize);
+            if (remapped)
+                return header_to_payload(remapped);
+        }
+        return move_block(ptr, size);
+    }
+
     // Don't allocate new memory if new size is smaller than or equal to
     // the original size
-    size_t asize = round_up(size + wsize, dsize);
     if (asize <= get_size(block)) {
         // split if enough space for a new free block
+#ifdef MM_CONCURRENT
+        arena_lock(get_arena(block));
+        split_block(block, asize);
+        arena_unlock();
+#else
         split_block(block, asize);
+#endif
         return ptr;
     }
 
-    // Otherwise, proceed with reallocation
-    newptr = malloc(size);
-
-    // If malloc fails, the original block is left untouched
-    if (newptr == NULL)
-        return NULL;
-
-    // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
-    if (size < copysize)
-        copysize = size;
-    memcpy(newptr, ptr, copysize);
-
-    // Free the old block
-    free(ptr);
+    // Otherwise, try to grow the block in place
+#ifdef MM_CONCURRENT
+    arena_lock(get_arena(block));
+    block_t *grown = grow_block(block, asize);
+    arena_unlock();
+#else
+    block_t *grown = grow_block(block, asize);
+#endif
+    if (grown)
+        return header_to_payload(grown);
 
-    return newptr;
+    // Otherwise, proceed with reallocation
+    return move_block(ptr, size);
 }
 
 /**
@@ -1422,6 +3320,351 @@ void *calloc(size_t elements, size_t size) {
     return bp;
 }
 
+/**
+ * @brief Allocate a block of memory whose payload is aligned to a power of two
+ *
+ * Alignments of at most 16 bytes are met by every block. Otherwise a free
+ * block with room for an aligned block is carved, and the slack before the
+ * aligned block stays a free block instead of being wasted.
+ *
+ * @see mm_malloc
+ *
+ * @param[in] alignment Alignment of the payload, a power of two
+ * @param[in] size Size of the payload in bytes
+ * @return Allocated memory payload. NULL if out of memory, if size is 0 or if
+ *         the alignment is not a power of two.
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment <= dsize)
+        return malloc(size);
+    if ((alignment & (alignment - 1)) != 0 || size == 0)
+        return NULL;
+
+    // Aligned blocks always come from the heap, since a mapping puts its
+    // header rather than its payload on a page boundary
+    size_t asize = round_up(size + wsize, dsize);
+
+#ifdef MM_CONCURRENT
+    arena_lock(thread_arena());
+#endif
+
+    block_t *block = alloc_aligned_block(alignment, asize);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+#ifdef MM_CONCURRENT
+    arena_unlock();
+#endif
+
+    return block ? header_to_payload(block) : NULL;
+}
+
+/**
+ * @brief Allocate a block of memory whose payload is aligned to a power of two
+ *        and report errors POSIX style
+ *
+ * @see aligned_alloc
+ *
+ * @param[out] memptr Where to store the allocated payload
+ * @param[in] alignment Alignment of the payload, a power of two multiple of
+ *                      sizeof(void *)
+ * @param[in] size Size of the payload in bytes
+ * @return 0 on success, EINVAL if the alignment is invalid, ENOMEM if out of
+ *         memory
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    void *bp = aligned_alloc(alignment, size);
+    if (bp == NULL && size != 0)
+        return ENOMEM;
+
+    *memptr = bp;
+    return 0;
+}
+
+/**
+ * @brief Get the number of bytes usable in an allocated payload
+ *
+ * This is at least the size requested, and includes the rounding of the
+ * block, so a caller may grow into it without realloc.
+ *
+ * @param[in] bp A pointer returned by *alloc, or NULL
+ * @return Usable size of the payload in bytes. 0 if bp is NULL.
+ */
+size_t malloc_usable_size(void *bp) {
+    if (bp == NULL)
+        return 0;
+
+#ifndef MM_CONCURRENT
+    slab_t *slab = get_slab(bp);
+    if (slab)
+        return slab->slot_size;
+#endif
+
+    return get_payload_size(payload_to_header(bp));
+}
+
+/**
+ * @brief Allocate n consecutive blocks of asize bytes out of a single fit
+ * @param[in] asize Block size
+ * @param[in] n Number of blocks, at least 1
+ * @param[out] out Array receiving the n payloads
+ * @return True on success. False if out of memory.
+ */
+static bool alloc_blocks(size_t asize, size_t n, void **out) {
+    size_t total = asize * n;
+    block_t *block = find_fit(total);
+#ifndef MM_CONCURRENT
+    if (block == NULL && consolidate_quick_lists())
+        block = find_fit(total);
+#endif
+    if (block == NULL)
+        block = extend_heap(max(total, chunksize));
+    if (block == NULL)
+        return false;
+
+    remove_block_from_free_list(block);
+    size_t remaining = get_size(block);
+    bool prev_alloc = get_prev_alloc(block);
+    for (size_t i = 0; i + 1 < n; ++i) {
+        write_block(block, asize, prev_alloc, true);
+        out[i] = header_to_payload(block);
+        prev_alloc = true;
+        remaining -= asize;
+        block = find_next(block);
+    }
+
+    // the last block takes the rest of the fit, and gives back what it does
+    // not need
+    write_block(block, remaining, prev_alloc, true);
+    set_next_prev_alloc(block);
+    split_block(block, asize);
+    out[n - 1] = header_to_payload(block);
+    return true;
+}
+
+/**
+ * @brief Allocate n blocks of the same size at once
+ *
+ * Blocks of the same size waiting on a quick list are reused first, like in
+ * malloc. The rest are carved back to back out of a single fit, so the
+ * seglists are searched and updated once rather than n times. A fit holds
+ * less than MAP_THRESHOLD bytes, so large batches take several. Small sizes
+ * take whole words of slots from slabs instead, and huge sizes are allocated
+ * one at a time.
+ *
+ * @see mm_malloc
+ *
+ * @param[in] size Size of each payload in bytes
+ * @param[in] n Number of blocks
+ * @param[out] out Array receiving the n payloads
+ * @return Number of blocks allocated, less than n if out of memory
+ */
+size_t malloc_batch(size_t size, size_t n, void **out) {
+    if (size == 0)
+        return 0;
+
+    size_t asize = round_up(size + wsize, dsize);
+    size_t done = 0;
+
+#ifndef MM_CONCURRENT
+    // Small requests are served from slabs like in malloc
+    if (size <= max_slot_size && round_up(size, dsize) < asize) {
+        done = slab_alloc_batch(size, n, out);
+        dbg_ensures(mm_checkheap(__LINE__));
+    }
+#endif
+
+    if (asize >= MAP_THRESHOLD / 2) {
+        while (done < n && (out[done] = malloc(size)) != NULL)
+            ++done;
+        return done;
+    }
+
+#ifdef MM_CONCURRENT
+    // Reuse cached blocks of the same size first, like malloc
+    arena_t *arena = thread_arena();
+    block_t *block;
+    while (done < n && (block = tcache_pop(asize)) != NULL)
+        out[done++] = header_to_payload(block);
+    if (done == n)
+        return done;
+
+    for (size_t i = 0; i < ARENA_COUNT; ++i)
+        remote_flush(i);
+    arena_lock(arena);
+#else
+    block_t *block;
+    while (done < n && (block = quick_pop(asize)) != NULL)
+        out[done++] = header_to_payload(block);
+#endif
+
+    size_t per_fit = MAP_THRESHOLD / asize;
+    while (done < n) {
+        size_t count = n - done < per_fit ? n - done : per_fit;
+        if (!alloc_blocks(asize, count, out + done))
+            break;
+        done += count;
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+#ifdef MM_CONCURRENT
+    arena_unlock();
+#endif
+    return done;
+}
+
+/**
+ * @brief Free a block whose requested size is known
+ *
+ * Only requests of at most max_slot_size bytes can be slab slots, and only
+ * requests of MAP_THRESHOLD bytes or more can be mapped, so other sizes go
+ * straight to the heap without looking the block up.
+ *
+ * @see mm_free
+ *
+ * @param[in] bp The pointer to the memory payload
+ * @param[in] size The size last requested for the block
+ */
+void free_sized(void *bp, size_t size) {
+    dbg_requires(bp == NULL || size <= malloc_usable_size(bp));
+
+    if (bp == NULL)
+        return;
+
+#ifndef MM_CONCURRENT
+    if (size <= max_slot_size) {
+        free(bp);
+        return;
+    }
+#endif
+    if (round_up(size + wsize, dsize) >= MAP_THRESHOLD) {
+        free(bp);
+        return;
+    }
+
+    dbg_requires(mm_checkheap(__LINE__));
+    free_heap_block(payload_to_header(bp));
+}
+
+/**
+ * @brief Order two pointers by address, for qsort
+ * @param[in] a Pointer to the first pointer
+ * @param[in] b Pointer to the second pointer
+ * @return Negative, zero or positive as the first is below, at or above the
+ *         second
+ */
+static int compare_ptrs(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) * (void *const *)a;
+    uintptr_t y = (uintptr_t) * (void *const *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Sort pointers by address
+ *
+ * Short batches are insertion sorted, which beats qsort and its indirect
+ * comparisons for them.
+ *
+ * @param[in,out] ptrs Pointers to sort
+ * @param[in] n Number of pointers
+ */
+static void sort_ptrs(void **ptrs, size_t n) {
+    if (n > 32) {
+        qsort(ptrs, n, sizeof(*ptrs), compare_ptrs);
+        return;
+    }
+
+    for (size_t i = 1; i < n; ++i) {
+        void *bp = ptrs[i];
+        size_t j = i;
+        for (; j > 0 && (uintptr_t)ptrs[j - 1] > (uintptr_t)bp; --j)
+            ptrs[j] = ptrs[j - 1];
+        ptrs[j] = bp;
+    }
+}
+
+/**
+ * @brief Free n blocks at once
+ *
+ * Slab slots and mapped blocks are freed right away, and small blocks go to
+ * their quick list like in free. The other heap blocks are sorted by
+ * address, so each run of neighboring blocks is merged into one free block,
+ * coalesced and added to the seglists once.
+ *
+ * @see mm_free
+ *
+ * @param[in,out] ptrs Pointers to free, clobbered. NULL entries are ignored.
+ * @param[in] n Number of pointers
+ */
+void free_batch(void **ptrs, size_t n) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+#ifdef MM_CONCURRENT
+    thread_arena(); // resets a thread cache left from an old heap
+#endif
+
+    // free slab slots and mapped blocks right away, and keep heap blocks
+    size_t n_heap = 0;
+    for (size_t i = 0; i < n; ++i) {
+        void *bp = ptrs[i];
+        if (bp == NULL)
+            continue;
+
+#ifndef MM_CONCURRENT
+        slab_t *slab = get_slab(bp);
+        if (slab) {
+            slab_free(slab, bp);
+            continue;
+        }
+#endif
+        block_t *block = payload_to_header(bp);
+        if (get_mapped(block)) {
+            unmap_block(block);
+            continue;
+        }
+
+        // small blocks are cached uncoalesced, like in free
+#ifdef MM_CONCURRENT
+        if (tcache_push(block))
+            continue;
+#else
+        if (quick_push(block))
+            continue;
+#endif
+        ptrs[n_heap++] = bp;
+    }
+
+    sort_ptrs(ptrs, n_heap);
+
+    size_t i = 0;
+    while (i < n_heap) {
+        void *bp = ptrs[i++];
+        block_t *block = payload_to_header(bp);
+
+#ifdef MM_CONCURRENT
+        // a run never crosses a region, so it belongs to a single arena
+        arena_lock(get_arena(block));
+#endif
+
+        // extend the run while the next pointer is the next block
+        size_t size = get_size(block);
+        size_t count = 1;
+        while (i < n_heap && ptrs[i] == (char *)bp + size) {
+            size += get_size(payload_to_header(ptrs[i++]));
+            ++count;
+        }
+        free_run(block, size, count);
+
+#ifdef MM_CONCURRENT
+        arena_unlock();
+#endif
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
 /*
  *****************************************************************************
  * Do not delete the following super-secret(tm) lines!                       *
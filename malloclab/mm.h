@@ -11,11 +11,40 @@
 
 #ifdef DRIVER
 
+/*
+ * With MM_NAMESPACE set to ns, the names of the allocator become ns_mm_...,
+ * so that mdriver can link several allocators together.
+ */
+#ifdef MM_NAMESPACE
+#define MM_PASTE_(ns, name) ns##_##name
+#define MM_NAMESPACED(ns, name) MM_PASTE_(ns, name)
+#define mm_malloc MM_NAMESPACED(MM_NAMESPACE, mm_malloc)
+#define mm_free MM_NAMESPACED(MM_NAMESPACE, mm_free)
+#define mm_realloc MM_NAMESPACED(MM_NAMESPACE, mm_realloc)
+#define mm_calloc MM_NAMESPACED(MM_NAMESPACE, mm_calloc)
+#define mm_aligned_alloc MM_NAMESPACED(MM_NAMESPACE, mm_aligned_alloc)
+#define mm_posix_memalign MM_NAMESPACED(MM_NAMESPACE, mm_posix_memalign)
+#define mm_usable_size MM_NAMESPACED(MM_NAMESPACE, mm_usable_size)
+#define mm_malloc_batch MM_NAMESPACED(MM_NAMESPACE, mm_malloc_batch)
+#define mm_free_sized MM_NAMESPACED(MM_NAMESPACE, mm_free_sized)
+#define mm_free_batch MM_NAMESPACED(MM_NAMESPACE, mm_free_batch)
+#define mm_init MM_NAMESPACED(MM_NAMESPACE, mm_init)
+#define mm_checkheap MM_NAMESPACED(MM_NAMESPACE, mm_checkheap)
+#define mm_profile MM_NAMESPACED(MM_NAMESPACE, mm_profile)
+#define print_heap MM_NAMESPACED(MM_NAMESPACE, print_heap)
+#endif
+
 /* declare functions for driver tests */
 extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern size_t mm_usable_size(void *ptr);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_sized(void *ptr, size_t size);
+extern void mm_free_batch(void **ptrs, size_t n);
 
 #else
 
@@ -59,6 +88,67 @@ extern void *realloc(void *ptr, size_t size);
  * @return A pointer to the first element of the array.
  */
 extern void *calloc(size_t nmemb, size_t size);
+
+/**
+ * @brief  Allocate memory in the heap of at least `size` bytes, aligned to
+ *         `alignment` bytes.
+ *
+ * @param[in] alignment  The alignment of the payload, a power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes.
+ */
+extern void *aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * @brief  Allocate memory in the heap of at least `size` bytes, aligned to
+ *         `alignment` bytes.
+ *
+ * @param[out] memptr  Where to store the pointer to the allocated bytes.
+ * @param[in] alignment  The alignment of the payload, a power of two multiple
+ *                       of sizeof(void *).
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  0 on success, EINVAL or ENOMEM otherwise.
+ */
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/**
+ * @brief  Get the number of usable bytes of an allocated block.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ *
+ * @return  The usable size, at least the size requested.
+ */
+extern size_t malloc_usable_size(void *ptr);
+
+/**
+ * @brief  Allocate `n` blocks of at least `size` bytes each.
+ *
+ * @param[in] size  The minimum size of bytes of each block.
+ * @param[in] n  The number of blocks.
+ * @param[out] out  The array receiving pointers to the allocated bytes.
+ *
+ * @return  The number of blocks allocated, less than `n` if out of memory.
+ */
+extern size_t malloc_batch(size_t size, size_t n, void **out);
+
+/**
+ * @brief  Marks an allocated block of a known size as free.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] size  The size last requested for the block.
+ */
+extern void free_sized(void *ptr, size_t size);
+
+/**
+ * @brief  Marks `n` allocated blocks as free.
+ *
+ * @param[in,out] ptrs  Pointers to the allocated payloads, clobbered. NULL
+ *                      pointers are ignored.
+ * @param[in] n  The number of pointers.
+ */
+extern void free_batch(void **ptrs, size_t n);
 #endif
 
 /**
@@ -78,4 +168,40 @@ extern bool mm_init(void);
  */
 extern bool mm_checkheap(int line);
 
+/** @brief Number of buckets in the free block size histogram */
+#define MM_PROFILE_BUCKETS 32
+
+/** @brief Most free lists an allocator can report */
+#define MM_PROFILE_LISTS 256
+
+/**
+ * @brief A snapshot of the heap, taken by mm_profile().
+ *
+ * All sizes are block sizes in bytes, headers included.
+ */
+typedef struct {
+    size_t alloc_blocks; /**< Allocated blocks in the heap */
+    size_t alloc_bytes;  /**< Their total size, slabs and caches included */
+    size_t free_blocks;  /**< Free blocks in the heap */
+    size_t free_bytes;   /**< Their total size */
+    size_t largest_free; /**< Size of the largest free block */
+    size_t cached_bytes; /**< Freed blocks kept allocated for reuse */
+    size_t slab_free;    /**< Free slots in slabs, in bytes */
+    size_t mapped_bytes; /**< Length of the blocks with their own mapping */
+    /** Free blocks by size, bucket i holds sizes in [2^i, 2^(i+1)) */
+    size_t free_hist[MM_PROFILE_BUCKETS];
+    size_t num_lists; /**< Free lists reported in list_blocks */
+    /** Blocks in each free list */
+    size_t list_blocks[MM_PROFILE_LISTS];
+} mm_profile_t;
+
+/**
+ * @brief  Walk the heap and take a snapshot of its fragmentation.
+ *
+ * @param[out] prof  The snapshot.
+ *
+ * @return  True on success, False if the allocator does not support it.
+ */
+extern bool mm_profile(mm_profile_t *prof);
+
 #endif /* mm.h */
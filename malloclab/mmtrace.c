@@ -0,0 +1,363 @@
+/*
+ * mmtrace.c - A malloc tracer for real programs.  Built as a shared
+ *     library, it is preloaded into a program
+ *
+ *         MMTRACE_LOG=prog LD_PRELOAD=./libmmtrace.so prog args...
+ *
+ *     and interposes on the malloc family, which it forwards to libc.
+ *     Every request is appended to a buffer owned by the calling thread,
+ *     so logging takes no lock: the only shared write is the atomic
+ *     increment of the sequence number that orders requests across
+ *     threads.  A full buffer is written to the log with one write() on
+ *     an O_APPEND descriptor; buffers are also flushed when their thread
+ *     exits and when the program exits.  The log, prog.<pid>.log
+ *     (mmtrace.<pid>.log without MMTRACE_LOG), is then turned into a trace
+ *     with mmtrace2rep.
+ *
+ *     A freed block is logged before it is released and a new block after
+ *     it is obtained, so a block that is reused by another thread is never
+ *     logged as allocated before it was freed.  The one exception is the
+ *     old block of a realloc that moves, which mmtrace2rep tolerates.
+ *
+ *     The libc allocator is reached through glibc's __libc_* entry points
+ *     rather than dlsym(), which would itself allocate.  Requests made by
+ *     the tracer itself and by threads still running after exit() are not
+ *     logged.  A child process, forked or executed, writes a log of its own.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mmtrace.h"
+
+/* Requests buffered by a thread before they are written to the log */
+#define BUF_OPS 4096
+
+/* The tracer must not allocate when its thread-local data is touched */
+#define TLS_MODEL __attribute__((tls_model("initial-exec")))
+
+/* The allocator in libc */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+/* Interposed functions, not all of which stdlib.h declares */
+void *malloc(size_t size);
+void free(void *ptr);
+void *realloc(void *ptr, size_t size);
+void *calloc(size_t nmemb, size_t size);
+void *reallocarray(void *ptr, size_t nmemb, size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+void *memalign(size_t alignment, size_t size);
+void *valloc(size_t size);
+void *pvalloc(size_t size);
+
+/* A buffer of requests, owned by one thread at a time */
+typedef struct buf {
+    struct buf *next; /* Next buffer in the list of all of them */
+    atomic_bool used; /* Is the buffer owned by a live thread? */
+    uint32_t tid;     /* Owner */
+    size_t num_ops;   /* Requests not yet written */
+    mt_op_t ops[BUF_OPS];
+} buf_t;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t buf_key;             /* Flushes a buffer at thread exit */
+static int log_fd = -1;                   /* The log */
+static atomic_bool tracing;               /* Are requests logged? */
+static atomic_uint_fast64_t next_seq;     /* Sequence number of next request */
+static _Atomic(buf_t *) all_bufs = NULL;  /* Buffers, owned or not */
+static _Thread_local buf_t *my_buf TLS_MODEL = NULL;   /* This thread's */
+static _Thread_local bool in_tracer TLS_MODEL = false; /* Do not recurse */
+
+/* Function prototypes */
+static void open_log(void);
+static void init(void);
+static bool enter(void);
+static void leave(void);
+static buf_t *get_buf(void);
+static void flush_buf(buf_t *b);
+static void thread_exit(void *arg);
+static void after_fork(void);
+static void finish(void) __attribute__((destructor));
+static void log_op(mt_type_t type, const void *ptr, uint64_t arg,
+                   uint64_t size);
+
+/*
+ * open_log - Create the log file of this process and write its header.
+ *     Tracing stays off if it cannot be created.
+ */
+static void open_log(void) {
+    char path[4096];
+    const char *prefix = getenv(MMTRACE_ENV);
+    mt_header_t header;
+
+    if (prefix == NULL || prefix[0] == '\0')
+        prefix = "mmtrace";
+    snprintf(path, sizeof(path), "%s.%d.log", prefix, (int)getpid());
+    log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                  0644);
+    if (log_fd < 0) {
+        fprintf(stderr, "mmtrace: cannot create %s: %s\n", path,
+                strerror(errno));
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MMTRACE_MAGIC, sizeof(header.magic));
+    header.op_size = sizeof(mt_op_t);
+    header.pid = (uint32_t)getpid();
+    if (write(log_fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        close(log_fd);
+        log_fd = -1;
+        return;
+    }
+    atomic_store(&tracing, true);
+}
+
+/*
+ * init - Set up the tracer on the first request
+ */
+static void init(void) {
+    if (pthread_key_create(&buf_key, thread_exit) != 0)
+        return;
+    pthread_atfork(NULL, NULL, after_fork);
+    open_log();
+}
+
+/*
+ * enter - Start logging a request.  Returns false if the request is not
+ *     logged, because tracing is off or the tracer itself made it.
+ */
+static bool enter(void) {
+    if (in_tracer)
+        return false;
+    in_tracer = true;
+    pthread_once(&init_once, init);
+    if (!atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        in_tracer = false;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * leave - Done logging a request
+ */
+static void leave(void) {
+    in_tracer = false;
+}
+
+/*
+ * get_buf - Return the buffer of this thread, taking over the buffer of an
+ *     exited thread or mapping a new one on its first request
+ */
+static buf_t *get_buf(void) {
+    buf_t *b;
+
+    if (my_buf != NULL)
+        return my_buf;
+
+    for (b = atomic_load(&all_bufs); b != NULL; b = b->next) {
+        bool unused = false;
+        if (atomic_compare_exchange_strong(&b->used, &unused, true))
+            break;
+    }
+    if (b == NULL) {
+        b = mmap(NULL, sizeof(buf_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b == MAP_FAILED)
+            return NULL;
+        atomic_init(&b->used, true);
+        b->next = atomic_load(&all_bufs);
+        while (!atomic_compare_exchange_weak(&all_bufs, &b->next, b))
+            ;
+    }
+    b->tid = (uint32_t)gettid();
+    b->num_ops = 0;
+    my_buf = b;
+    pthread_setspecific(buf_key, b);
+    return b;
+}
+
+/*
+ * flush_buf - Write the requests in a buffer to the log
+ */
+static void flush_buf(buf_t *b) {
+    const char *p = (const char *)b->ops;
+    size_t left = b->num_ops * sizeof(mt_op_t);
+
+    while (left > 0) {
+        ssize_t n = write(log_fd, p, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "mmtrace: write to log failed, tracing stops\n");
+            atomic_store(&tracing, false);
+            break;
+        }
+        p += n;
+        left -= (size_t)n;
+    }
+    b->num_ops = 0;
+}
+
+/*
+ * thread_exit - Flush the buffer of an exiting thread and release it
+ */
+static void thread_exit(void *arg) {
+    buf_t *b = arg;
+
+    in_tracer = true;
+    if (atomic_load(&tracing))
+        flush_buf(b);
+    my_buf = NULL;
+    atomic_store(&b->used, false);
+    in_tracer = false;
+}
+
+/*
+ * after_fork - In the child, drop the requests of the parent and start a
+ *     new log.  Only the forking thread lives on, so it keeps its buffer.
+ */
+static void after_fork(void) {
+    atomic_store(&tracing, false);
+    for (buf_t *b = atomic_load(&all_bufs); b != NULL; b = b->next) {
+        b->num_ops = 0;
+        if (b != my_buf)
+            atomic_store(&b->used, false);
+    }
+    if (my_buf != NULL)
+        my_buf->tid = (uint32_t)gettid();
+    if (log_fd >= 0)
+        close(log_fd);
+    open_log();
+}
+
+/*
+ * finish - At exit, stop tracing and flush the buffers of all threads
+ */
+static void finish(void) {
+    if (!atomic_exchange(&tracing, false))
+        return;
+    for (buf_t *b = atomic_load(&all_bufs); b != NULL; b = b->next)
+        flush_buf(b);
+    close(log_fd);
+    log_fd = -1;
+}
+
+/*
+ * log_op - Append a request to the buffer of this thread.  Called between
+ *     enter() and leave().
+ */
+static void log_op(mt_type_t type, const void *ptr, uint64_t arg,
+                   uint64_t size) {
+    buf_t *b = get_buf();
+    if (b == NULL)
+        return;
+
+    mt_op_t *op = &b->ops[b->num_ops];
+    op->seq = atomic_fetch_add_explicit(&next_seq, 1, memory_order_relaxed);
+    op->ptr = (uint64_t)(uintptr_t)ptr;
+    op->arg = arg;
+    op->size = size;
+    op->type = type;
+    op->tid = b->tid;
+    if (++b->num_ops == BUF_OPS)
+        flush_buf(b);
+}
+
+/*
+ * The interposed functions
+ */
+void *malloc(size_t size) {
+    void *p = __libc_malloc(size);
+    if (p != NULL && enter()) {
+        log_op(MT_ALLOC, p, 0, size);
+        leave();
+    }
+    return p;
+}
+
+void free(void *ptr) {
+    if (ptr != NULL && enter()) {
+        log_op(MT_FREE, ptr, 0, 0);
+        leave();
+    }
+    __libc_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size) {
+    void *p = __libc_realloc(ptr, size);
+    if ((p != NULL || (ptr != NULL && size == 0)) && enter()) {
+        if (p == NULL)
+            log_op(MT_FREE, ptr, 0, 0);
+        else
+            log_op(MT_REALLOC, p, (uint64_t)(uintptr_t)ptr, size);
+        leave();
+    }
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    void *p = __libc_calloc(nmemb, size);
+    if (p != NULL && enter()) {
+        log_op(MT_ALLOC, p, 0, (uint64_t)nmemb * size);
+        leave();
+    }
+    return p;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, bytes);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    void *p = __libc_memalign(alignment, size);
+    if (p != NULL && enter()) {
+        log_op(MT_ALIGNED, p, alignment, size);
+        leave();
+    }
+    return p;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    void *p = memalign(alignment, size);
+    if (p == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void *valloc(size_t size) {
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
@@ -0,0 +1,46 @@
+/**
+ * @file mmtrace.h
+ * @brief Log format of the malloc tracer
+ *
+ * The tracer (mmtrace.c) is preloaded into a real program and logs its heap
+ * requests, and mmtrace2rep turns the log into a trace for mdriver. The log
+ * is a header followed by the requests of all threads, written in chunks in
+ * no particular order; the sequence numbers give the order in the program.
+ */
+#ifndef MMTRACE_H__
+#define MMTRACE_H__ 1
+
+#include <stdint.h>
+
+/** @brief First bytes of a log file */
+#define MMTRACE_MAGIC "MMTRLOG1"
+
+/** @brief Environment variable with the prefix of the log file names */
+#define MMTRACE_ENV "MMTRACE_LOG"
+
+/** @brief Kinds of logged requests */
+typedef enum {
+    MT_ALLOC,   /* malloc, calloc */
+    MT_REALLOC, /* realloc, reallocarray */
+    MT_ALIGNED, /* aligned_alloc, posix_memalign, memalign, valloc */
+    MT_FREE     /* free, or realloc to size 0 */
+} mt_type_t;
+
+/** @brief A logged request */
+typedef struct {
+    uint64_t seq;  /* Order of the request among all threads */
+    uint64_t ptr;  /* Block returned, or the block freed */
+    uint64_t arg;  /* Old block of a realloc, alignment of an aligned alloc */
+    uint64_t size; /* Requested size in bytes */
+    uint32_t type; /* An mt_type_t */
+    uint32_t tid;  /* Thread that made the request */
+} mt_op_t;
+
+/** @brief Header of a log file */
+typedef struct {
+    char magic[8];    /* MMTRACE_MAGIC, not terminated */
+    uint32_t op_size; /* sizeof(mt_op_t) of the writer */
+    uint32_t pid;     /* Process that was traced */
+} mt_header_t;
+
+#endif /* mmtrace.h */
@@ -0,0 +1,428 @@
+/*
+ * mmtrace2rep - Turn a log written by the malloc tracer (mmtrace.c) into a
+ *     trace for mdriver.
+ *
+ *     The requests of all threads are sorted by sequence number and the
+ *     blocks are given ids in the order they are allocated; a block keeps
+ *     its id across reallocs.  Frees of blocks that were not allocated
+ *     while tracing are dropped, and blocks still live at the end are left
+ *     allocated.  Allocations of 0 bytes are dropped too, as mdriver takes
+ *     NULL for a failure.  The header records the peak number of live
+ *     payload bytes.  A binary trace is then written with mdriver -w.
+ *
+ *     Usage: mmtrace2rep [-h] [-v] [-w <weight>] <log> [<trace>]
+ *
+ *     The trace is written to standard output if no file is named.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mmtrace.h"
+
+/* A request of the trace, before it is printed */
+typedef struct {
+    char type;      /* 'a', 'r', 'A' or 'f', as in the .rep format */
+    unsigned index; /* Id of the block */
+    size_t align;   /* Alignment of an 'A' request */
+    size_t size;    /* Payload size */
+} rep_op_t;
+
+/* A live block, keyed by its address in the traced program */
+typedef struct {
+    uint64_t ptr; /* 0 if the slot is empty */
+    unsigned index;
+    size_t size;
+} live_t;
+
+/* The blocks live at some point of the trace, by address */
+typedef struct {
+    live_t *slots;
+    size_t num_slots; /* A power of two */
+    size_t count;
+} live_map_t;
+
+/* Summary of a conversion */
+typedef struct {
+    size_t requests;   /* Requests in the log */
+    size_t threads;    /* Distinct threads that made them */
+    size_t empty;      /* Allocations of 0 bytes */
+    size_t unknown;    /* Frees and reallocs of blocks not traced */
+    size_t reused;     /* Blocks allocated again before being freed */
+    size_t peak_bytes; /* Peak live payload bytes */
+} summary_t;
+
+static bool verbose = false;
+
+/* Function prototypes */
+static void usage(void);
+static void unix_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2), noreturn));
+static void app_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2), noreturn));
+static mt_op_t *map_log(const char *filename, size_t *num_ops);
+static int cmp_seq(const void *a, const void *b);
+static size_t hash_ptr(const live_map_t *map, uint64_t ptr);
+static live_t *live_find(live_map_t *map, uint64_t ptr);
+static void live_insert(live_map_t *map, uint64_t ptr, unsigned index,
+                        size_t size);
+static void live_remove(live_map_t *map, live_t *slot);
+static size_t convert(const mt_op_t *log, size_t num_log, rep_op_t *ops,
+                      unsigned *num_ids, summary_t *sum);
+static void write_rep(FILE *out, unsigned weight, const rep_op_t *ops,
+                      size_t num_ops, unsigned num_ids, size_t peak_bytes);
+
+int main(int argc, char **argv) {
+    unsigned weight = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "hvw:")) != EOF) {
+        switch (c) {
+        case 'v':
+            verbose = true;
+            break;
+        case 'w':
+            weight = (unsigned)atoi(optarg);
+            if (weight > 3)
+                app_error("Weight must be in {0, 1, 2, 3}");
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(c == 'h' ? 0 : 1);
+        }
+    }
+    if (optind >= argc || argc - optind > 2) {
+        usage();
+        exit(1);
+    }
+
+    size_t num_log;
+    mt_op_t *log = map_log(argv[optind], &num_log);
+    if (num_log == 0)
+        app_error("%s holds no requests", argv[optind]);
+
+    /* A request yields at most two: a free of a reused block, then itself */
+    rep_op_t *ops = calloc(2 * num_log, sizeof(rep_op_t));
+    if (ops == NULL)
+        unix_error("calloc failed in main");
+
+    summary_t sum;
+    unsigned num_ids;
+    size_t num_ops = convert(log, num_log, ops, &num_ids, &sum);
+    if (num_ids == 0)
+        app_error("%s holds no allocations", argv[optind]);
+
+    FILE *out = stdout;
+    if (optind + 1 < argc && (out = fopen(argv[optind + 1], "w")) == NULL)
+        unix_error("Could not open %s", argv[optind + 1]);
+    write_rep(out, weight, ops, num_ops, num_ids, sum.peak_bytes);
+    if (fclose(out) != 0)
+        unix_error("Could not write the trace");
+
+    fprintf(stderr,
+            "%zu requests from %zu threads: %zu ops on %u ids, "
+            "peak %zu bytes\n",
+            sum.requests, sum.threads, num_ops, num_ids, sum.peak_bytes);
+    if (sum.empty > 0 || sum.unknown > 0 || sum.reused > 0)
+        fprintf(stderr,
+                "dropped %zu allocations of 0 bytes and %zu requests on "
+                "untraced blocks; %zu blocks reused before their free\n",
+                sum.empty, sum.unknown, sum.reused);
+    free(ops);
+    return 0;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: mmtrace2rep [-h] [-v] [-w <weight>] <log> [<trace>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-v         Report every dropped request.\n");
+    fprintf(stderr, "\t-w <w>     Weight of the trace (default 1).\n");
+    fprintf(stderr, "Writes the trace to <trace>, or standard output.\n");
+}
+
+/*
+ * unix_error - Report a Unix-style error and exit
+ */
+static void unix_error(const char *fmt, ...) {
+    va_list ap;
+    int err = errno;
+
+    fprintf(stderr, "mmtrace2rep: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, ": %s\n", strerror(err));
+    exit(1);
+}
+
+/*
+ * app_error - Report an error and exit
+ */
+static void app_error(const char *fmt, ...) {
+    va_list ap;
+
+    fprintf(stderr, "mmtrace2rep: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/*
+ * map_log - Map a log and sort its requests by sequence number.  A partly
+ *     written request at the end, from a program that was killed, is
+ *     ignored.
+ */
+static mt_op_t *map_log(const char *filename, size_t *num_ops) {
+    mt_header_t header;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        unix_error("Could not open %s", filename);
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, MMTRACE_MAGIC, sizeof(header.magic)) != 0)
+        app_error("%s is not a log of the malloc tracer", filename);
+    if (header.op_size != sizeof(mt_op_t))
+        app_error("%s: written with %u-byte requests, expected %zu",
+                  filename, header.op_size, sizeof(mt_op_t));
+    if (fstat(fd, &st) < 0)
+        unix_error("fstat failed in map_log");
+
+    /* Private, so that the requests can be sorted in place */
+    size_t len = (size_t)st.st_size;
+    char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        unix_error("mmap failed in map_log");
+    close(fd);
+
+    mt_op_t *log = (mt_op_t *)(map + sizeof(header));
+    *num_ops = (len - sizeof(header)) / sizeof(mt_op_t);
+    qsort(log, *num_ops, sizeof(mt_op_t), cmp_seq);
+    return log;
+}
+
+/*
+ * cmp_seq - Order requests by sequence number
+ */
+static int cmp_seq(const void *a, const void *b) {
+    uint64_t sa = ((const mt_op_t *)a)->seq;
+    uint64_t sb = ((const mt_op_t *)b)->seq;
+    return (sa > sb) - (sa < sb);
+}
+
+/*
+ * hash_ptr - Home slot of an address
+ */
+static size_t hash_ptr(const live_map_t *map, uint64_t ptr) {
+    return (size_t)((ptr >> 4) * 0x9E3779B97F4A7C15u) & (map->num_slots - 1);
+}
+
+/*
+ * live_find - Return the slot of a live block, or NULL
+ */
+static live_t *live_find(live_map_t *map, uint64_t ptr) {
+    if (map->num_slots == 0)
+        return NULL;
+    size_t mask = map->num_slots - 1;
+    for (size_t i = hash_ptr(map, ptr);; i = (i + 1) & mask) {
+        live_t *slot = &map->slots[i];
+        if (slot->ptr == ptr)
+            return slot;
+        if (slot->ptr == 0)
+            return NULL;
+    }
+}
+
+/*
+ * live_insert - Add a block that is not live, doubling the table when it
+ *     gets half full
+ */
+static void live_insert(live_map_t *map, uint64_t ptr, unsigned index,
+                        size_t size) {
+    if (2 * (map->count + 1) > map->num_slots) {
+        live_map_t old = *map;
+        map->num_slots = old.num_slots ? 2 * old.num_slots : 1024;
+        map->count = 0;
+        if ((map->slots = calloc(map->num_slots, sizeof(live_t))) == NULL)
+            unix_error("calloc failed in live_insert");
+        for (size_t i = 0; i < old.num_slots; i++)
+            if (old.slots[i].ptr != 0)
+                live_insert(map, old.slots[i].ptr, old.slots[i].index,
+                            old.slots[i].size);
+        free(old.slots);
+    }
+
+    size_t mask = map->num_slots - 1;
+    size_t i = hash_ptr(map, ptr);
+    while (map->slots[i].ptr != 0)
+        i = (i + 1) & mask;
+    map->slots[i].ptr = ptr;
+    map->slots[i].index = index;
+    map->slots[i].size = size;
+    map->count++;
+}
+
+/*
+ * live_remove - Empty a slot, moving back the blocks that probed past it
+ */
+static void live_remove(live_map_t *map, live_t *slot) {
+    size_t mask = map->num_slots - 1;
+    size_t hole = (size_t)(slot - map->slots);
+
+    for (size_t i = (hole + 1) & mask; map->slots[i].ptr != 0;
+         i = (i + 1) & mask) {
+        size_t home = hash_ptr(map, map->slots[i].ptr);
+        /* Move it if its home is not in (hole, i] */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            map->slots[hole] = map->slots[i];
+            hole = i;
+        }
+    }
+    map->slots[hole].ptr = 0;
+    map->count--;
+}
+
+/*
+ * convert - Turn the sorted log into trace requests.  Returns their
+ *     number.
+ */
+static size_t convert(const mt_op_t *log, size_t num_log, rep_op_t *ops,
+                      unsigned *num_ids, summary_t *sum) {
+    live_map_t live = {NULL, 0, 0};
+    uint32_t *tids = NULL;
+    size_t num_tids = 0;
+    size_t live_bytes = 0;
+    size_t n = 0;
+
+    memset(sum, 0, sizeof(*sum));
+    sum->requests = num_log;
+    *num_ids = 0;
+
+    for (size_t i = 0; i < num_log; i++) {
+        const mt_op_t *op = &log[i];
+        live_t *slot;
+        size_t size = (size_t)op->size;
+
+        /* Count the threads; there are few, so a scan will do */
+        size_t t = 0;
+        while (t < num_tids && tids[t] != op->tid)
+            t++;
+        if (t == num_tids) {
+            if ((tids = realloc(tids, (num_tids + 1) * sizeof(*tids))) ==
+                NULL)
+                unix_error("realloc failed in convert");
+            tids[num_tids++] = op->tid;
+        }
+
+        if (op->type == MT_FREE) {
+            if ((slot = live_find(&live, op->ptr)) == NULL) {
+                if (verbose)
+                    fprintf(stderr, "request %" PRIu64 ": free of %#" PRIx64
+                                    ", not traced\n",
+                            op->seq, op->ptr);
+                sum->unknown++;
+                continue;
+            }
+            ops[n++] = (rep_op_t){'f', slot->index, 0, 0};
+            live_bytes -= slot->size;
+            live_remove(&live, slot);
+            continue;
+        }
+
+        /* A realloc of a traced block keeps its id */
+        unsigned index = *num_ids;
+        char type = op->type == MT_ALIGNED ? 'A' : 'a';
+        if (op->type == MT_REALLOC && op->arg != 0) {
+            if ((slot = live_find(&live, op->arg)) != NULL) {
+                index = slot->index;
+                type = 'r';
+                live_bytes -= slot->size;
+                live_remove(&live, slot);
+            } else {
+                if (verbose)
+                    fprintf(stderr, "request %" PRIu64 ": realloc of %#" PRIx64
+                                    ", not traced\n",
+                            op->seq, op->arg);
+                sum->unknown++;
+            }
+        }
+        if (size == 0) {
+            /* Its block is not traced, as if malloc had returned NULL */
+            if (type == 'r')
+                ops[n++] = (rep_op_t){'f', index, 0, 0};
+            sum->empty++;
+            continue;
+        }
+        if (type != 'r')
+            (*num_ids)++;
+
+        /* The old block of a moving realloc in another thread, freed
+         * before the realloc was logged */
+        if ((slot = live_find(&live, op->ptr)) != NULL) {
+            ops[n++] = (rep_op_t){'f', slot->index, 0, 0};
+            live_bytes -= slot->size;
+            live_remove(&live, slot);
+            sum->reused++;
+        }
+
+        size_t align = 0;
+        if (type == 'A') {
+            /* memalign() rounds up an alignment that is not a power of 2 */
+            align = 1;
+            while (align < op->arg)
+                align <<= 1;
+        }
+        ops[n++] = (rep_op_t){type, index, align, size};
+        live_insert(&live, op->ptr, index, size);
+        live_bytes += size;
+        if (live_bytes > sum->peak_bytes)
+            sum->peak_bytes = live_bytes;
+    }
+
+    sum->threads = num_tids;
+    free(tids);
+    free(live.slots);
+    return n;
+}
+
+/*
+ * write_rep - Print a trace in the .rep format that mdriver reads
+ */
+static void write_rep(FILE *out, unsigned weight, const rep_op_t *ops,
+                      size_t num_ops, unsigned num_ids, size_t peak_bytes) {
+    fprintf(out, "%u\n%u\n%zu\n%zu\n", weight, num_ids, num_ops, peak_bytes);
+    for (size_t i = 0; i < num_ops; i++) {
+        const rep_op_t *op = &ops[i];
+        switch (op->type) {
+        case 'f':
+            fprintf(out, "f %u\n", op->index);
+            break;
+        case 'A':
+            fprintf(out, "A %u %zu %zu\n", op->index, op->align, op->size);
+            break;
+        default:
+            fprintf(out, "%c %u %zu\n", op->type, op->index, op->size);
+            break;
+        }
+    }
+}
@@ -0,0 +1,823 @@
+/*
+ * mmtracegen - Generate a synthetic trace for mdriver from a parametric
+ *     workload, to stress an allocator beyond the shipped traces.
+ *
+ *     Every allocation draws its size from a size distribution and its
+ *     lifetime, in ops, from a lifetime distribution; a block is freed
+ *     when its lifetime runs out.  Options add:
+ *
+ *     - phases: at each phase change, half of the live blocks are freed
+ *       and the sizes are scaled by 1, 4 or 16 in turn
+ *     - reallocs: some ops grow a live block, geometrically or linearly
+ *     - threads: allocations go round robin to logical threads, and the
+ *       blocks of thread t get ids with id % threads == t, so that
+ *       mdriver -P <threads> replays each on a thread of its own
+ *     - handoff: some blocks are passed to a consumer that frees them in
+ *       the order it got them, as in a producer-consumer queue.  A trace
+ *       keeps all ops on a block on one replay thread, so the free itself
+ *       crosses threads only in the cross-thread replay of mdriver -P.
+ *
+ *     Live payload is kept under a limit, by freeing the blocks that are
+ *     due first, so that the trace fits in the dense heap of mdriver.
+ *     Freed ids are reused, so a trace of 10^8 ops needs about as many
+ *     ids as there are live blocks.  The trace is generated twice with
+ *     the same seed: once to fill in the header, then to write it.  It is
+ *     the same for the same options and seed.  A binary trace is then
+ *     written with mdriver -w.
+ *
+ *     Usage: mmtracegen [-h] [-n <ops>] [-s <seed>] [-S <sizes>]
+ *                       [-L <lifetimes>] [-p <phases>] [-r <frac>]
+ *                       [-g <growth>] [-t <threads>] [-H <frac>]
+ *                       [-m <bytes>] [-w <weight>] [<trace>]
+ *
+ *     The trace is written to standard output if no file is named.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+/* Sizes are capped, so that a block always fits in the heap */
+#define MAX_SIZE ((size_t)1 << 24)
+
+/* Buffer of the output stream */
+#define OUT_BUF (1 << 20)
+
+/* Distributions of allocation sizes */
+typedef enum {
+    SIZE_POWER,   /* power:<alpha>:<min>:<max>, bounded power law */
+    SIZE_BIMODAL, /* bimodal:<small>:<large>:<p>, large with prob p */
+    SIZE_UNIFORM, /* uniform:<min>:<max> */
+    SIZE_SAMPLED  /* trace:<file>, the sizes requested in a .rep trace */
+} size_kind_t;
+
+typedef struct {
+    size_kind_t kind;
+    double alpha;    /* Exponent of a power law */
+    double p;        /* Probability of a large block */
+    size_t lo, hi;   /* Bounds, or the two sizes of a bimodal */
+    size_t *samples; /* Sizes of a sampled distribution... */
+    size_t num_samples; /* ... and how many */
+} size_dist_t;
+
+/* Distributions of lifetimes, in ops */
+typedef enum {
+    LIFE_EXP,   /* exp:<mean>, exponential */
+    LIFE_PARETO /* pareto:<alpha>:<min>, heavy-tailed */
+} life_kind_t;
+
+typedef struct {
+    life_kind_t kind;
+    double mean;  /* Mean of an exponential */
+    double alpha; /* Exponent of a Pareto */
+    double min;   /* Shortest lifetime of a Pareto */
+} life_dist_t;
+
+/* Growth of a block by realloc */
+typedef struct {
+    bool linear;   /* geom:<factor> or linear:<bytes> */
+    double factor; /* New size of a geometric growth, per old byte */
+    size_t step;   /* Bytes added by a linear growth */
+} growth_t;
+
+/* Parameters of a workload */
+typedef struct {
+    uint64_t num_ops;
+    uint64_t seed;
+    size_dist_t sizes;
+    life_dist_t lives;
+    unsigned phases;
+    double realloc_frac;
+    growth_t growth;
+    unsigned threads;
+    double handoff_frac;
+    size_t max_live; /* Limit on live payload bytes */
+} params_t;
+
+/* A block id, live or free */
+typedef struct {
+    size_t size;     /* Payload of a live block */
+    uint64_t death;  /* Op at which it is freed */
+    size_t live_pos; /* Position in the live array... */
+    size_t heap_pos; /* ... and in the heap of deaths */
+    unsigned next;   /* Next free id of the same thread */
+} block_t;
+
+/* State of a generation */
+typedef struct {
+    const params_t *params;
+    FILE *out;          /* NULL while only counting */
+    uint64_t rng;       /* State of the random numbers */
+    uint64_t ops;       /* Ops emitted */
+    block_t *blocks;    /* By id */
+    unsigned num_ids;   /* Ids handed out so far */
+    size_t max_ids;     /* Room in blocks */
+    unsigned *free_ids; /* Head of the free ids of each thread */
+    unsigned *live;     /* Ids of the live blocks */
+    size_t num_live;
+    size_t max_live;    /* Room in live and heap */
+    unsigned *heap;     /* Live ids, in a min-heap by death */
+    size_t live_bytes;
+    size_t peak_bytes;
+    uint64_t allocs, reallocs, frees;
+} gen_t;
+
+/* No id; ids are below UINT32_MAX, which mdriver takes for free(NULL) */
+#define NO_ID UINT32_MAX
+
+/* Function prototypes */
+static void usage(void);
+static void unix_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2), noreturn));
+static void app_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2), noreturn));
+static double parse_num(const char *str, const char *what);
+static void parse_sizes(char *spec, size_dist_t *dist);
+static void parse_lives(char *spec, life_dist_t *dist);
+static void parse_growth(char *spec, growth_t *growth);
+static void read_samples(const char *filename, size_dist_t *dist);
+static uint64_t next_rand(gen_t *gen);
+static double uniform(gen_t *gen);
+static size_t draw_size(gen_t *gen, unsigned phase);
+static uint64_t draw_life(gen_t *gen);
+static void heap_swap(gen_t *gen, size_t i, size_t j);
+static void heap_up(gen_t *gen, size_t i);
+static void heap_down(gen_t *gen, size_t i);
+static void heap_remove(gen_t *gen, unsigned id);
+static unsigned new_id(gen_t *gen, unsigned thread);
+static void emit(gen_t *gen, char type, unsigned id, size_t size);
+static void do_alloc(gen_t *gen, unsigned thread, size_t size,
+                     uint64_t life);
+static void do_realloc(gen_t *gen, unsigned id, size_t size);
+static void do_free(gen_t *gen, unsigned id);
+static void generate(gen_t *gen, const params_t *params, FILE *out);
+static void free_gen(gen_t *gen);
+
+int main(int argc, char **argv) {
+    params_t params = {
+        .num_ops = 1000000,
+        .seed = 1,
+        .phases = 1,
+        .realloc_frac = 0.0,
+        .threads = 1,
+        .handoff_frac = 0.0,
+        .max_live = MAX_DENSE_HEAP / 2,
+    };
+    char default_sizes[] = "power:1.2:8:8192";
+    char default_lives[] = "exp:1000";
+    char default_growth[] = "geom:1.5";
+    unsigned weight = 1;
+    int c;
+
+    parse_sizes(default_sizes, &params.sizes);
+    parse_lives(default_lives, &params.lives);
+    parse_growth(default_growth, &params.growth);
+
+    while ((c = getopt(argc, argv, "hn:s:S:L:p:r:g:t:H:m:w:")) != EOF) {
+        switch (c) {
+        case 'n':
+            params.num_ops = (uint64_t)parse_num(optarg, "-n");
+            if (params.num_ops == 0 || params.num_ops > UINT32_MAX)
+                app_error("-n must be in [1, %" PRIu32 "]", UINT32_MAX);
+            break;
+        case 's':
+            params.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'S':
+            parse_sizes(optarg, &params.sizes);
+            break;
+        case 'L':
+            parse_lives(optarg, &params.lives);
+            break;
+        case 'p':
+            params.phases = (unsigned)parse_num(optarg, "-p");
+            if (params.phases == 0)
+                app_error("-p must be at least 1");
+            break;
+        case 'r':
+            params.realloc_frac = parse_num(optarg, "-r");
+            if (params.realloc_frac >= 1.0)
+                app_error("-r must be below 1");
+            break;
+        case 'g':
+            parse_growth(optarg, &params.growth);
+            break;
+        case 't':
+            params.threads = (unsigned)parse_num(optarg, "-t");
+            if (params.threads == 0 || params.threads > 1024)
+                app_error("-t must be in [1, 1024]");
+            break;
+        case 'H':
+            params.handoff_frac = parse_num(optarg, "-H");
+            if (params.handoff_frac > 1.0)
+                app_error("-H must be at most 1");
+            break;
+        case 'm':
+            params.max_live = (size_t)parse_num(optarg, "-m");
+            if (params.max_live < MAX_SIZE)
+                app_error("-m must be at least %zu", MAX_SIZE);
+            break;
+        case 'w':
+            weight = (unsigned)atoi(optarg);
+            if (weight > 3)
+                app_error("Weight must be in {0, 1, 2, 3}");
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(c == 'h' ? 0 : 1);
+        }
+    }
+    if (argc - optind > 1) {
+        usage();
+        exit(1);
+    }
+
+    /* Count the ids, ops and peak bytes for the header */
+    gen_t gen;
+    generate(&gen, &params, NULL);
+    unsigned num_ids = gen.num_ids;
+    uint64_t num_ops = gen.ops;
+    size_t peak_bytes = gen.peak_bytes;
+    free_gen(&gen);
+
+    FILE *out = stdout;
+    if (optind < argc && (out = fopen(argv[optind], "w")) == NULL)
+        unix_error("Could not open %s", argv[optind]);
+    if (setvbuf(out, NULL, _IOFBF, OUT_BUF) != 0)
+        unix_error("setvbuf failed in main");
+    fprintf(out, "%u\n%u\n%" PRIu64 "\n%zu\n", weight, num_ids, num_ops,
+            peak_bytes);
+    generate(&gen, &params, out);
+    if (fclose(out) != 0)
+        unix_error("Could not write the trace");
+
+    fprintf(stderr,
+            "%" PRIu64 " ops on %u ids: %" PRIu64 " allocs, %" PRIu64
+            " reallocs, %" PRIu64 " frees, peak %zu bytes\n",
+            gen.ops, gen.num_ids, gen.allocs, gen.reallocs, gen.frees,
+            gen.peak_bytes);
+    free_gen(&gen);
+    free(params.sizes.samples);
+    return 0;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: mmtracegen [-h] [-n <ops>] [-s <seed>] "
+                    "[-S <sizes>] [-L <lifetimes>]\n"
+                    "                  [-p <phases>] [-r <frac>] "
+                    "[-g <growth>] [-t <threads>]\n"
+                    "                  [-H <frac>] [-m <bytes>] "
+                    "[-w <weight>] [<trace>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-n <ops>   Number of ops (default 1000000).\n");
+    fprintf(stderr, "\t-s <seed>  Seed of the random numbers (default 1).\n");
+    fprintf(stderr, "\t-S <sizes> Size distribution: power:<alpha>:<min>:"
+                    "<max>,\n"
+                    "\t           bimodal:<small>:<large>:<p>, "
+                    "uniform:<min>:<max>\n"
+                    "\t           or trace:<file> (default "
+                    "power:1.2:8:8192).\n");
+    fprintf(stderr, "\t-L <lives> Lifetime distribution in ops: exp:<mean> "
+                    "or\n"
+                    "\t           pareto:<alpha>:<min> (default exp:1000).\n");
+    fprintf(stderr, "\t-p <n>     Number of phases (default 1).\n");
+    fprintf(stderr, "\t-r <frac>  Fraction of the other ops that grow a "
+                    "block (default 0).\n");
+    fprintf(stderr, "\t-g <grow>  Growth by realloc: geom:<factor> or "
+                    "linear:<bytes>\n"
+                    "\t           (default geom:1.5).\n");
+    fprintf(stderr, "\t-t <n>     Number of logical threads (default 1).\n");
+    fprintf(stderr, "\t-H <frac>  Fraction of the blocks handed to a "
+                    "consumer (default 0).\n");
+    fprintf(stderr, "\t-m <bytes> Limit on live payload (default %d).\n",
+            MAX_DENSE_HEAP / 2);
+    fprintf(stderr, "\t-w <w>     Weight of the trace (default 1).\n");
+    fprintf(stderr, "Writes the trace to <trace>, or standard output.\n");
+}
+
+/*
+ * unix_error - Report a Unix-style error and exit
+ */
+static void unix_error(const char *fmt, ...) {
+    va_list ap;
+    int err = errno;
+
+    fprintf(stderr, "mmtracegen: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, ": %s\n", strerror(err));
+    exit(1);
+}
+
+/*
+ * app_error - Report an error and exit
+ */
+static void app_error(const char *fmt, ...) {
+    va_list ap;
+
+    fprintf(stderr, "mmtracegen: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/*
+ * parse_num - Read a non-negative number, such as 1e8
+ */
+static double parse_num(const char *str, const char *what) {
+    char *end;
+    double x;
+
+    if (str == NULL)
+        app_error("%s: missing number", what);
+    x = strtod(str, &end);
+    if (end == str || *end != '\0' || !(x >= 0) || isinf(x))
+        app_error("%s: bad number %s", what, str);
+    return x;
+}
+
+/*
+ * parse_sizes - Read a size distribution
+ */
+static void parse_sizes(char *spec, size_dist_t *dist) {
+    char *save = NULL;
+    char *kind = strtok_r(spec, ":", &save);
+
+    free(dist->samples);
+    memset(dist, 0, sizeof(*dist));
+    if (kind != NULL && strcmp(kind, "power") == 0) {
+        dist->kind = SIZE_POWER;
+        dist->alpha = parse_num(strtok_r(NULL, ":", &save), "power alpha");
+        dist->lo = (size_t)parse_num(strtok_r(NULL, ":", &save), "power min");
+        dist->hi = (size_t)parse_num(strtok_r(NULL, ":", &save), "power max");
+        if (dist->alpha <= 0)
+            app_error("power: alpha must be positive");
+    } else if (kind != NULL && strcmp(kind, "bimodal") == 0) {
+        dist->kind = SIZE_BIMODAL;
+        dist->lo = (size_t)parse_num(strtok_r(NULL, ":", &save), "small");
+        dist->hi = (size_t)parse_num(strtok_r(NULL, ":", &save), "large");
+        dist->p = parse_num(strtok_r(NULL, ":", &save), "bimodal p");
+        if (dist->p > 1.0)
+            app_error("bimodal: p must be at most 1");
+    } else if (kind != NULL && strcmp(kind, "uniform") == 0) {
+        dist->kind = SIZE_UNIFORM;
+        dist->lo = (size_t)parse_num(strtok_r(NULL, ":", &save), "min");
+        dist->hi = (size_t)parse_num(strtok_r(NULL, ":", &save), "max");
+    } else if (kind != NULL && strcmp(kind, "trace") == 0) {
+        const char *filename = strtok_r(NULL, "", &save);
+        if (filename == NULL)
+            app_error("trace: missing file name");
+        dist->kind = SIZE_SAMPLED;
+        read_samples(filename, dist);
+        return;
+    } else {
+        app_error("Unknown size distribution %s", kind ? kind : "");
+    }
+    if (dist->lo == 0 || dist->lo > dist->hi || dist->hi > MAX_SIZE)
+        app_error("Sizes must be in [1, %zu] with min <= max", MAX_SIZE);
+}
+
+/*
+ * parse_lives - Read a lifetime distribution
+ */
+static void parse_lives(char *spec, life_dist_t *dist) {
+    char *save = NULL;
+    char *kind = strtok_r(spec, ":", &save);
+
+    memset(dist, 0, sizeof(*dist));
+    if (kind != NULL && strcmp(kind, "exp") == 0) {
+        dist->kind = LIFE_EXP;
+        dist->mean = parse_num(strtok_r(NULL, ":", &save), "exp mean");
+        if (dist->mean < 1)
+            app_error("exp: mean must be at least 1");
+    } else if (kind != NULL && strcmp(kind, "pareto") == 0) {
+        dist->kind = LIFE_PARETO;
+        dist->alpha = parse_num(strtok_r(NULL, ":", &save), "pareto alpha");
+        dist->min = parse_num(strtok_r(NULL, ":", &save), "pareto min");
+        if (dist->alpha <= 0 || dist->min < 1)
+            app_error("pareto: alpha must be positive and min at least 1");
+        /* The mean, for the queue of a handoff; infinite below 1 */
+        dist->mean = dist->alpha > 1 ? dist->alpha * dist->min /
+                                           (dist->alpha - 1)
+                                     : 100 * dist->min;
+    } else {
+        app_error("Unknown lifetime distribution %s", kind ? kind : "");
+    }
+}
+
+/*
+ * parse_growth - Read the growth of a block by realloc
+ */
+static void parse_growth(char *spec, growth_t *growth) {
+    char *save = NULL;
+    char *kind = strtok_r(spec, ":", &save);
+
+    memset(growth, 0, sizeof(*growth));
+    if (kind != NULL && strcmp(kind, "geom") == 0) {
+        growth->factor = parse_num(strtok_r(NULL, ":", &save), "factor");
+        if (growth->factor <= 1.0)
+            app_error("geom: factor must be above 1");
+    } else if (kind != NULL && strcmp(kind, "linear") == 0) {
+        growth->linear = true;
+        growth->step = (size_t)parse_num(strtok_r(NULL, ":", &save), "step");
+        if (growth->step == 0)
+            app_error("linear: step must be at least 1");
+    } else {
+        app_error("Unknown growth %s", kind ? kind : "");
+    }
+}
+
+/*
+ * read_samples - Collect the sizes requested by the allocations and
+ *     reallocs of a trace in the .rep format
+ */
+static void read_samples(const char *filename, size_dist_t *dist) {
+    unsigned weight, num_ids, num_ops;
+    size_t data_bytes, size, align;
+    unsigned index;
+    char type[2];
+    FILE *fp;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+        unix_error("Could not open %s", filename);
+    if (fscanf(fp, "%u %u %u %zu", &weight, &num_ids, &num_ops,
+               &data_bytes) != 4)
+        app_error("%s is not a trace in the .rep format", filename);
+    if ((dist->samples = calloc(num_ops, sizeof(size_t))) == NULL)
+        unix_error("calloc failed in read_samples");
+
+    while (dist->num_samples < num_ops && fscanf(fp, "%1s", type) == 1) {
+        int n;
+        switch (type[0]) {
+        case 'a':
+        case 'r':
+            n = fscanf(fp, "%u %zu", &index, &size);
+            break;
+        case 'A':
+            n = fscanf(fp, "%u %zu %zu", &index, &align, &size) - 1;
+            break;
+        case 'f':
+            if (fscanf(fp, "%u", &index) != 1)
+                app_error("%s: malformed request", filename);
+            continue;
+        default:
+            app_error("%s: bogus type character (%c)", filename, type[0]);
+        }
+        if (n != 2)
+            app_error("%s: malformed request", filename);
+        if (size > 0 && size <= MAX_SIZE)
+            dist->samples[dist->num_samples++] = size;
+    }
+    fclose(fp);
+    if (dist->num_samples == 0)
+        app_error("%s holds no allocations", filename);
+}
+
+/*
+ * next_rand - Next random number, by splitmix64
+ */
+static uint64_t next_rand(gen_t *gen) {
+    uint64_t z = (gen->rng += 0x9E3779B97F4A7C15u);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9u;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBu;
+    return z ^ (z >> 31);
+}
+
+/*
+ * uniform - A random number in (0, 1]
+ */
+static double uniform(gen_t *gen) {
+    return (double)((next_rand(gen) >> 11) + 1) * 0x1.0p-53;
+}
+
+/*
+ * draw_size - Size of an allocation, scaled for its phase
+ */
+static size_t draw_size(gen_t *gen, unsigned phase) {
+    const size_dist_t *dist = &gen->params->sizes;
+    double lo = (double)dist->lo, hi = (double)dist->hi;
+    double size;
+
+    switch (dist->kind) {
+    case SIZE_POWER: {
+        /* Inverse of the CDF of a power law bounded to [lo, hi] */
+        double a = dist->alpha;
+        double lo_a = pow(lo, -a), hi_a = pow(hi, -a);
+        size = pow(lo_a - uniform(gen) * (lo_a - hi_a), -1.0 / a);
+        break;
+    }
+    case SIZE_BIMODAL: {
+        /* Within a quarter of either mode */
+        double mode = uniform(gen) <= dist->p ? hi : lo;
+        size = mode * (0.75 + 0.5 * uniform(gen));
+        break;
+    }
+    case SIZE_UNIFORM:
+        size = lo + (hi - lo + 1) * (1.0 - uniform(gen));
+        break;
+    case SIZE_SAMPLED:
+    default:
+        size = (double)dist->samples[next_rand(gen) % dist->num_samples];
+        break;
+    }
+
+    size *= (double)(1u << (2 * (phase % 3)));
+    if (size < 1)
+        return 1;
+    return size > (double)MAX_SIZE ? MAX_SIZE : (size_t)size;
+}
+
+/*
+ * draw_life - Lifetime of an allocation, in ops
+ */
+static uint64_t draw_life(gen_t *gen) {
+    const life_dist_t *dist = &gen->params->lives;
+    double life;
+
+    if (dist->kind == LIFE_EXP)
+        life = -dist->mean * log(uniform(gen));
+    else
+        life = dist->min / pow(uniform(gen), 1.0 / dist->alpha);
+
+    /* Longer than the trace is forever */
+    if (life >= (double)gen->params->num_ops)
+        return gen->params->num_ops;
+    return life < 1 ? 1 : (uint64_t)life;
+}
+
+/*
+ * heap_swap - Swap two entries of the heap of deaths
+ */
+static void heap_swap(gen_t *gen, size_t i, size_t j) {
+    unsigned a = gen->heap[i], b = gen->heap[j];
+    gen->heap[i] = b;
+    gen->heap[j] = a;
+    gen->blocks[b].heap_pos = i;
+    gen->blocks[a].heap_pos = j;
+}
+
+/*
+ * heap_up - Move an entry up to its place
+ */
+static void heap_up(gen_t *gen, size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (gen->blocks[gen->heap[parent]].death <=
+            gen->blocks[gen->heap[i]].death)
+            break;
+        heap_swap(gen, i, parent);
+        i = parent;
+    }
+}
+
+/*
+ * heap_down - Move an entry down to its place
+ */
+static void heap_down(gen_t *gen, size_t i) {
+    for (;;) {
+        size_t least = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < gen->num_live && gen->blocks[gen->heap[l]].death <
+                                     gen->blocks[gen->heap[least]].death)
+            least = l;
+        if (r < gen->num_live && gen->blocks[gen->heap[r]].death <
+                                     gen->blocks[gen->heap[least]].death)
+            least = r;
+        if (least == i)
+            return;
+        heap_swap(gen, i, least);
+        i = least;
+    }
+}
+
+/*
+ * heap_remove - Take a live block out of the heap.  Called before it is
+ *     taken out of the live array, which has as many entries.
+ */
+static void heap_remove(gen_t *gen, unsigned id) {
+    size_t i = gen->blocks[id].heap_pos;
+    size_t last = gen->num_live - 1;
+
+    if (i != last) {
+        heap_swap(gen, i, last);
+        gen->num_live--;
+        heap_down(gen, i);
+        heap_up(gen, i);
+        gen->num_live++;
+    }
+}
+
+/*
+ * new_id - Return a free id of a thread, reusing freed ones first.  The
+ *     ids of thread t are t, t + threads, t + 2 * threads, ...
+ */
+static unsigned new_id(gen_t *gen, unsigned thread) {
+    unsigned threads = gen->params->threads;
+    unsigned id = gen->free_ids[thread];
+
+    if (id != NO_ID) {
+        gen->free_ids[thread] = gen->blocks[id].next;
+        return id;
+    }
+
+    /* The next fresh id of the thread */
+    id = gen->num_ids + (thread + threads - gen->num_ids % threads) % threads;
+    if (id >= NO_ID - threads)
+        app_error("Out of block ids");
+    if (id >= gen->max_ids) {
+        size_t max_ids = 2 * (size_t)id + 1024;
+        gen->blocks = realloc(gen->blocks, max_ids * sizeof(block_t));
+        if (gen->blocks == NULL)
+            unix_error("realloc failed in new_id");
+        gen->max_ids = max_ids;
+    }
+
+    /* Skipped ids of other threads go on their free lists */
+    for (unsigned skip = gen->num_ids; skip < id; skip++) {
+        unsigned t = skip % threads;
+        gen->blocks[skip].next = gen->free_ids[t];
+        gen->free_ids[t] = skip;
+    }
+    gen->num_ids = id + 1;
+    return id;
+}
+
+/*
+ * emit - Count an op, and print it unless only counting
+ */
+static void emit(gen_t *gen, char type, unsigned id, size_t size) {
+    gen->ops++;
+    if (gen->out == NULL)
+        return;
+    if (type == 'f')
+        fprintf(gen->out, "f %u\n", id);
+    else
+        fprintf(gen->out, "%c %u %zu\n", type, id, size);
+}
+
+/*
+ * do_alloc - Allocate a block for a thread, which is freed after life ops
+ */
+static void do_alloc(gen_t *gen, unsigned thread, size_t size,
+                     uint64_t life) {
+    unsigned id = new_id(gen, thread);
+    block_t *block = &gen->blocks[id];
+
+    if (gen->num_live == gen->max_live) {
+        gen->max_live = gen->max_live ? 2 * gen->max_live : 1024;
+        gen->live = realloc(gen->live, gen->max_live * sizeof(unsigned));
+        gen->heap = realloc(gen->heap, gen->max_live * sizeof(unsigned));
+        if (gen->live == NULL || gen->heap == NULL)
+            unix_error("realloc failed in do_alloc");
+    }
+    block->size = size;
+    block->death = gen->ops + life;
+    block->live_pos = gen->num_live;
+    block->heap_pos = gen->num_live;
+    gen->live[gen->num_live] = id;
+    gen->heap[gen->num_live] = id;
+    gen->num_live++;
+    heap_up(gen, block->heap_pos);
+
+    gen->live_bytes += size;
+    if (gen->live_bytes > gen->peak_bytes)
+        gen->peak_bytes = gen->live_bytes;
+    gen->allocs++;
+    emit(gen, 'a', id, size);
+}
+
+/*
+ * do_realloc - Resize a live block, which keeps its lifetime
+ */
+static void do_realloc(gen_t *gen, unsigned id, size_t size) {
+    block_t *block = &gen->blocks[id];
+
+    gen->live_bytes += size - block->size;
+    if (gen->live_bytes > gen->peak_bytes)
+        gen->peak_bytes = gen->live_bytes;
+    block->size = size;
+    gen->reallocs++;
+    emit(gen, 'r', id, size);
+}
+
+/*
+ * do_free - Free a live block and put its id on the free list of its
+ *     thread
+ */
+static void do_free(gen_t *gen, unsigned id) {
+    block_t *block = &gen->blocks[id];
+    unsigned thread = id % gen->params->threads;
+
+    heap_remove(gen, id);
+    size_t last = gen->num_live - 1;
+    unsigned moved = gen->live[last];
+    gen->live[block->live_pos] = moved;
+    gen->blocks[moved].live_pos = block->live_pos;
+    gen->num_live--;
+
+    gen->live_bytes -= block->size;
+    block->next = gen->free_ids[thread];
+    gen->free_ids[thread] = id;
+    gen->frees++;
+    emit(gen, 'f', id, 0);
+}
+
+/*
+ * generate - Run the workload, printing its ops to out, or only counting
+ *     them if out is NULL.  Blocks still live at the end are left
+ *     allocated.
+ */
+static void generate(gen_t *gen, const params_t *params, FILE *out) {
+    uint64_t n = params->num_ops;
+    uint64_t phase_len = (n + params->phases - 1) / params->phases;
+    unsigned phase = 0;
+    unsigned thread = 0;
+
+    memset(gen, 0, sizeof(*gen));
+    gen->params = params;
+    gen->out = out;
+    gen->rng = params->seed;
+    gen->free_ids = malloc(params->threads * sizeof(unsigned));
+    if (gen->free_ids == NULL)
+        unix_error("malloc failed in generate");
+    for (unsigned t = 0; t < params->threads; t++)
+        gen->free_ids[t] = NO_ID;
+
+    while (gen->ops < n) {
+        /* At a phase change, free half of the live blocks */
+        if (gen->ops >= (phase + 1) * phase_len) {
+            phase++;
+            for (size_t i = gen->num_live; i > 0 && gen->ops < n; i--) {
+                if (next_rand(gen) & 1)
+                    do_free(gen, gen->live[i - 1]);
+            }
+            continue;
+        }
+
+        /* Free the blocks whose time has come */
+        if (gen->num_live > 0 && gen->blocks[gen->heap[0]].death <= gen->ops) {
+            do_free(gen, gen->heap[0]);
+            continue;
+        }
+
+        /* Grow a live block */
+        if (gen->num_live > 0 && uniform(gen) <= params->realloc_frac) {
+            unsigned id = gen->live[next_rand(gen) % gen->num_live];
+            size_t old = gen->blocks[id].size;
+            size_t size = params->growth.linear
+                              ? old + params->growth.step
+                              : (size_t)((double)old * params->growth.factor) +
+                                    1;
+            if (size > MAX_SIZE)
+                size = MAX_SIZE;
+            if (gen->live_bytes + (size - old) <= params->max_live) {
+                do_realloc(gen, id, size);
+                continue;
+            }
+        }
+
+        /* Make room under the limit by freeing the blocks due first */
+        size_t size = draw_size(gen, phase);
+        if (gen->live_bytes + size > params->max_live) {
+            do_free(gen, gen->heap[0]);
+            continue;
+        }
+
+        /* A handed-off block is freed by its consumer after a fixed delay,
+           so in the order it was allocated */
+        uint64_t life;
+        if (params->threads > 1 && uniform(gen) <= params->handoff_frac)
+            life = (uint64_t)params->lives.mean;
+        else
+            life = draw_life(gen);
+        do_alloc(gen, thread, size, life);
+        thread = (thread + 1) % params->threads;
+    }
+}
+
+/*
+ * free_gen - Free the state of a generation
+ */
+static void free_gen(gen_t *gen) {
+    free(gen->blocks);
+    free(gen->free_ids);
+    free(gen->live);
+    free(gen->heap);
+}
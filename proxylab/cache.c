@@ -9,9 +9,24 @@
 #include "debug.h"
 #include "util.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Snapshot file identification, "PXYC" in little endian
+ */
+#define SNAPSHOT_MAGIC 0x43595850
+#define SNAPSHOT_VERSION 1
+
+/// The snapshot only contains keys, values must be refetched
+#define SNAPSHOT_KEYS_ONLY 0x1
 
 /**
  * Internal representation of map key-value pair as circular linked list
@@ -42,12 +57,38 @@ typedef struct {
     pthread_mutex_t cache_mutex;
 } _cache_t;
 
+/**
+ * Header at the beginning of a snapshot file
+ *
+ * Followed by count records, most recently used first
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t count;
+} snapshot_header_t;
+
+/**
+ * Record of a single entry in a snapshot file
+ *
+ * Followed by key_len bytes of key (without the NUL terminator), then
+ * val_len bytes of value (none if keys only)
+ */
+typedef struct {
+    uint32_t key_len;
+    uint32_t val_len;
+} snapshot_record_t;
+
 // prototypes
 
 static entry_t *find(_cache_t *cache, const char *key);
 static void remove_entry(_cache_t *cache, entry_t *e);
 static void evict_entry(_cache_t *cache, entry_t *e);
 static void insert_front(_cache_t *cache, entry_t *e);
+static void insert_back(_cache_t *cache, entry_t *e);
+static bool restore_entry(_cache_t *cache, char *key, void *val, size_t size);
+static bool read_exact(int fd, void *buf, size_t n);
 static void cache_mutex_lock(_cache_t *cache);
 static void cache_mutex_unlock(_cache_t *cache);
 static void free_entry(entry_t *e);
@@ -124,6 +165,202 @@ void cache_entry_release(cache_t *_cache, cache_entry_t *_e) {
     cache_mutex_unlock(cache);
 }
 
+bool cache_snapshot(cache_t *_cache, const char *path, bool keys_only) {
+    _cache_t *cache = (_cache_t *)_cache;
+
+    // pin all entries in recency order, so that the file can be written
+    // without holding the lock
+    cache_mutex_lock(cache);
+    size_t count = 0;
+    entry_t *curr = cache->head;
+    if (curr) {
+        do {
+            ++count;
+            curr = curr->next;
+        } while (curr != cache->head);
+    }
+    entry_t **entries = Calloc(count ? count : 1, sizeof(entry_t *));
+    curr = cache->head;
+    for (size_t i = 0; i < count; ++i) {
+        entries[i] = curr;
+        ++curr->ref;
+        curr = curr->next;
+    }
+    cache_mutex_unlock(cache);
+
+    // write to a temporary file first, so a crash never leaves a truncated
+    // snapshot behind
+    char tmp_path[MAXLINE];
+    bool ok = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) <
+              (int)sizeof(tmp_path);
+    int fd = -1;
+    if (ok) {
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        ok = fd >= 0;
+    }
+
+    snapshot_header_t header = {.magic = SNAPSHOT_MAGIC,
+                                .version = SNAPSHOT_VERSION,
+                                .flags = keys_only ? SNAPSHOT_KEYS_ONLY : 0,
+                                .count = (uint32_t)count};
+    // records are small, coalesce them into large writes
+    rio_writer_t writer;
+    rio_writeinitb(&writer, fd);
+    ok = ok && rio_writenb(&writer, &header, sizeof(header)) >= 0;
+
+    for (size_t i = 0; ok && i < count; ++i) {
+        entry_t *e = entries[i];
+        snapshot_record_t record = {.key_len = (uint32_t)strlen(e->key),
+                                    .val_len =
+                                        keys_only ? 0 : (uint32_t)e->size};
+        ok = rio_writenb(&writer, &record, sizeof(record)) >= 0 &&
+             rio_writenb(&writer, e->key, record.key_len) >= 0 &&
+             rio_writenb(&writer, e->val, record.val_len) >= 0;
+    }
+    ok = ok && rio_flushb(&writer) >= 0;
+
+    if (fd >= 0 && close(fd) < 0) {
+        ok = false;
+    }
+    if (ok && rename(tmp_path, path) < 0) {
+        ok = false;
+    }
+    if (!ok) {
+        sio_eprintf("Failed to write cache snapshot to %s\n", path);
+        if (fd >= 0) {
+            unlink(tmp_path);
+        }
+    } else {
+        dbg_printf("Saved %zu cache entries to %s\n", count, path);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        cache_entry_release(_cache, (cache_entry_t *)entries[i]);
+    }
+    Free(entries);
+    return ok;
+}
+
+bool cache_restore(cache_t *_cache, const char *path, cache_warm_fn warm) {
+    _cache_t *cache = (_cache_t *)_cache;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    snapshot_header_t header;
+    if (!read_exact(fd, &header, sizeof(header)) ||
+        header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+        header.count > MAX_CACHE_SIZE) { // every entry holds at least 1 byte
+        sio_eprintf("Invalid cache snapshot: %s\n", path);
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+
+    bool keys_only = header.flags & SNAPSHOT_KEYS_ONLY;
+    char **keys = keys_only ? Calloc(header.count + 1, sizeof(char *)) : NULL;
+    uint32_t n = 0; // # of records read
+    bool ok = true;
+    for (; n < header.count; ++n) {
+        snapshot_record_t record;
+        if (!read_exact(fd, &record, sizeof(record)) ||
+            record.key_len >= MAXLINE || record.val_len > MAX_OBJECT_SIZE) {
+            ok = false;
+            break;
+        }
+
+        char *key = Malloc(record.key_len + 1);
+        void *val = Malloc(record.val_len ? record.val_len : 1);
+        if (!read_exact(fd, key, record.key_len) ||
+            !read_exact(fd, val, record.val_len)) {
+            Free(key);
+            Free(val);
+            ok = false;
+            break;
+        }
+        key[record.key_len] = '\0';
+
+        if (keys_only) {
+            Free(val);
+            keys[n] = key;
+        } else if (!restore_entry(cache, key, val, record.val_len)) {
+            // the remaining entries are less recent, so they would not fit
+            // either
+            break;
+        }
+    }
+    close(fd);
+
+    if (!ok) {
+        sio_eprintf("Truncated cache snapshot: %s\n", path);
+    }
+
+    // refetch keys-only entries from the least recent one, so the most
+    // recent one ends up at the front
+    if (keys_only) {
+        for (uint32_t i = n; i > 0; --i) {
+            if (warm) {
+                warm(keys[i - 1]);
+            }
+            Free(keys[i - 1]);
+        }
+        Free(keys);
+    }
+
+    dbg_printf("Restored %u cache entries from %s\n", n, path);
+    if (!ok) {
+        errno = EINVAL;
+    }
+    return ok;
+}
+
+/**
+ * Append a restored entry to the back of the cache
+ *
+ * Takes ownership of key and val
+ *
+ * @return false if the entry does not fit in the cache (nothing is evicted)
+ */
+bool restore_entry(_cache_t *cache, char *key, void *val, size_t size) {
+    cache_mutex_lock(cache);
+
+    if (cache->size + size > MAX_CACHE_SIZE) {
+        cache_mutex_unlock(cache);
+        Free(key);
+        Free(val);
+        return false;
+    }
+
+    // an entry fetched since startup is more recent than the snapshot
+    if (find(cache, key)) {
+        cache_mutex_unlock(cache);
+        Free(key);
+        Free(val);
+        return true;
+    }
+
+    entry_t *e = Calloc(1, sizeof(entry_t));
+    e->key = key;
+    e->val = val;
+    e->size = size;
+    e->ref = 1;
+    insert_back(cache, e);
+
+    cache_mutex_unlock(cache);
+    return true;
+}
+
+/**
+ * Read exactly n bytes from a file
+ * @return false on error or early EOF
+ */
+bool read_exact(int fd, void *buf, size_t n) {
+    return rio_readn(fd, buf, n) == (ssize_t)n;
+}
+
 /**
  * Find entry with key
  * @param cache Cache returned by cache_create
@@ -177,6 +414,19 @@ void insert_front(_cache_t *cache, entry_t *e) {
     cache->size += e->size;
 }
 
+/**
+ * Insert entry to the back of the linked list
+ *
+ * Update the total cache size
+ *
+ * Not thread-safe
+ */
+void insert_back(_cache_t *cache, entry_t *e) {
+    insert_front(cache, e);
+    // the list is circular, so the new front becomes the back
+    cache->head = e->next;
+}
+
 /**
  * Remove entry from the linked list
  *
@@ -71,4 +71,39 @@ cache_entry_t *cache_get(cache_t *cache, const char *key);
  */
 void cache_entry_release(cache_t *cache, cache_entry_t *e);
 
+/**
+ * Callback used by cache_restore to refetch an entry whose value was not
+ * stored in the snapshot
+ * @param key String key of the entry
+ */
+typedef void (*cache_warm_fn)(const char *key);
+
+/**
+ * Write all cache entries to a binary snapshot file
+ *
+ * Entries are stored in recency order (most recent first). The file is
+ * written to a temporary path and renamed, so an existing snapshot is only
+ * replaced by a complete one.
+ *
+ * @param cache Cache returned by cache_create
+ * @param path Path of the snapshot file
+ * @param keys_only Only store the keys, values are refetched on restore
+ * @return false if an error occurred
+ */
+bool cache_snapshot(cache_t *cache, const char *path, bool keys_only);
+
+/**
+ * Load the entries of a snapshot written by cache_snapshot
+ *
+ * Restored entries keep their relative recency, and values read from the
+ * snapshot never evict entries already in the cache.
+ *
+ * @param cache Cache returned by cache_create
+ * @param path Path of the snapshot file
+ * @param warm Called for each key of a keys-only snapshot, least recent
+ *             first; may be NULL to skip those entries
+ * @return false if an error occurred, errno is ENOENT if there is no snapshot
+ */
+bool cache_restore(cache_t *cache, const char *path, cache_warm_fn warm);
+
 #endif // CACHE_H
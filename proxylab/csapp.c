@@ -18,6 +18,7 @@
 #include <string.h>     /* memset() */
 #include <sys/socket.h> /* struct sockaddr */
 #include <sys/types.h>  /* struct sockaddr */
+#include <sys/uio.h>    /* readv() */
 #include <unistd.h>     /* STDIN_FILENO */
 
 /************************************
@@ -483,7 +484,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
     size_t cnt;
 
     while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
-        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_bufbase, rp->rio_bufsize);
         if (rp->rio_cnt < 0) {
             if (errno != EINTR) {
                 return -1; /* errno set by read() */
@@ -493,7 +494,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
         } else if (rp->rio_cnt == 0) {
             return 0; /* EOF */
         } else {
-            rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+            rp->rio_bufptr = rp->rio_bufbase; /* Reset buffer ptr */
         }
     }
 
@@ -512,9 +513,60 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
 void rio_readinitb(rio_t *rp, int fd) {
+    rio_readinitb_buf(rp, fd, NULL, 0);
+}
+
+/*
+ * rio_readinitb_buf - Associate a descriptor with a caller-supplied read
+ *    buffer of size bytes, or with the internal buffer if buf is NULL
+ */
+void rio_readinitb_buf(rio_t *rp, int fd, void *buf, size_t size) {
     rp->rio_fd = fd;
     rp->rio_cnt = 0;
-    rp->rio_bufptr = rp->rio_buf;
+    if (buf == NULL || size == 0) {
+        buf = rp->rio_buf;
+        size = sizeof(rp->rio_buf);
+    }
+    rp->rio_bufbase = buf;
+    rp->rio_bufsize = size;
+    rp->rio_bufptr = rp->rio_bufbase;
+}
+
+/*
+ * rio_readvb - Read up to n bytes (buffered), returning as soon as some
+ *    bytes are available like read(). Buffered bytes are returned first.
+ *    Otherwise a single readv() reads directly into the user buffer, and
+ *    refills the internal buffer with any bytes beyond n.
+ */
+ssize_t rio_readvb(rio_t *rp, void *usrbuf, size_t n) {
+    ssize_t nread;
+    struct iovec iov[2];
+
+    if (n == 0) {
+        return 0;
+    }
+    if (rp->rio_cnt > 0) {
+        return rio_read(rp, usrbuf, n);
+    }
+
+    iov[0].iov_base = usrbuf;
+    iov[0].iov_len = n;
+    iov[1].iov_base = rp->rio_bufbase;
+    iov[1].iov_len = rp->rio_bufsize;
+    while ((nread = readv(rp->rio_fd, iov, 2)) < 0) {
+        if (errno != EINTR) {
+            return -1; /* errno set by readv() */
+        }
+
+        /* Interrupted by sig handler return, call readv() again */
+    }
+
+    if ((size_t)nread > n) { /* Keep the rest for the next read */
+        rp->rio_bufptr = rp->rio_bufbase;
+        rp->rio_cnt = nread - (ssize_t)n;
+        nread = (ssize_t)n;
+    }
+    return nread; /* Return >= 0 */
 }
 
 /*
@@ -526,7 +578,7 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
     char *bufp = usrbuf;
 
     while (nleft > 0) {
-        if ((nread = rio_read(rp, bufp, nleft)) < 0) {
+        if ((nread = rio_readvb(rp, bufp, nleft)) < 0) {
             return -1; /* errno set by read() */
         } else if (nread == 0) {
             break; /* EOF */
@@ -566,6 +618,102 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
     return (ssize_t)(n - 1);
 }
 
+/*
+ * rio_writev - Robustly write all bytes of an iovec array (unbuffered).
+ *    The array is modified.
+ */
+static ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    ssize_t nwritten;
+
+    while (iovcnt > 0) {
+        if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+            if (errno != EINTR) {
+                return -1; /* errno set by writev() */
+            }
+
+            /* Interrupted by sig handler return, call writev() again */
+            nwritten = 0;
+        }
+        total += (size_t)nwritten;
+
+        /* Skip the buffers that were written completely */
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= (size_t)nwritten;
+        }
+    }
+    return (ssize_t)total;
+}
+
+/*
+ * rio_writeinitb - Associate a descriptor with a write buffer and reset
+ *    buffer
+ */
+void rio_writeinitb(rio_writer_t *wp, int fd) {
+    rio_writeinitb_buf(wp, fd, NULL, 0);
+}
+
+/*
+ * rio_writeinitb_buf - Associate a descriptor with a caller-supplied write
+ *    buffer of size bytes, or with the internal buffer if buf is NULL
+ */
+void rio_writeinitb_buf(rio_writer_t *wp, int fd, void *buf, size_t size) {
+    wp->rio_fd = fd;
+    wp->rio_cnt = 0;
+    if (buf == NULL || size == 0) {
+        buf = wp->rio_wbuf;
+        size = sizeof(wp->rio_wbuf);
+    }
+    wp->rio_bufbase = buf;
+    wp->rio_bufsize = size;
+}
+
+/*
+ * rio_writenb - Robustly write n bytes (buffered). Small writes are
+ *    coalesced in the internal buffer until it is full or rio_flushb is
+ *    called. A write that does not fit is sent together with the buffered
+ *    bytes in a single writev().
+ */
+ssize_t rio_writenb(rio_writer_t *wp, const void *usrbuf, size_t n) {
+    struct iovec iov[2];
+
+    if (n <= wp->rio_bufsize - wp->rio_cnt) {
+        memcpy(wp->rio_bufbase + wp->rio_cnt, usrbuf, n);
+        wp->rio_cnt += n;
+        return (ssize_t)n;
+    }
+
+    iov[0].iov_base = wp->rio_bufbase;
+    iov[0].iov_len = wp->rio_cnt;
+    iov[1].iov_base = (void *)usrbuf;
+    iov[1].iov_len = n;
+    if (rio_writev(wp->rio_fd, iov, 2) < 0) {
+        return -1; /* errno set by writev() */
+    }
+    wp->rio_cnt = 0;
+    return (ssize_t)n;
+}
+
+/*
+ * rio_flushb - Write all buffered bytes. Returns the number of bytes
+ *    written, or -1 on error.
+ */
+ssize_t rio_flushb(rio_writer_t *wp) {
+    ssize_t n = (ssize_t)wp->rio_cnt;
+
+    if (n > 0 && rio_writen(wp->rio_fd, wp->rio_bufbase, wp->rio_cnt) < 0) {
+        return -1; /* errno set by write() */
+    }
+    wp->rio_cnt = 0;
+    return n;
+}
+
 /********************************
  * Client/server helper functions
  ********************************/
@@ -6,7 +6,8 @@
  *
  * - The RIO (robust I/O) package, which allows performing reads and writes
  *   robustly by handling short reads and writes. It also provides the rio_t
- *   which allows for buffered reads.
+ *   which allows for buffered reads, and the rio_writer_t which coalesces
+ *   small writes until they are flushed.
  *
  * - The SIO (safe I/O) package, which implements an async-signal-safe variant
  *   of printf and related calls. (The Sio_puts and Sio_putl functions in the
@@ -52,9 +53,20 @@ typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     ssize_t rio_cnt;           /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
+    char *rio_bufbase;         /* Start of buf (rio_buf or caller's) */
+    size_t rio_bufsize;        /* Size of buf */
     char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
 } rio_t;
 
+/* Persistent state for buffered writes */
+typedef struct {
+    int rio_fd;                 /* Descriptor for this internal buf */
+    size_t rio_cnt;             /* Unwritten bytes in internal buf */
+    char *rio_bufbase;          /* Start of buf (rio_wbuf or caller's) */
+    size_t rio_bufsize;         /* Size of buf */
+    char rio_wbuf[RIO_BUFSIZE]; /* Internal buffer */
+} rio_writer_t;
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */
 extern char **environ; /* Defined by libc */
@@ -94,8 +106,14 @@ void Free(void *ptr);
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, const void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd);
+void rio_readinitb_buf(rio_t *rp, int fd, void *buf, size_t size);
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t rio_readvb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+void rio_writeinitb(rio_writer_t *wp, int fd);
+void rio_writeinitb_buf(rio_writer_t *wp, int fd, void *buf, size_t size);
+ssize_t rio_writenb(rio_writer_t *wp, const void *usrbuf, size_t n);
+ssize_t rio_flushb(rio_writer_t *wp);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(const char *hostname, const char *port);
@@ -15,6 +15,12 @@
  *
  * The proxy supports concurrent connections.
  *
+ * The cache can be persisted across restarts with -s: a snapshot is written
+ * on SIGTERM (and every -i seconds), and restored in the background at
+ * startup. With -k only the URIs are stored, and they are refetched from the
+ * servers on restore. The cache can also be pre-warmed from a list of URIs
+ * with -w.
+ *
  * @see cache.c
  * @see util.c
  */
@@ -38,6 +44,7 @@
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "cache.h"
 #include "debug.h"
@@ -77,6 +84,17 @@ typedef struct {
     const char *path;    /// The path to find a resource, e.g. index.html
 } http_info;
 
+/**
+ * Command line options
+ */
+typedef struct {
+    const char *port;          /// port to listen on
+    const char *snapshot_path; /// cache snapshot file, NULL to disable
+    unsigned int interval;     /// seconds between snapshots, 0 for SIGTERM only
+    bool keys_only;            /// snapshot only the URIs, not the responses
+    const char *warm_list;     /// file listing URIs to pre-warm, or NULL
+} proxy_options;
+
 /**
  * String to use for the User-Agent header.
  * @note Don't forget to terminate with \r\n
@@ -94,10 +112,16 @@ static bool parse_http_request(int fd, parser_t *p, http_info *info);
 static bool construct_new_request(parser_t *p, http_info info, char *out);
 static bool forward_http_response(int host_fd, int client_fd,
                                   const char *cache_key);
+static bool parse_options(int argc, char **argv, proxy_options *opts);
+static void *snapshot_worker(void *vargp);
+static void *warmup_worker(void *vargp);
+static void warm_cache_entry(const char *uri);
+static void warm_cache_from_list(const char *path);
 
 // global variables
 
 cache_t *g_cache = NULL;
+proxy_options g_options;
 
 /**
  * - Initialize
@@ -108,17 +132,31 @@ cache_t *g_cache = NULL;
  */
 int main(int argc, char **argv) {
     /* Check command line args */
-    if (argc != 2) {
-        sio_eprintf("usage: %s <port>\n", argv[0]);
+    if (!parse_options(argc, argv, &g_options)) {
+        sio_eprintf("usage: %s [-s <snapshot> [-i <seconds>] [-k]] "
+                    "[-w <uri list>] <port>\n",
+                    argv[0]);
         exit(1);
     }
 
     // ignore SIGPIPE
     Signal(SIGPIPE, SIG_IGN);
 
-    int listenfd = open_listenfd(argv[1]);
+    // SIGTERM is handled synchronously by the snapshot thread, so it must be
+    // blocked before any other thread is created
+    if (g_options.snapshot_path) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGTERM);
+        if (pthread_sigmask(SIG_BLOCK, &mask, NULL)) {
+            sio_eprintf("pthread_sigmask failed\n");
+            exit(1);
+        }
+    }
+
+    int listenfd = open_listenfd(g_options.port);
     if (listenfd < 0) {
-        sio_eprintf("Failed to listen on port: %s\n", argv[1]);
+        sio_eprintf("Failed to listen on port: %s\n", g_options.port);
         exit(1);
     }
 
@@ -129,6 +167,18 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    // restore and warm the cache without delaying the first connections
+    pthread_t tid;
+    if (g_options.snapshot_path &&
+        pthread_create(&tid, NULL, snapshot_worker, NULL)) {
+        sio_eprintf("pthread_create failed\n");
+        exit(1);
+    }
+    if ((g_options.snapshot_path || g_options.warm_list) &&
+        pthread_create(&tid, NULL, warmup_worker, NULL)) {
+        sio_eprintf("pthread_create failed\n");
+    }
+
     // main loop
     while (1) {
         client_info *client = Malloc(sizeof(client_info));
@@ -194,7 +244,11 @@ static void *serve(void *vargp) {
         cache_entry_t *entry = cache_get(g_cache, info.uri);
         if (entry) {
             dbg_printf("Found cached HTTP response for %s\n", info.uri);
-            if (rio_writen(client.connfd, entry->val, entry->size) < 0) {
+            // the whole response is sent with a single write
+            rio_writer_t writer;
+            rio_writeinitb(&writer, client.connfd);
+            if (rio_writenb(&writer, entry->val, entry->size) < 0 ||
+                rio_flushb(&writer) < 0) {
                 sio_eprintf("Failed to send cached HTTP response to client\n");
             }
 
@@ -234,6 +288,201 @@ static void *serve(void *vargp) {
     return NULL;
 }
 
+/**
+ * Parse command line options
+ * @param argc Argument count
+ * @param argv Argument vector
+ * @param[out] opts Parsed options
+ * @return false if the arguments are invalid
+ */
+static bool parse_options(int argc, char **argv, proxy_options *opts) {
+    memset(opts, 0, sizeof(*opts));
+
+    int c;
+    while ((c = getopt(argc, argv, "s:i:kw:")) != -1) {
+        switch (c) {
+        case 's':
+            opts->snapshot_path = optarg;
+            break;
+        case 'i': {
+            char *end;
+            unsigned long interval = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || interval > UINT32_MAX) {
+                return false;
+            }
+            opts->interval = (unsigned int)interval;
+            break;
+        }
+        case 'k':
+            opts->keys_only = true;
+            break;
+        case 'w':
+            opts->warm_list = optarg;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    // -i and -k only make sense with a snapshot file
+    if (!opts->snapshot_path && (opts->interval || opts->keys_only)) {
+        return false;
+    }
+
+    if (optind != argc - 1) {
+        return false;
+    }
+    opts->port = argv[optind];
+    return true;
+}
+
+/**
+ * Save the cache periodically and on SIGTERM
+ *
+ * SIGTERM must be blocked in all threads, it is received with sigtimedwait
+ * so that the snapshot is not written from a signal handler. The proxy exits
+ * after the final snapshot.
+ */
+static void *snapshot_worker(void *vargp) {
+    if (pthread_detach(pthread_self())) {
+        sio_eprintf("pthread_detach failed\n");
+        return NULL;
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    struct timespec interval = {.tv_sec = g_options.interval, .tv_nsec = 0};
+
+    while (true) {
+        int sig = sigtimedwait(&mask, NULL,
+                               g_options.interval ? &interval : NULL);
+        if (sig < 0 && errno != EAGAIN) { // EINTR
+            continue;
+        }
+
+        cache_snapshot(g_cache, g_options.snapshot_path, g_options.keys_only);
+
+        if (sig == SIGTERM) {
+            exit(0);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Restore the cache snapshot, then pre-warm the cache from the URI list
+ */
+static void *warmup_worker(void *vargp) {
+    if (pthread_detach(pthread_self())) {
+        sio_eprintf("pthread_detach failed\n");
+        return NULL;
+    }
+
+    if (g_options.snapshot_path &&
+        !cache_restore(g_cache, g_options.snapshot_path, warm_cache_entry) &&
+        errno != ENOENT) {
+        sio_eprintf("Failed to restore cache from %s\n",
+                    g_options.snapshot_path);
+    }
+
+    if (g_options.warm_list) {
+        warm_cache_from_list(g_options.warm_list);
+    }
+
+    return NULL;
+}
+
+/**
+ * Fetch a URI from its server and cache the response
+ *
+ * Nothing is fetched if the URI is already cached
+ *
+ * @param uri Absolute http URI, also used as the cache key
+ */
+static void warm_cache_entry(const char *uri) {
+    cache_entry_t *entry = cache_get(g_cache, uri);
+    if (entry) {
+        cache_entry_release(g_cache, entry);
+        return;
+    }
+
+    char line[MAXLINE];
+    if (snprintf(line, sizeof(line), "GET %s HTTP/1.0\r\n", uri) >=
+        (int)sizeof(line)) {
+        sio_eprintf("URI too long to pre-warm: %s\n", uri);
+        return;
+    }
+
+    parser_t *p = parser_new();
+    http_info info;
+
+    do { // easier control flow
+        if (parser_parse_line(p, line) == ERROR ||
+            parser_retrieve(p, SCHEME, &info.scheme) ||
+            strcmp(info.scheme, "http") ||
+            parser_retrieve(p, URI, &info.uri) ||
+            parser_retrieve(p, HOST, &info.host) ||
+            parser_retrieve(p, PORT, &info.port) ||
+            parser_retrieve(p, PATH, &info.path)) {
+            sio_eprintf("Cannot pre-warm invalid URI: %s\n", uri);
+            break;
+        }
+
+        char new_req[MAXLINE];
+        if (!construct_new_request(p, info, new_req)) {
+            break;
+        }
+
+        int host_fd = open_clientfd(info.host, info.port);
+        if (host_fd < 0) {
+            sio_eprintf("Failed to connect to host: %s:%s\n", info.host,
+                        info.port);
+            break;
+        }
+        if (rio_writen(host_fd, new_req, strlen(new_req)) < 0 ||
+            !forward_http_response(host_fd, -1, info.uri)) {
+            sio_eprintf("Failed to pre-warm %s\n", uri);
+        }
+        close(host_fd);
+    } while (false);
+
+    parser_free(p);
+}
+
+/**
+ * Pre-warm the cache from a file with one URI per line
+ *
+ * Empty lines and lines starting with # are skipped. URIs are fetched in
+ * order, so the last one ends up as the most recently used entry.
+ *
+ * @param path Path of the URI list
+ */
+static void warm_cache_from_list(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        sio_eprintf("Failed to open URI list: %s\n", path);
+        return;
+    }
+
+    char buf[MAXLINE];
+    while (fgets(buf, sizeof(buf), f)) {
+        // trim trailing whitespace and newline
+        size_t len = strlen(buf);
+        while (len > 0 && isspace((unsigned char)buf[len - 1])) {
+            buf[--len] = '\0';
+        }
+
+        if (len == 0 || buf[0] == '#') {
+            continue;
+        }
+        warm_cache_entry(buf);
+    }
+
+    fclose(f);
+}
+
 /**
  * Parse HTTP request
  * @param fd Socket descriptor
@@ -391,21 +640,25 @@ static bool construct_new_request(parser_t *p, http_info info, char *out) {
  * The proxy will cache the response (if it's not too large) using a LRU cache.
  *
  * @param host_fd Server socket descriptor
- * @param client_fd Server socket descriptor
+ * @param client_fd Client socket descriptor, or -1 to only cache the response
  * @param cache_key String key (URI) used in the cache
  * @return false if an error occurred
  */
 static bool forward_http_response(int host_fd, int client_fd,
                                   const char *cache_key) {
-    // continuously read from host and write to client
-    // only takes 1 iteration if the content size is small
+    // continuously read from host and write to client as data arrives
+    // the response is accumulated in buf until it is too large to cache
     rio_t rio;
     rio_readinitb(&rio, host_fd);
+    rio_writer_t writer;
+    rio_writeinitb(&writer, client_fd);
     char buf[MAX_OBJECT_SIZE];
     size_t cache_size = 0;
+    bool cacheable = true;
     while (true) {
-        // read from host
-        ssize_t len = rio_readnb(&rio, buf, sizeof(buf));
+        // read from host, after the data kept for the cache
+        size_t offset = cache_size < sizeof(buf) ? cache_size : 0;
+        ssize_t len = rio_readvb(&rio, buf + offset, sizeof(buf) - offset);
         if (len < 0) {
             sio_eprintf("Failed to get HTTP response from host\n");
             return false;
@@ -413,17 +666,26 @@ static bool forward_http_response(int host_fd, int client_fd,
             break;
         }
 
-        // send received HTTP response to client
-        if (rio_writen(client_fd, buf, len) < 0) {
+        // send received HTTP response to client, small chunks are coalesced
+        if (client_fd >= 0 &&
+            rio_writenb(&writer, buf + offset, (size_t)len) < 0) {
             sio_eprintf("Failed to send HTTP response to client\n");
             return false;
         }
 
-        cache_size += len;
+        if (cache_size + (size_t)len > sizeof(buf)) {
+            cacheable = false;
+        }
+        cache_size += (size_t)len;
+    }
+
+    if (client_fd >= 0 && rio_flushb(&writer) < 0) {
+        sio_eprintf("Failed to send HTTP response to client\n");
+        return false;
     }
 
     // cache the response if not too large
-    if (cache_size <= MAX_OBJECT_SIZE && cache_size > 0) {
+    if (cacheable && cache_size > 0) {
         dbg_printf("Caching HTTP response (%s) of size %zu\n", cache_key,
                    cache_size);
         if (!cache_insert(g_cache, cache_key, buf, cache_size)) {
@@ -476,14 +738,14 @@ static void clienterror(int fd, const char *errnum, const char *shortmsg,
         return; // overflow
     }
 
-    // write the headers
-    if (rio_writen(fd, buf, buflen) < 0) {
+    // write the headers and the body in a single packet
+    rio_writer_t writer;
+    rio_writeinitb(&writer, fd);
+    if (rio_writenb(&writer, buf, buflen) < 0) {
         sio_eprintf("Error writing error response headers to client\n");
         return;
     }
-
-    // write the body
-    if (rio_writen(fd, body, bodylen) < 0) {
+    if (rio_writenb(&writer, body, bodylen) < 0 || rio_flushb(&writer) < 0) {
         sio_eprintf("Error writing error response body to client\n");
         return;
     }
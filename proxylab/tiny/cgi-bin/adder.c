@@ -1,24 +1,30 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *
+ * Run with -p, it is a pooled worker that serves requests from tiny over
+ * the framing protocol in cgi_pool.h instead of exiting after one request.
  */
 /* $begin adder */
 #include "csapp.h"
+#include "../cgi_pool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-int main(void) {
-    char *buf, *p;
+/*
+ * make_response - format the response for a query string "n1&n2" into out,
+ * which holds MAXBUF bytes. Returns the length of the response.
+ */
+static size_t make_response(const char *query, char *out) {
     char content[MAXLINE];
     int n1=0, n2=0;
 
     /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-        p = strchr(buf, '&');
+    if (query != NULL) {
+        const char *p = strchr(query, '&');
         if (p != NULL) {
-            *p = '\0';
-            n1 = atoi(buf);
+            n1 = atoi(query);
             n2 = atoi(p+1);
         }
     }
@@ -32,11 +38,69 @@ int main(void) {
         n1, n2, n1 + n2);
 
     /* Generate the HTTP response */
-    printf("Connection: close\r\n");
-    printf("Content-length: %zu\r\n", strlen(content));
-    printf("Content-type: text/html\r\n");
-    printf("\r\n");
-    printf("%s", content);
+    int len = snprintf(out, MAXBUF,
+        "Connection: close\r\n"
+        "Content-length: %zu\r\n"
+        "Content-type: text/html\r\n"
+        "\r\n"
+        "%s",
+        strlen(content), content);
+    return len < MAXBUF ? (size_t) len : MAXBUF - 1;
+}
+
+/*
+ * send_frame - write one frame to tiny. Returns -1 on error.
+ */
+static int send_frame(uint32_t type, const char *payload, size_t len) {
+    cgi_frame_header header = { .type = type, .len = (uint32_t) len };
+    if (rio_writen(CGI_POOL_FD, &header, sizeof(header)) < 0
+            || rio_writen(CGI_POOL_FD, (void *) payload, len) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * serve_pooled - answer request frames until tiny closes the socket
+ */
+static void serve_pooled(void) {
+    char query[CGI_FRAME_MAX + 1];
+    char out[MAXBUF];
+
+    while (1) {
+        cgi_frame_header header;
+        if (rio_readn(CGI_POOL_FD, &header, sizeof(header)) != sizeof(header)
+                || header.type != CGI_FRAME_REQUEST
+                || header.len > CGI_FRAME_MAX
+                || rio_readn(CGI_POOL_FD, query, header.len)
+                    != (ssize_t) header.len) {
+            return;     /* Closed by tiny, or protocol error */
+        }
+        query[header.len] = '\0';
+
+        size_t len = make_response(query, out);
+        for (size_t sent = 0; sent < len; sent += CGI_FRAME_MAX) {
+            size_t n = len - sent < CGI_FRAME_MAX ? len - sent : CGI_FRAME_MAX;
+            if (send_frame(CGI_FRAME_STDOUT, out + sent, n) < 0) {
+                return;
+            }
+        }
+        if (send_frame(CGI_FRAME_END, NULL, 0) < 0) {
+            return;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    char out[MAXBUF];
+
+    if (argc > 1 && strcmp(argv[1], CGI_POOL_FLAG) == 0) {
+        serve_pooled();
+        exit(0);
+    }
+
+    size_t len = make_response(getenv("QUERY_STRING"), out);
+    fwrite(out, 1, len, stdout);
     fflush(stdout);
 
     exit(0);
@@ -0,0 +1,37 @@
+/*
+ * cgi_pool.h - framing protocol between tiny and pooled CGI workers
+ *
+ * A pooled worker is started as "<program> -p" with a Unix stream socket
+ * as its standard input, and serves requests until the socket is closed.
+ * Every message is a cgi_frame_header followed by len bytes of payload:
+ *
+ *   tiny -> worker: one CGI_FRAME_REQUEST carrying the QUERY_STRING
+ *   worker -> tiny: any number of CGI_FRAME_STDOUT frames carrying the
+ *                   response (what the program would print to stdout),
+ *                   then an empty CGI_FRAME_END frame
+ */
+#ifndef CGI_POOL_H
+#define CGI_POOL_H
+
+#include <stdint.h>
+
+/* Command line flag that starts a CGI program in pooled mode */
+#define CGI_POOL_FLAG "-p"
+
+/* Descriptor of the socket connected to tiny, in a pooled worker */
+#define CGI_POOL_FD 0
+
+/* Frame types */
+#define CGI_FRAME_REQUEST 1
+#define CGI_FRAME_STDOUT 2
+#define CGI_FRAME_END 3
+
+/* Max payload of a single frame */
+#define CGI_FRAME_MAX 8192
+
+typedef struct {
+    uint32_t type;
+    uint32_t len;       // Payload length in bytes, at most CGI_FRAME_MAX
+} cgi_frame_header;
+
+#endif /* CGI_POOL_H */
@@ -0,0 +1,183 @@
+/*
+ * tiny-bench.c - A closed-loop HTTP/1.0 load generator for tiny.
+ *
+ * Each client thread repeatedly connects, sends "GET <uri>", and reads the
+ * response until the server closes the connection. Prints requests/sec.
+ *
+ * To compare CGI pooling with fork-per-request, start both servers and
+ * measure the pooled one against the forking one with -b:
+ *     ./tiny -t 8 8000 &
+ *     ./tiny -t 8 -c 8 8001 &
+ *     ./tiny-bench -c 8 -b 8000 localhost 8001 '/cgi-bin/adder?1&2'
+ */
+
+#include "csapp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Benchmark parameters, shared by all client threads. */
+typedef struct {
+    const char *host;
+    const char *port;
+    const char *uri;
+    long requests;              // Requests per client thread
+} bench_args;
+
+/* Result of one client thread. */
+typedef struct {
+    bench_args *args;
+    long ok;                    // Responses starting with HTTP/1.0 200
+    long failed;
+} client_result;
+
+/*
+ * do_request - send one request and read the whole response
+ * Returns true if the server answered 200 OK.
+ */
+static bool do_request(const bench_args *args) {
+    char buf[MAXBUF];
+    int fd = open_clientfd(args->host, args->port);
+    if (fd < 0) {
+        return false;
+    }
+
+    int len = snprintf(buf, sizeof(buf),
+            "GET %s HTTP/1.0\r\n" \
+            "Host: %s:%s\r\n\r\n", \
+            args->uri, args->host, args->port);
+    if (len >= (int) sizeof(buf) || rio_writen(fd, buf, len) < 0) {
+        close(fd);
+        return false;
+    }
+
+    /* Read until EOF, checking the status line */
+    bool ok = false;
+    bool first = true;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (first) {
+            ok = n >= 12 && strncmp(buf, "HTTP/1.0 200", 12) == 0;
+            first = false;
+        }
+    }
+    if (n < 0) {
+        ok = false;
+    }
+
+    close(fd);
+    return ok;
+}
+
+/*
+ * client - run the requests of one client thread
+ */
+static void *client(void *vargp) {
+    client_result *result = vargp;
+    for (long i = 0; i < result->args->requests; i++) {
+        if (do_request(result->args)) {
+            result->ok++;
+        } else {
+            result->failed++;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * run_bench - run nclients threads against args, and return requests/sec
+ */
+static double run_bench(bench_args *args, long nclients) {
+    pthread_t *tids = Malloc(nclients * sizeof(pthread_t));
+    client_result *results = Calloc(nclients, sizeof(client_result));
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < nclients; i++) {
+        results[i].args = args;
+        if (pthread_create(&tids[i], NULL, client, &results[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+
+    long ok = 0;
+    long failed = 0;
+    for (long i = 0; i < nclients; i++) {
+        pthread_join(tids[i], NULL);
+        ok += results[i].ok;
+        failed += results[i].failed;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec)
+        + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double rps = ok / secs;
+    printf("%s:%s%s: %ld ok, %ld failed in %.3f s, %.1f requests/sec\n",
+           args->host, args->port, args->uri, ok, failed, secs, rps);
+
+    Free(results);
+    Free(tids);
+    return rps;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-n <requests>] [-c <clients>] [-b <base port>] "
+            "<host> <port> <uri>\n" \
+            "  -n  requests per client (default 1000)\n" \
+            "  -c  concurrent clients (default 1)\n" \
+            "  -b  also measure <base port>, and print the speedup\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    long requests = 1000;
+    long nclients = 1;
+    const char *base_port = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:b:")) != -1) {
+        switch (opt) {
+        case 'n':
+            requests = atol(optarg);
+            break;
+        case 'c':
+            nclients = atol(optarg);
+            break;
+        case 'b':
+            base_port = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 3 || requests <= 0 || nclients <= 0) {
+        usage(argv[0]);
+    }
+
+    bench_args args = {
+        .host = argv[optind],
+        .port = argv[optind + 1],
+        .uri = argv[optind + 2],
+        .requests = requests,
+    };
+    double rps = run_bench(&args, nclients);
+
+    if (base_port != NULL) {
+        bench_args base = args;
+        base.port = base_port;
+        double base_rps = run_bench(&base, nclients);
+        if (base_rps > 0) {
+            printf("speedup: %.2fx\n", rps / base_rps);
+        }
+    }
+
+    return 0;
+}
@@ -1,12 +1,23 @@
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple HTTP/1.0 Web server that uses the GET method to
+ *     serve static and dynamic content.
+ *
+ * By default connections are served one at a time. With -t <threads>, a
+ * pool of worker threads serves connections from a bounded queue filled
+ * by the main thread. With -c <workers>, CGI programs run as pools of
+ * long-lived workers (see cgi_pool.h) instead of being forked for every
+ * request. Static files are served from an LRU cache holding
+ * pre-formatted response headers and either an open file descriptor (sent
+ * with sendfile) or, for small files, an in-memory copy (sent with writev).
  *
  * Updated 04/2017 - Stanley Zhang <szz@andrew.cmu.edu>
  * Fixed some style issues, stop using csapp functions where not appropriate
  */
 
+#define _GNU_SOURCE     /* accept4 */
+
 #include "csapp.h"
+#include "cgi_pool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,10 +25,15 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
@@ -26,6 +42,24 @@
 #define HOSTLEN 256
 #define SERVLEN 8
 
+/* Max number of accepted connections waiting for a worker thread */
+#define CONNQ_SIZE 64
+
+/* Number of hash buckets in the open file cache */
+#define FILE_CACHE_BUCKETS 256
+
+/* Max number of file descriptors held open by the file cache */
+#define FILE_CACHE_MAX_FDS 128
+
+/* Files up to this size are kept in memory instead of open */
+#define FILE_CACHE_SMALL_FILE (16 * 1024)
+
+/* Max total size of the in-memory file copies */
+#define FILE_CACHE_MAX_BYTES (16 * 1024 * 1024)
+
+/* Max number of distinct CGI programs with a worker pool */
+#define CGI_POOL_PROGRAMS 8
+
 /* Typedef for convenience */
 typedef struct sockaddr SA;
 
@@ -45,6 +79,76 @@ typedef enum {
     PARSE_DYNAMIC
 } parse_result;
 
+/* Bounded queue of accepted connections, shared with the worker threads. */
+typedef struct {
+    client_info buf[CONNQ_SIZE];
+    size_t head;                // Index of the oldest connection
+    size_t count;               // Number of queued connections
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} conn_queue;
+
+/*
+ * A static file with its pre-formatted response headers. Small files are
+ * copied into memory, larger ones are kept open. Entries are keyed by path
+ * and are stale once the size or mtime of the file changes.
+ */
+typedef struct file_entry {
+    char *path;
+    int fd;                     // -1 if the content is in data
+    char *data;                 // Content of a small file, or NULL
+    off_t size;
+    struct timespec mtime;
+    char filetype[32];          // Content type
+    char *header;               // Response headers, including the empty line
+    size_t header_len;
+    int ref;                    // The cache holds one reference while linked
+    struct file_entry *next;    // Next entry in the hash bucket
+    struct file_entry *lru_prev;    // More recently used entry
+    struct file_entry *lru_next;    // Less recently used entry
+} file_entry;
+
+/* Open file cache, with a hash table and a list in LRU order. */
+typedef struct {
+    file_entry *buckets[FILE_CACHE_BUCKETS];
+    file_entry *lru_head;       // Most recently used entry
+    file_entry *lru_tail;       // Least recently used entry
+    size_t nfds;                // Open descriptors held by linked entries
+    size_t nbytes;              // In-memory bytes held by linked entries
+    pthread_mutex_t mutex;
+} file_cache_t;
+
+/* A long-lived CGI process, see cgi_pool.h. */
+typedef struct {
+    pid_t pid;                  // 0 if the worker is not running
+    int fd;                     // Socket connected to the worker
+    bool busy;                  // Serving a request
+    unsigned served;            // Requests completed since it started
+} cgi_worker;
+
+/* The workers running one CGI program. */
+typedef struct {
+    char filename[MAXLINE];
+    cgi_worker *workers;        // cgi_pool_size workers
+    bool unpooled;              // The program does not implement -p
+} cgi_pool;
+
+static conn_queue connq = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
+
+static file_cache_t file_cache = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t cgi_pool_size = 0;    /* Workers per program, 0 to fork */
+static cgi_pool cgi_pools[CGI_POOL_PROGRAMS];
+static pthread_mutex_t cgi_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cgi_pool_idle = PTHREAD_COND_INITIALIZER;
+
 
 /*
  * parse_uri - parse URI into filename and CGI args
@@ -111,7 +215,7 @@ parse_result parse_uri(char *uri, char *filename, char *cgiargs) {
  *
  * filename - The file name. Must be a NUL-terminated string.
  * filetype - The buffer in which the file type will be storaged. Must be at
- * least MAXLINE bytes. Will be a NUL-terminated string.
+ * least 32 bytes. Will be a NUL-terminated string.
  */
 void get_filetype(char *filename, char *filetype) {
     if (strstr(filename, ".html")) {
@@ -129,62 +233,568 @@ void get_filetype(char *filename, char *filetype) {
 
 
 /*
- * serve_static - copy a file back to the client
+ * hash_path - hash a file name into a file cache bucket
+ */
+static size_t hash_path(const char *path) {
+    size_t hash = 5381;
+    for (const char *p = path; *p != '\0'; p++) {
+        hash = hash * 33 + (unsigned char) *p;
+    }
+    return hash % FILE_CACHE_BUCKETS;
+}
+
+/*
+ * file_entry_put - drop a reference to a file cache entry, freeing it once
+ * the last reference is gone. Must hold the file cache mutex.
  */
-void serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp;
-    char filetype[MAXLINE];
+static void file_entry_put(file_entry *entry) {
+    if (--entry->ref > 0) {
+        return;
+    }
+    if (entry->fd >= 0) {
+        close(entry->fd);
+    }
+    free(entry->data);
+    free(entry->header);
+    free(entry->path);
+    free(entry);
+}
+
+/*
+ * file_entry_open - open a file and format its response headers. Small
+ * files are read into memory and closed.
+ *
+ * Returns a new entry holding one reference, or NULL on error.
+ */
+static file_entry *file_entry_open(const char *filename,
+                                   const struct stat *sbuf) {
     char buf[MAXBUF];
     size_t buflen;
 
-    get_filetype(filename, filetype);
+    file_entry *entry = calloc(1, sizeof(*entry));
+    if (entry == NULL) {
+        fprintf(stderr, "Out of memory caching \"%s\"\n", filename);
+        return NULL;
+    }
+    entry->fd = -1;
+    entry->size = sbuf->st_size;
+    entry->mtime = sbuf->st_mtim;
+    entry->ref = 1;
+    get_filetype((char *) filename, entry->filetype);
 
-    /* Send response headers to client */
     buflen = snprintf(buf, MAXBUF,
             "HTTP/1.0 200 OK\r\n" \
             "Server: Tiny Web Server\r\n" \
             "Connection: close\r\n" \
-            "Content-Length: %d\r\n" \
+            "Content-Length: %lld\r\n" \
             "Content-Type: %s\r\n\r\n", \
-            filesize, filetype);
+            (long long) sbuf->st_size, entry->filetype);
     if (buflen >= MAXBUF) {
-        return; // Overflow!
+        free(entry);
+        return NULL; // Overflow!
+    }
+    entry->header_len = buflen;
+
+    if ((entry->path = strdup(filename)) == NULL
+            || (entry->header = strdup(buf)) == NULL
+            || (entry->size <= FILE_CACHE_SMALL_FILE
+                && (entry->data = malloc(entry->size + 1)) == NULL)) {
+        fprintf(stderr, "Out of memory caching \"%s\"\n", filename);
+        file_entry_put(entry);
+        return NULL;
+    }
+
+    entry->fd = open(filename, O_RDONLY | O_CLOEXEC, 0);
+    if (entry->fd < 0) {
+        perror(filename);
+        file_entry_put(entry);
+        return NULL;
     }
 
-    printf("Response headers:\n%s", buf);
+    if (entry->data != NULL) {
+        ssize_t n = rio_readn(entry->fd, entry->data, entry->size);
+        if (n != entry->size) {
+            fprintf(stderr, "Error reading static file \"%s\"\n", filename);
+            file_entry_put(entry);
+            return NULL;
+        }
+        close(entry->fd);
+        entry->fd = -1;
+    }
 
-    if (rio_writen(fd, buf, buflen) < 0) {
-        fprintf(stderr, "Error writing static response headers to client\n");
+    return entry;
+}
+
+/*
+ * file_cache_unlink - remove an entry from the cache and drop the cache's
+ * reference. Requests still using it keep it alive. Must hold the file
+ * cache mutex.
+ */
+static void file_cache_unlink(file_entry *entry) {
+    file_entry **link = &file_cache.buckets[hash_path(entry->path)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        file_cache.lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        file_cache.lru_tail = entry->lru_prev;
+    }
+
+    if (entry->fd >= 0) {
+        file_cache.nfds--;
+    } else {
+        file_cache.nbytes -= entry->size;
+    }
+    file_entry_put(entry);
+}
+
+/*
+ * file_cache_touch - move an entry to the front of the LRU list. Must hold
+ * the file cache mutex.
+ */
+static void file_cache_touch(file_entry *entry) {
+    if (file_cache.lru_head == entry) {
         return;
     }
 
+    entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        file_cache.lru_tail = entry->lru_prev;
+    }
 
-    /* Send response body to client */
-    srcfd = open(filename, O_RDONLY, 0);
-    if (srcfd < 0) {
-        perror(filename);
+    entry->lru_prev = NULL;
+    entry->lru_next = file_cache.lru_head;
+    file_cache.lru_head->lru_prev = entry;
+    file_cache.lru_head = entry;
+}
+
+/*
+ * file_cache_link - add a new entry to the cache. While over the fd budget
+ * the least recently used open files are evicted, and while over the memory
+ * budget the least recently used in-memory files. Must hold the file cache
+ * mutex.
+ */
+static void file_cache_link(file_entry *entry) {
+    size_t bucket = hash_path(entry->path);
+    entry->next = file_cache.buckets[bucket];
+    file_cache.buckets[bucket] = entry;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = file_cache.lru_head;
+    if (file_cache.lru_head != NULL) {
+        file_cache.lru_head->lru_prev = entry;
+    } else {
+        file_cache.lru_tail = entry;
+    }
+    file_cache.lru_head = entry;
+
+    if (entry->fd >= 0) {
+        file_cache.nfds++;
+    } else {
+        file_cache.nbytes += entry->size;
+    }
+    entry->ref++;
+
+    /* Only evict entries that hold what is over budget, fds or memory */
+    file_entry *victim = file_cache.lru_tail;
+    while (file_cache.nfds > FILE_CACHE_MAX_FDS
+            || file_cache.nbytes > FILE_CACHE_MAX_BYTES) {
+        file_entry *prev = victim->lru_prev;
+        if (victim->fd >= 0 ? file_cache.nfds > FILE_CACHE_MAX_FDS
+                            : file_cache.nbytes > FILE_CACHE_MAX_BYTES) {
+            file_cache_unlink(victim);
+        }
+        victim = prev;
+    }
+}
+
+/*
+ * file_cache_find - find a fresh entry for filename, and take a reference
+ * to it. A stale entry is removed from the cache. Must hold the file cache
+ * mutex.
+ */
+static file_entry *file_cache_find(const char *filename,
+                                   const struct stat *sbuf) {
+    file_entry *entry = file_cache.buckets[hash_path(filename)];
+    while (entry != NULL && strcmp(entry->path, filename) != 0) {
+        entry = entry->next;
+    }
+
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    if (entry->size != sbuf->st_size
+            || entry->mtime.tv_sec != sbuf->st_mtim.tv_sec
+            || entry->mtime.tv_nsec != sbuf->st_mtim.tv_nsec) {
+        file_cache_unlink(entry);
+        return NULL;
+    }
+
+    file_cache_touch(entry);
+    entry->ref++;
+    return entry;
+}
+
+/*
+ * file_cache_get - look up a file, (re)opening it if it is not cached or its
+ * size or mtime differ from sbuf
+ *
+ * Returns an entry that must be released with file_cache_release, or NULL
+ * on error.
+ */
+file_entry *file_cache_get(const char *filename, const struct stat *sbuf) {
+    pthread_mutex_lock(&file_cache.mutex);
+    file_entry *entry = file_cache_find(filename, sbuf);
+    pthread_mutex_unlock(&file_cache.mutex);
+    if (entry != NULL) {
+        return entry;
+    }
+
+    /* Open outside the lock; if another thread raced us, use its entry */
+    file_entry *opened = file_entry_open(filename, sbuf);
+    if (opened == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&file_cache.mutex);
+    entry = file_cache_find(filename, sbuf);
+    if (entry != NULL) {
+        file_entry_put(opened);
+    } else {
+        file_cache_link(opened);
+        entry = opened;
+    }
+    pthread_mutex_unlock(&file_cache.mutex);
+
+    return entry;
+}
+
+/*
+ * file_cache_release - release an entry returned by file_cache_get
+ */
+void file_cache_release(file_entry *entry) {
+    pthread_mutex_lock(&file_cache.mutex);
+    file_entry_put(entry);
+    pthread_mutex_unlock(&file_cache.mutex);
+}
+
+/*
+ * send_file - copy size bytes of srcfd to the client with sendfile
+ *
+ * The file offset of srcfd is not used, so the descriptor can be shared
+ * between threads. Returns -1 on error, or 0 otherwise.
+ */
+int send_file(int fd, int srcfd, off_t size) {
+    off_t offset = 0;
+
+    while (offset < size) {
+        ssize_t n = sendfile(fd, srcfd, &offset, (size_t) (size - offset));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;  /* File was truncated */
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * writev_all - write all buffers to fd, retrying after short writes
+ *
+ * Returns -1 on error, or 0 otherwise. The iovec array is modified.
+ */
+int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        /* Skip the buffers that were written completely */
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * serve_static - copy a file back to the client
+ */
+void serve_static(int fd, char *filename, const struct stat *sbuf) {
+    file_entry *entry = file_cache_get(filename, sbuf);
+    if (entry == NULL) {
+        return;
+    }
+
+    printf("Response headers:\n%s", entry->header);
+
+    /* Small files: send headers and body with a single writev */
+    if (entry->data != NULL) {
+        struct iovec iov[2] = {
+            { .iov_base = entry->header, .iov_len = entry->header_len },
+            { .iov_base = entry->data, .iov_len = entry->size },
+        };
+        if (writev_all(fd, iov, 2) < 0) {
+            fprintf(stderr, "Error writing static file \"%s\" to client\n",
+                    filename);
+        }
+        file_cache_release(entry);
         return;
     }
 
-    srcp = mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    if (srcp == MAP_FAILED) {
-        perror("mmap");
-        close(srcfd);
+    /* Send response headers to client */
+    if (rio_writen(fd, entry->header, entry->header_len) < 0) {
+        fprintf(stderr, "Error writing static response headers to client\n");
+        file_cache_release(entry);
         return;
     }
-    close(srcfd);
 
-    if (rio_writen(fd, srcp, filesize) < 0) {
+    /* Send response body to client */
+    if (send_file(fd, entry->fd, entry->size) < 0) {
         fprintf(stderr, "Error writing static file \"%s\" to client\n",
                 filename);
-        // Fall through to cleanup
     }
 
-    if (munmap(srcp, filesize) < 0) {
-        perror("munmap");
-        return;
+    file_cache_release(entry);
+}
+
+/*
+ * cgi_worker_spawn - start a pooled worker running filename
+ *
+ * Returns -1 on error, or 0 otherwise. Must hold cgi_pool_mutex.
+ */
+static int cgi_worker_spawn(cgi_worker *worker, const char *filename) {
+    int sv[2];
+    char *argv[] = { (char *) filename, CGI_POOL_FLAG, NULL };
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) { /* Child */
+        /*
+         * A program without pooled mode prints its response to stdout
+         * instead of framing it; that output must not reach tiny's stdout
+         */
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+        }
+        dup2(sv[1], CGI_POOL_FD);
+        execve(filename, argv, environ);
+        perror(filename);
+        _exit(1);
+    }
+    close(sv[1]);
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        return -1;
     }
+
+    worker->pid = pid;
+    worker->fd = sv[0];
+    worker->served = 0;
+    return 0;
+}
+
+/*
+ * cgi_worker_stop - close the socket of a worker and mark it as not
+ * running. The worker is restarted by the next request that picks it.
+ * Returns the pid to pass to cgi_worker_reap once cgi_pool_mutex is
+ * released. Must hold cgi_pool_mutex.
+ */
+static pid_t cgi_worker_stop(cgi_worker *worker) {
+    pid_t pid = worker->pid;
+    close(worker->fd);
+    worker->pid = 0;
+    worker->fd = -1;
+    return pid;
+}
+
+/*
+ * cgi_worker_reap - kill and reap a stopped worker, which may be hung.
+ * Must not hold cgi_pool_mutex.
+ */
+static void cgi_worker_reap(pid_t pid) {
+    kill(pid, SIGKILL);
+    if (waitpid(pid, NULL, 0) < 0) {
+        perror("waitpid");
+    }
+}
+
+/*
+ * cgi_pool_acquire - reserve an idle worker for filename, starting it if
+ * needed and waiting while all of them are busy
+ *
+ * Returns NULL if there is no pool for filename and no room for a new one,
+ * if the program does not implement pooled mode, or if the worker cannot be
+ * started.
+ */
+static cgi_worker *cgi_pool_acquire(const char *filename) {
+    pthread_mutex_lock(&cgi_pool_mutex);
+
+    cgi_pool *pool = NULL;
+    for (size_t i = 0; i < CGI_POOL_PROGRAMS; i++) {
+        if (cgi_pools[i].workers == NULL) {
+            /* First request for this program: create its pool */
+            cgi_pools[i].workers = calloc(cgi_pool_size, sizeof(cgi_worker));
+            if (cgi_pools[i].workers == NULL) {
+                break;
+            }
+            strcpy(cgi_pools[i].filename, filename);
+            pool = &cgi_pools[i];
+            break;
+        }
+        if (strcmp(cgi_pools[i].filename, filename) == 0) {
+            pool = &cgi_pools[i];
+            break;
+        }
+    }
+
+    if (pool != NULL && pool->unpooled) {
+        pool = NULL;
+    }
+
+    cgi_worker *worker = NULL;
+    while (pool != NULL && worker == NULL) {
+        for (size_t i = 0; i < cgi_pool_size; i++) {
+            if (!pool->workers[i].busy) {
+                worker = &pool->workers[i];
+                break;
+            }
+        }
+        if (worker == NULL) {
+            pthread_cond_wait(&cgi_pool_idle, &cgi_pool_mutex);
+        }
+    }
+
+    if (worker != NULL && worker->pid == 0
+            && cgi_worker_spawn(worker, filename) < 0) {
+        worker = NULL;
+    }
+    if (worker != NULL) {
+        worker->busy = true;
+    }
+
+    pthread_mutex_unlock(&cgi_pool_mutex);
+    return worker;
+}
+
+/*
+ * cgi_pool_release - return a worker to its pool, stopping it if it is no
+ * longer in sync with the framing protocol. A new worker that fails before
+ * framing any output is taken to run a program without pooled mode, and
+ * the program is no longer pooled.
+ */
+static void cgi_pool_release(cgi_worker *worker, const char *filename,
+                             bool failed, bool relayed) {
+    pid_t pid = 0;
+
+    pthread_mutex_lock(&cgi_pool_mutex);
+    if (failed) {
+        if (worker->served == 0 && !relayed) {
+            for (size_t i = 0; i < CGI_POOL_PROGRAMS; i++) {
+                if (cgi_pools[i].workers != NULL
+                        && strcmp(cgi_pools[i].filename, filename) == 0) {
+                    cgi_pools[i].unpooled = true;
+                }
+            }
+        }
+        pid = cgi_worker_stop(worker);
+    } else {
+        worker->served++;
+    }
+    worker->busy = false;
+    pthread_cond_broadcast(&cgi_pool_idle);
+    pthread_mutex_unlock(&cgi_pool_mutex);
+
+    if (pid != 0) {
+        cgi_worker_reap(pid);
+    }
+}
+
+/*
+ * serve_pooled - run a request on a pooled CGI worker, relaying its output
+ * to the client
+ *
+ * Returns -1 if no output was sent and the request should be run with
+ * fork/exec instead, or 0 otherwise.
+ */
+int serve_pooled(int fd, char *filename, char *cgiargs) {
+    cgi_worker *worker = cgi_pool_acquire(filename);
+    if (worker == NULL) {
+        return -1;
+    }
+
+    cgi_frame_header header = {
+        .type = CGI_FRAME_REQUEST,
+        .len = (uint32_t) strlen(cgiargs),
+    };
+    if (rio_writen(worker->fd, &header, sizeof(header)) < 0
+            || rio_writen(worker->fd, cgiargs, header.len) < 0) {
+        cgi_pool_release(worker, filename, true, false);
+        return -1;
+    }
+
+    char buf[CGI_FRAME_MAX];
+    bool failed = false;
+    bool relayed = false;       // Was any output sent to the client?
+    bool client_ok = true;
+    while (true) {
+        if (rio_readn(worker->fd, &header, sizeof(header))
+                    != (ssize_t) sizeof(header)
+                || header.len > CGI_FRAME_MAX
+                || rio_readn(worker->fd, buf, header.len)
+                    != (ssize_t) header.len) {
+            fprintf(stderr, "CGI worker for \"%s\" failed\n", filename);
+            failed = true;
+            break;
+        }
+        if (header.type == CGI_FRAME_END) {
+            break;
+        }
+
+        relayed = true;
+
+        /* Keep draining the worker even if the client went away */
+        if (client_ok && rio_writen(fd, buf, header.len) < 0) {
+            fprintf(stderr, "Error writing CGI response to client\n");
+            client_ok = false;
+        }
+    }
+
+    cgi_pool_release(worker, filename, failed, relayed);
+    return failed && !relayed ? -1 : 0;
 }
 
 /*
@@ -194,6 +804,7 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
     char buf[MAXLINE];
     size_t buflen;
     char *emptylist[] = { NULL };
+    char query[MAXLINE + sizeof("QUERY_STRING=")];
 
     /* Format first part of HTTP response */
     buflen = snprintf(buf, MAXLINE,
@@ -209,29 +820,55 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
         return;
     }
 
-    pid_t pid = fork();
-    if (pid == 0) { /* Child */
+    if (cgi_pool_size > 0 && serve_pooled(fd, filename, cgiargs) == 0) {
+        return;
+    }
+
+    /*
+     * Build the CGI environment before forking: other threads may hold the
+     * malloc lock, so the child must not call setenv
+     */
+    size_t nenv = 0;
+    while (environ[nenv] != NULL) {
+        nenv++;
+    }
+    char **envp = malloc((nenv + 2) * sizeof(char *));
+    if (envp == NULL) {
+        fprintf(stderr, "Out of memory running \"%s\"\n", filename);
+        return;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < nenv; i++) {
         /* Real server would set all CGI vars here */
-        setenv("QUERY_STRING", cgiargs, 1);
+        if (strncmp(environ[i], "QUERY_STRING=", strlen("QUERY_STRING=")) != 0) {
+            envp[n++] = environ[i];
+        }
+    }
+    snprintf(query, sizeof(query), "QUERY_STRING=%s", cgiargs);
+    envp[n++] = query;
+    envp[n] = NULL;
 
+    pid_t pid = fork();
+    if (pid == 0) { /* Child */
         /* Redirect stdout to client */
         dup2(fd, STDOUT_FILENO);
         close(fd);
 
         /* Run CGI program */
-        if (execve(filename, emptylist, environ) < 0) {
+        if (execve(filename, emptylist, envp) < 0) {
             perror(filename);
-            exit(1);  /* Exit child process */
+            _exit(1);  /* Exit child process */
         }
     }
-    else if (pid == -1) {
+    free(envp);
+    if (pid == -1) {
         perror("fork");
         return;
     }
 
-    /* Parent waits for and reaps child */
-    if (wait(NULL) < 0) {
-        perror("wait");
+    /* Parent waits for and reaps its own child */
+    if (waitpid(pid, NULL, 0) < 0) {
+        perror("waitpid");
         return;
     }
 }
@@ -398,7 +1035,7 @@ void serve(client_info *client) {
                         "Tiny couldn't read the file");
             return;
         }
-        serve_static(client->connfd, filename, sbuf.st_size);
+        serve_static(client->connfd, filename, &sbuf);
     } else { /* Serve dynamic content */
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
             clienterror(client->connfd, "403", "Forbidden",
@@ -409,21 +1046,108 @@ void serve(client_info *client) {
     }
 }
 
+/*
+ * connq_insert - add an accepted connection to the queue, blocking while
+ * the queue is full
+ */
+void connq_insert(conn_queue *q, const client_info *client) {
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == CONNQ_SIZE) {
+        pthread_cond_wait(&q->not_full, &q->mutex);
+    }
+    q->buf[(q->head + q->count) % CONNQ_SIZE] = *client;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/*
+ * connq_remove - take the oldest connection from the queue, blocking while
+ * the queue is empty
+ */
+void connq_remove(conn_queue *q, client_info *client) {
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == 0) {
+        pthread_cond_wait(&q->not_empty, &q->mutex);
+    }
+    *client = q->buf[q->head];
+    q->head = (q->head + 1) % CONNQ_SIZE;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/*
+ * worker - serve connections from the queue until the server exits
+ */
+void *worker(void *vargp) {
+    (void) vargp;
+
+    while (true) {
+        client_info client;
+        connq_remove(&connq, &client);
+        serve(&client);
+        close(client.connfd);
+    }
+
+    return NULL;
+}
+
 int main(int argc, char **argv) {
     int listenfd;
+    long nthreads = 0;  /* 0 serves connections from the main thread */
+    int opt;
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "t:c:")) != -1) {
+        char *end;
+        long n;
+        switch (opt) {
+        case 't':
+            nthreads = strtol(optarg, &end, 10);
+            if (*end == '\0' && nthreads > 0 && nthreads <= 1024) {
+                break;
+            }
+            goto usage;
+        case 'c':
+            n = strtol(optarg, &end, 10);
+            if (*end == '\0' && n > 0 && n <= 1024) {
+                cgi_pool_size = (size_t) n;
+                break;
+            }
+            goto usage;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+usage:
+        fprintf(stderr, "usage: %s [-t <threads>] [-c <cgi workers>] <port>\n",
+                argv[0]);
         exit(1);
     }
 
-    listenfd = open_listenfd(argv[1]);
+    /* A client hanging up must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    listenfd = open_listenfd(argv[optind]);
     if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
+        fprintf(stderr, "Failed to listen on port: %s\n", argv[optind]);
         exit(1);
     }
 
+    /* Keep sockets out of CGI programs, pooled workers outlive requests */
+    fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+
+    for (long i = 0; i < nthreads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker, NULL) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+
     while (1) {
         /* Allocate space on the stack for client info */
         client_info client_data;
@@ -433,14 +1157,18 @@ int main(int argc, char **argv) {
         client->addrlen = sizeof(client->addr);
 
         /* accept() will block until a client connects to the port */
-        client->connfd = accept(listenfd,
-                (SA *) &client->addr, &client->addrlen);
+        client->connfd = accept4(listenfd,
+                (SA *) &client->addr, &client->addrlen, SOCK_CLOEXEC);
         if (client->connfd < 0) {
             perror("accept");
             continue;
         }
 
         /* Connection is established; serve client */
+        if (nthreads > 0) {
+            connq_insert(&connq, client);
+            continue;
+        }
         serve(client);
         close(client->connfd);
     }